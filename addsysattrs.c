@@ -35,6 +35,13 @@
 #include <ctype.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
 #include <gensio/gensio.h>
 #include <gensio/argvutils.h>
 #include "ser2net.h"
@@ -43,6 +50,225 @@
 #define SYSFS_TTY_BASE "/sys/class/tty/"
 #define SYSFS_TTY_BASE_LEN 15
 
+/*
+ * Cache of what has been read from sysfs, so ports sharing a USB
+ * device (or being set up again on a reload) don't read the same
+ * files again.  Entries are keyed by the canonical sysfs path of the
+ * attribute file or the tty class link.  target is the attribute
+ * value (NULL if the attribute isn't there) or the canonical link
+ * target.
+ *
+ * The kernel's uevents are used to invalidate the cache.  Anything
+ * at or below the device path of an event is dropped, as is any link
+ * pointing there.  The events are read before each lookup, that's
+ * the only time the cache is used.  If the socket can't be opened
+ * nothing is cached, and if events were lost everything is dropped.
+ */
+#define SYSFS_CACHE_HASH_SIZE 256
+
+struct sysfs_cent {
+    char *path;
+    char *target;
+    struct sysfs_cent *next;
+};
+
+static struct sysfs_cent *sysfs_cache[SYSFS_CACHE_HASH_SIZE];
+static int uevent_fd = -1;
+static bool uevent_tried;
+
+#ifdef USE_PTHREADS
+static pthread_mutex_t sysfs_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define CACHE_LOCK() pthread_mutex_lock(&sysfs_cache_lock)
+#define CACHE_UNLOCK() pthread_mutex_unlock(&sysfs_cache_lock)
+#else
+#define CACHE_LOCK() do { } while (0)
+#define CACHE_UNLOCK() do { } while (0)
+#endif
+
+static unsigned int
+sysfs_hash(const char *s)
+{
+    unsigned int h = 2166136261U; /* FNV-1a */
+
+    while (*s) {
+	h ^= (unsigned char) *s++;
+	h *= 16777619U;
+    }
+    return h % SYSFS_CACHE_HASH_SIZE;
+}
+
+static void
+sysfs_cent_free(struct sysfs_cent *e)
+{
+    free(e->path);
+    if (e->target)
+	free(e->target);
+    free(e);
+}
+
+/* Is path equal to or below dir? */
+static bool
+path_under(const char *path, const char *dir, size_t dirlen)
+{
+    return (strncmp(path, dir, dirlen) == 0 &&
+	    (path[dirlen] == '\0' || path[dirlen] == '/'));
+}
+
+/* Drop everything, or everything related to dir if it's not NULL. */
+static void
+sysfs_cache_drop(const char *dir)
+{
+    struct sysfs_cent **prev, *e;
+    size_t dirlen = dir ? strlen(dir) : 0;
+    unsigned int i;
+
+    for (i = 0; i < SYSFS_CACHE_HASH_SIZE; i++) {
+	prev = &sysfs_cache[i];
+	while ((e = *prev)) {
+	    if (!dir || path_under(e->path, dir, dirlen) ||
+			(e->target && path_under(e->target, dir, dirlen))) {
+		*prev = e->next;
+		sysfs_cent_free(e);
+	    } else {
+		prev = &e->next;
+	    }
+	}
+    }
+}
+
+static void
+uevent_open(void)
+{
+    struct sockaddr_nl addr;
+    int fd;
+
+    uevent_tried = true;
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		NETLINK_KOBJECT_UEVENT);
+    if (fd < 0)
+	return;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1; /* Kernel events. */
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+	close(fd);
+	return;
+    }
+    uevent_fd = fd;
+}
+
+/*
+ * Read the pending uevents and drop what they touch.  Called with the
+ * cache lock held.  Returns false if nothing can be cached.
+ */
+static bool
+sysfs_cache_update(void)
+{
+    char buf[4096], dir[PATH_MAX];
+    const char *devpath;
+    ssize_t rv;
+
+    if (!uevent_tried)
+	uevent_open();
+    if (uevent_fd < 0)
+	return false;
+
+    for (;;) {
+	rv = recv(uevent_fd, buf, sizeof(buf) - 1, 0);
+	if (rv < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == ENOBUFS) {
+		/* Events were lost, can't trust anything. */
+		sysfs_cache_drop(NULL);
+		continue;
+	    }
+	    break;
+	}
+	buf[rv] = '\0';
+
+	/* The message starts with "<action>@<devpath>". */
+	devpath = strchr(buf, '@');
+	if (!devpath || devpath[1] != '/')
+	    continue;
+	snprintf(dir, sizeof(dir), "/sys%s", devpath + 1);
+	sysfs_cache_drop(dir);
+    }
+    return true;
+}
+
+static struct sysfs_cent *
+sysfs_cache_find(const char *path)
+{
+    struct sysfs_cent *e;
+
+    for (e = sysfs_cache[sysfs_hash(path)]; e; e = e->next) {
+	if (strcmp(e->path, path) == 0)
+	    return e;
+    }
+    return NULL;
+}
+
+static void
+sysfs_cache_add(const char *path, const char *target)
+{
+    struct sysfs_cent *e;
+    unsigned int h;
+
+    e = malloc(sizeof(*e));
+    if (!e)
+	return;
+    e->path = strdup(path);
+    e->target = target ? strdup(target) : NULL;
+    if (!e->path || (target && !e->target)) {
+	if (e->path)
+	    free(e->path);
+	if (e->target)
+	    free(e->target);
+	free(e);
+	return;
+    }
+    h = sysfs_hash(path);
+    e->next = sysfs_cache[h];
+    sysfs_cache[h] = e;
+}
+
+/*
+ * Remove "." and ".." components from an absolute path without
+ * touching the filesystem.  The sysfs class links are relative links
+ * to real directories, so this gives the canonical path.
+ */
+static void
+canon_path(char *path)
+{
+    char *in = path, *out = path;
+
+    while (*in) {
+	while (*in == '/')
+	    in++;
+	if (in[0] == '.' && (in[1] == '/' || in[1] == '\0')) {
+	    in++;
+	    continue;
+	}
+	if (in[0] == '.' && in[1] == '.' && (in[2] == '/' || in[2] == '\0')) {
+	    in += 2;
+	    while (out > path && *(out - 1) != '/')
+		out--;
+	    if (out > path)
+		out--;
+	    continue;
+	}
+	if (!*in)
+	    break;
+	*out++ = '/';
+	while (*in && *in != '/')
+	    *out++ = *in++;
+    }
+    if (out == path)
+	*out++ = '/';
+    *out = '\0';
+}
+
 static const char *
 get_base_str(const char *devname, unsigned int *len)
 {
@@ -75,6 +301,7 @@ add_attr(struct absout *eout, const char *portname,
     char *s, buf[1024];
     ssize_t rv;
     int fd;
+    bool cache = false;
 
     s = gensio_alloc_sprintf(so, "%s/%s", path, sysfsname);
     if (!s) {
@@ -84,11 +311,34 @@ add_attr(struct absout *eout, const char *portname,
 	return;
     }
 
+    CACHE_LOCK();
+    if (sysfs_cache_update()) {
+	struct sysfs_cent *e = sysfs_cache_find(s);
+
+	if (e) {
+	    if (e->target)
+		strcpy(buf, e->target);
+	    CACHE_UNLOCK();
+	    so->free(so, s);
+	    if (!e->target)
+		return;
+	    goto add;
+	}
+	cache = true;
+    }
+    CACHE_UNLOCK();
+
     fd = open(s, O_RDONLY);
-    so->free(so, s);
-    if (fd < 0)
+    if (fd < 0) {
 	/* Some of these are options, just ignore open errors. */
+	if (cache) {
+	    CACHE_LOCK();
+	    sysfs_cache_add(s, NULL);
+	    CACHE_UNLOCK();
+	}
+	so->free(so, s);
 	return;
+    }
  retry:
     rv = read(fd, buf, sizeof(buf) - 1);
     if (rv < 0) {
@@ -97,19 +347,27 @@ add_attr(struct absout *eout, const char *portname,
 	eout->out(eout,
 		  "Device %s: Unable to read contents of %s: %s\n",
 		  portname, sysfsname, strerror(errno));
-	goto out;
+	close(fd);
+	so->free(so, s);
+	return;
     }
+    close(fd);
     while (rv > 0 && isspace(buf[rv - 1]))
 	rv--;
     buf[rv] = '\0';
+    if (cache) {
+	CACHE_LOCK();
+	sysfs_cache_add(s, buf);
+	CACHE_UNLOCK();
+    }
+    so->free(so, s);
 
+ add:
     rv = gensio_argv_sappend(so, txt, args, argc, "%s=%s", sysfsname, buf);
     if (rv < 0)
 	eout->out(eout,
 		  "Device %s: Unable add txt contents for %s: %s\n",
 		  portname, sysfsname, gensio_err_to_str(rv));
- out:
-    close(fd);
 }
 
 void
@@ -219,6 +477,7 @@ add_sys_attrs(struct absout *eout, const char *portname,
     unsigned int len;
     char path[PATH_MAX], path2[PATH_MAX], devstr[128];
     ssize_t rv;
+    bool cache = false;
 
     /* Find the /dev/xxx string in the device name. */
     d = get_base_str(devname, &len);
@@ -253,6 +512,19 @@ add_sys_attrs(struct absout *eout, const char *portname,
     snprintf(path2, sizeof(path2), "%s%s", SYSFS_TTY_BASE, devstr);
 
     /* The tty class is a link, find the real location. */
+    CACHE_LOCK();
+    if (sysfs_cache_update()) {
+	struct sysfs_cent *e = sysfs_cache_find(path2);
+
+	if (e) {
+	    strcpy(path, e->target);
+	    CACHE_UNLOCK();
+	    goto have_path;
+	}
+	cache = true;
+    }
+    CACHE_UNLOCK();
+
     memcpy(path, SYSFS_TTY_BASE, SYSFS_TTY_BASE_LEN);
     rv = readlink(path2, path + SYSFS_TTY_BASE_LEN,
 		  sizeof(path) - SYSFS_TTY_BASE_LEN - 1);
@@ -263,6 +535,15 @@ add_sys_attrs(struct absout *eout, const char *portname,
 	return;
     }
     path[rv + SYSFS_TTY_BASE_LEN] = '\0';
+    canon_path(path);
+    if (cache) {
+	/* Failures aren't cached, the device may just not be there yet. */
+	CACHE_LOCK();
+	sysfs_cache_add(path2, path);
+	CACHE_UNLOCK();
+    }
+
+ have_path:
 
     if (strstr(path, "/usb")) {
 	add_usb_attrs(eout, portname, devstr, path, txt, args, argc);
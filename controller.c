@@ -53,6 +53,26 @@ static int num_controller_ports = 0;	/* How many control connections
 
 #define INBUF_SIZE 2048	/* The size of the maximum input command or YAML doc. */
 
+/*
+ * Output is queued in a chain of fixed-size chunks and written with
+ * scatter/gather, so appending never moves data that is already
+ * queued.  Command output is not limited, input is held off until it
+ * is written, so a command can only queue its own reply, however
+ * long the listing.  Monitor output is refused once the queue passes
+ * the monitor's limit, at most OUTBUF_MAX, this keeps a slow reader
+ * of a busy monitor from using unbounded memory.
+ */
+#define OUTCHUNK_SIZE	4096
+#define OUTBUF_MAX	(1024 * 1024)
+#define OUTBUF_MAX_SG	16
+
+struct cntlr_outchunk {
+    struct cntlr_outchunk *next;
+    unsigned int pos;			/* Start of unwritten data. */
+    unsigned int len;			/* End of data. */
+    char data[OUTCHUNK_SIZE];
+};
+
 char *prompt = "-> ";
 
 /* This data structure is kept for each control connection. */
@@ -69,15 +89,15 @@ typedef struct controller_info {
 
     struct gensio_lock *outlock;
     bool yaml;				/* Am I in YAML output mode? */
-    char *outbuf;			/* The output buffer, NULL if
+    struct cntlr_outchunk *outhead;	/* The output queue, NULL if
 					   no output. */
-    int  outbufsize;			/* Total size of the memory
-					   allocated in outbuf. */
-    int  outbuf_pos;			/* The current position in the
-					   output buffer. */
-    int  outbuf_count;			/* The number of bytes
-					   (starting at outbuf_pos)
+    struct cntlr_outchunk *outtail;
+    struct cntlr_outchunk *outspare;	/* A free chunk kept for reuse. */
+    unsigned int outbuf_count;		/* The number of bytes queued
 					   left to transmit. */
+    unsigned int monitor_limit;		/* Set when a monitor is waiting
+					   for the output to drain below
+					   a quarter of this. */
     unsigned int indent;
 
     bool yamlin;			/* Am I in YAML input mode? */
@@ -119,10 +139,16 @@ controller_close_done(struct gensio *net, void *cb_data)
     so->free_lock(cntlr->lock);
     so->free_lock(cntlr->outlock);
 
-    if (cntlr->outbuf != NULL) {
-	free(cntlr->outbuf);
+    while (cntlr->outhead) {
+	struct cntlr_outchunk *chunk = cntlr->outhead;
+
+	cntlr->outhead = chunk->next;
+	free(chunk);
     }
-    cntlr->outbuf = NULL;
+    cntlr->outtail = NULL;
+    if (cntlr->outspare)
+	free(cntlr->outspare);
+    cntlr->outspare = NULL;
 
     /* Remove it from the linked list. */
     prev = NULL;
@@ -180,70 +206,69 @@ controller_indent(struct controller_info *cntlr, int amount)
     cntlr->indent += amount;
 }
 
-/* Send some output to the control connection.  This allocates and
-   free a buffer in blocks of 1024 and increases the size of the
-   buffer as necessary. */
-static void
-controller_raw_output(struct controller_info *cntlr,
-		      const char *data, int count)
+static struct cntlr_outchunk *
+controller_alloc_chunk(struct controller_info *cntlr)
 {
-    if (cntlr->outbuf != NULL) {
-	/* Already outputting data, just add more onto it. */
-	int  new_size = cntlr->outbuf_count + count;
-
-	if (new_size <= cntlr->outbufsize) {
-	    /* It will fit into the current buffer, just move things
-	       around and append it. */
-	    if (cntlr->outbuf_pos > 0) {
-		int i;
-
-		for (i = 0; i < cntlr->outbuf_count; i++) {
-		    cntlr->outbuf[i] = cntlr->outbuf[cntlr->outbuf_pos + i];
-		}
-	    }
-	    memcpy(&(cntlr->outbuf[cntlr->outbuf_count]), data, count);
-	} else {
-	    /* We need to allocate a larger buffer. */
-	    char *newbuf;
+    struct cntlr_outchunk *chunk = cntlr->outspare;
 
-	    /* Allocate the next even multiple of 1024 bytes. */
-	    new_size = ((new_size / 1024) * 1024) + 1024;
-	    newbuf = malloc(new_size);
+    if (chunk)
+	cntlr->outspare = NULL;
+    else
+	chunk = malloc(sizeof(*chunk));
+    if (chunk) {
+	chunk->next = NULL;
+	chunk->pos = 0;
+	chunk->len = 0;
+    }
+    return chunk;
+}
 
-	    if (newbuf == NULL) {
-		/* Out of memory, just ignore the request */
-		return;
-	    }
+/* Append data to the output chunks, allocating new chunks as
+   necessary. */
+static void
+controller_queue_output(struct controller_info *cntlr,
+			const char *data, int count)
+{
+    struct cntlr_outchunk *chunk;
+    unsigned int left;
 
-	    cntlr->outbufsize = new_size;
+    if (count <= 0)
+	return;
 
-	    /* Copy all the data into a new buffer. */
-	    memcpy(newbuf,
-		   &(cntlr->outbuf[cntlr->outbuf_pos]),
-		   cntlr->outbuf_count);
-	    memcpy(newbuf + cntlr->outbuf_count, data, count);
-	    free(cntlr->outbuf);
-	    cntlr->outbuf = newbuf;
-	}
-	cntlr->outbuf_pos = 0;
-	cntlr->outbuf_count += count;
-    } else {
-	/* We are starting a new buffer, just get it. */
-	char *newbuf;
-	int  new_size = ((count / 1024) * 1024) + 1024;
-
-	newbuf = malloc(new_size);
-	if (newbuf == NULL) {
-	    /* Out of memory, just ignore thre request */
-	    return;
+    while (count > 0) {
+	chunk = cntlr->outtail;
+	if (!chunk || chunk->len == OUTCHUNK_SIZE) {
+	    chunk = controller_alloc_chunk(cntlr);
+	    if (!chunk)
+		/* Out of memory, just ignore the rest of the request */
+		break;
+	    if (cntlr->outtail)
+		cntlr->outtail->next = chunk;
+	    else
+		cntlr->outhead = chunk;
+	    cntlr->outtail = chunk;
 	}
+	left = OUTCHUNK_SIZE - chunk->len;
+	if (left > (unsigned int) count)
+	    left = count;
+	memcpy(chunk->data + chunk->len, data, left);
+	chunk->len += left;
+	cntlr->outbuf_count += left;
+	data += left;
+	count -= left;
+    }
+}
 
-	cntlr->outbufsize = new_size;
+/* Send some output to the control connection.  Input is held off
+   until the output has been written. */
+static void
+controller_raw_output(struct controller_info *cntlr,
+		      const char *data, int count)
+{
+    bool start = cntlr->outhead == NULL;
 
-	memcpy(newbuf, data, count);
-	cntlr->outbuf = newbuf;
-	cntlr->outbuf_pos = 0;
-	cntlr->outbuf_count = count;
+    controller_queue_output(cntlr, data, count);
+    if (start && cntlr->outhead) {
 	gensio_set_read_callback_enable(cntlr->net, false);
 	gensio_set_write_callback_enable(cntlr->net, true);
     }
@@ -341,12 +366,42 @@ void controller_outs(struct controller_info *cntlr,
 }
 
 
-/* Write some data directly to the controllers output port. */
-void
-controller_write(struct controller_info *cntlr, const char *data,
-		 gensiods count)
+int
+controller_monitor_write(struct controller_info *cntlr,
+			 const char *hdr, gensiods hdrlen,
+			 const char *data, gensiods count,
+			 unsigned int limit, bool *behind)
 {
-    gensio_write(cntlr->net, NULL, data, count, NULL);
+    int rv = 0;
+
+    so->lock(cntlr->outlock);
+    if (cntlr->in_shutdown) {
+	rv = GE_NOTREADY;
+	goto out;
+    }
+    if (limit > OUTBUF_MAX)
+	limit = OUTBUF_MAX;
+    if (cntlr->outbuf_count + hdrlen + count > limit) {
+	cntlr->monitor_limit = limit;
+	*behind = true;
+	rv = GE_NOMEM;
+	goto out;
+    }
+
+    /*
+     * Unlike command output, don't turn off input here, the user
+     * must be able to stop a busy monitor.
+     */
+    if (!cntlr->outhead)
+	gensio_set_write_callback_enable(cntlr->net, true);
+    controller_queue_output(cntlr, hdr, hdrlen);
+    controller_queue_output(cntlr, data, count);
+    *behind = cntlr->outbuf_count > limit / 2;
+    if (*behind)
+	cntlr->monitor_limit = limit;
+ out:
+    so->unlock(cntlr->outlock);
+    return rv;
 }
 
 static char *help_str =
@@ -357,20 +412,24 @@ static char *help_str =
 "       line processing is done.  Some commands are disabled.  Output\r\n"
 "       is yaml, beginning with --- and ending with ... for each\r\n"
 "       response to a command.\r\n"
-"monitor <type> <tcp port> - display all the input for a given port on\r\n"
-"       the calling control port.  Only one direction may be monitored\r\n"
-"       at a time.  The type field may be 'tcp' or 'term' and specifies\r\n"
-"       whether to monitor data from the net port or from the serial port\r\n"
-"       Note that data monitoring is best effort, if the controller port\r\n"
-"       cannot keep up the data will be silently dropped.  A controller\r\n"
-"       may only monitor one thing and a port may only be monitored by\r\n"
-"       one controller.\r\n"
+"monitor <type> <tcp port> [<option> [<option>]] - display all the input\r\n"
+"       for a given port on the calling control port.  The type field may\r\n"
+"       be 'tcp', 'term' or 'both' and specifies whether to monitor data\r\n"
+"       from the net port, from the serial port, or both.  Options are\r\n"
+"       'timestamp' to mark each block of data with the time, 'drop'\r\n"
+"       (the default) to drop data the controller can't keep up with,\r\n"
+"       and 'block[=<msec>]' to stop reading the port for up to msec\r\n"
+"       milliseconds (default 1000) instead.  Drops are reported in the\r\n"
+"       output.  A controller may only monitor one port, a port may be\r\n"
+"       monitored by any number of controllers.\r\n"
 "monitor stop - stop the current monitor.\r\n"
 "disconnect <tcp port> - disconnect the tcp connection on the port.\r\n"
 "showport [<tcp port>] - Show information about a port. If no port is\r\n"
 "       given, all ports are displayed.\r\n"
 "showshortport [<tcp port>] - Show information about a port in a one-line\r\n"
 "       format. If no port is given, all ports are displayed.\r\n"
+"showportstats [<tcp port>] - Show data path statistics and latency\r\n"
+"       histograms for a port. If no port is given, all ports are displayed.\r\n"
 "setporttimeout <tcp port> <timeout> - Set the amount of time in seconds\r\n"
 "       before the port connection will be shut down if no activity\r\n"
 "       has been seen on the port.\r\n"
@@ -457,6 +516,10 @@ process_command(controller_info_t *cntlr, const char *cmd, const char *id,
 	start_maint_op();
 	showports(cntlr, parms[0], cntlr->yaml);
 	end_maint_op();
+    } else if (strcmp(cmd, "showportstats") == 0) {
+	start_maint_op();
+	showportstats(cntlr, parms[0], cntlr->yaml);
+	end_maint_op();
     } else if (!cntlr->yaml && strcmp(cmd, "showshortport") == 0) {
 	start_maint_op();
 	showshortports(cntlr, parms[0]);
@@ -484,7 +547,9 @@ process_command(controller_info_t *cntlr, const char *cmd, const char *id,
 	    }
 	    start_maint_op();
 	    cntlr->monitor_port_id = data_monitor_start(cntlr,
-							parms[0], parms[1]);
+							parms[0], parms[1],
+							(const char **)
+							parms + 2);
 	    end_maint_op();
 	}
     } else if (strcmp(cmd, "disconnect") == 0) {
@@ -943,16 +1008,24 @@ static void
 controller_write_ready(struct gensio *net)
 {
     controller_info_t *cntlr = gensio_get_user_data(net);
+    struct cntlr_outchunk *chunk;
+    struct gensio_sg sg[OUTBUF_MAX_SG];
+    gensiods sglen = 0, write_count, len;
+    void *monitor_id = NULL;
     int err;
-    gensiods write_count;
 
     so->lock(cntlr->outlock);
     if (cntlr->in_shutdown)
 	goto out;
 
-    err = gensio_write(net, &write_count,
-		       &(cntlr->outbuf[cntlr->outbuf_pos]),
-		       cntlr->outbuf_count, NULL);
+    for (chunk = cntlr->outhead; chunk && sglen < OUTBUF_MAX_SG;
+	 chunk = chunk->next) {
+	sg[sglen].buf = chunk->data + chunk->pos;
+	sg[sglen].buflen = chunk->len - chunk->pos;
+	sglen++;
+    }
+
+    err = gensio_write_sg(net, &write_count, sg, sglen, NULL);
     if (err == EAGAIN) {
 	/* This again was due to O_NONBso->lock, just ignore it. */
     } else if (err == EPIPE) {
@@ -965,18 +1038,38 @@ controller_write_ready(struct gensio *net)
     }
 
     cntlr->outbuf_count -= write_count;
-    if (cntlr->outbuf_count != 0) {
-	/* We didn't write all the data, continue writing. */
-	cntlr->outbuf_pos += write_count;
-    } else {
+    while (write_count > 0) {
+	chunk = cntlr->outhead;
+	len = chunk->len - chunk->pos;
+	if (write_count < len) {
+	    chunk->pos += write_count;
+	    break;
+	}
+	write_count -= len;
+	cntlr->outhead = chunk->next;
+	if (!cntlr->outhead)
+	    cntlr->outtail = NULL;
+	if (cntlr->outspare)
+	    free(chunk);
+	else
+	    cntlr->outspare = chunk;
+    }
+
+    if (cntlr->outbuf_count == 0) {
 	/* We are done writing, turn the reader back on. */
-	free(cntlr->outbuf);
-	cntlr->outbuf = NULL;
 	gensio_set_read_callback_enable(net, true);
 	gensio_set_write_callback_enable(net, false);
     }
+    if (cntlr->monitor_limit &&
+		cntlr->outbuf_count <= cntlr->monitor_limit / 4) {
+	cntlr->monitor_limit = 0;
+	monitor_id = cntlr->monitor_port_id;
+    }
  out:
     so->unlock(cntlr->outlock);
+    if (monitor_id)
+	/* Must be done without outlock, this takes the port lock. */
+	data_monitor_drained(cntlr, monitor_id);
     return;
 
  out_fail:
@@ -1043,7 +1136,10 @@ controller_acc_new_child(struct gensio *net)
     gensio_set_callback(net, controller_io_event, cntlr);
 
     cntlr->inbuf_count = 0;
-    cntlr->outbuf = NULL;
+    cntlr->outhead = NULL;
+    cntlr->outtail = NULL;
+    cntlr->outspare = NULL;
+    cntlr->outbuf_count = 0;
     cntlr->monitor_port_id = NULL;
     cntlr->parse_pos = 1; /* Assume we start with a \n. */
 
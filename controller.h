@@ -27,6 +27,7 @@
 #define CONTROLLER
 
 #include <stdarg.h>
+#include <stdbool.h>
 
 #define CONTROLLER_INVALID_TCP_SPEC	-1
 #define CONTROLLER_CANT_OPEN_PORT	-2
@@ -53,9 +54,17 @@ int controller_outputf(struct controller_info *cntlr,
 int controller_voutputf(struct controller_info *cntlr,
 			const char *field, const char *str, va_list ap);
 
-/* Write some data directly to the controllers output port. */
-void controller_write(struct controller_info *cntlr,
-		      const char *data, gensiods count);
+/*
+ * Queue monitor data, with an optional header before it, for output
+ * on the controller.  If it won't fit under limit bytes of queued
+ * output, nothing is queued and GE_NOMEM is returned.  *behind is set
+ * if the output is over half the limit, data_monitor_drained() is
+ * called when it has drained after that.
+ */
+int controller_monitor_write(struct controller_info *cntlr,
+			     const char *hdr, gensiods hdrlen,
+			     const char *data, gensiods count,
+			     unsigned int limit, bool *behind);
 
 /*  output a string  */
 void controller_outs(struct controller_info *cntlr,
@@ -52,6 +52,95 @@ static int handle_net_event(struct gensio *net, void *user_data,
 			    unsigned char *buf, gensiods *buflen,
 			    const char *const *auxdata);
 
+static void
+dev_read_stall_start(port_info_t *port)
+{
+    port->o->get_monotonic_time(port->o, &port->stats.dev_read_stall_start);
+    port->stats.dev_read_stalled = true;
+    port->stats.dev_read_stalls++;
+}
+
+static void
+dev_read_stall_end(port_info_t *port)
+{
+    gensio_time now;
+
+    if (!port->stats.dev_read_stalled)
+	return;
+    port->o->get_monotonic_time(port->o, &now);
+    port_hist_add(&port->stats.dev_read_stall,
+		  sub_time(&now, &port->stats.dev_read_stall_start));
+    port->stats.dev_read_stalled = false;
+}
+
+/*
+ * Length and delimiter framers hold the data until the frame is done,
+ * chardelay_max is the only timer, to get out partial frames.
+ */
+static bool
+framer_holds_data(port_info_t *port)
+{
+    return (port->framer.type == FRAMER_LENGTH ||
+	    port->framer.type == FRAMER_DELIM);
+}
+
+/*
+ * Don't adapt chardelay until we have seen enough gaps to have an
+ * idea of what they look like.
+ */
+#define CHARDELAY_ADAPT_SAMPLES	16
+
+/*
+ * Measure the time since the last device read and adjust chardelay.
+ * A gap goes with the bursts or the idle times, whichever average it
+ * is closer to.  The delay is set to cover nearly all the gaps inside
+ * a burst (average plus four deviations, like TCP's retransmit timer),
+ * but never more than halfway to the idle gap, and within
+ * chardelay-min and chardelay-max.
+ */
+static void
+chardelay_adapt(port_info_t *port, gensio_time *now)
+{
+    int gap, err, delay, mid;
+
+    if (!port->last_dev_read_valid) {
+	port->last_dev_read = *now;
+	port->last_dev_read_valid = true;
+	return;
+    }
+
+    gap = sub_time(now, &port->last_dev_read);
+    port->last_dev_read = *now;
+    if (gap < 0)
+	gap = 0;
+    if (gap > (int) port->chardelay_max)
+	gap = port->chardelay_max;
+
+    if (abs(gap - port->gap_burst_avg) <= abs(gap - port->gap_idle_avg)) {
+	err = gap - port->gap_burst_avg;
+	port->gap_burst_avg += err / 8;
+	port->gap_burst_dev += (abs(err) - port->gap_burst_dev) / 4;
+    } else {
+	port->gap_idle_avg += (gap - port->gap_idle_avg) / 8;
+    }
+
+    if (port->gap_samples < CHARDELAY_ADAPT_SAMPLES) {
+	port->gap_samples++;
+	return;
+    }
+
+    delay = port->gap_burst_avg + 4 * port->gap_burst_dev;
+    mid = (port->gap_burst_avg + port->gap_idle_avg) / 2;
+    if (delay > mid)
+	delay = mid;
+    if (delay < (int) port->chardelay_min)
+	delay = port->chardelay_min;
+    if (delay > (int) port->chardelay_max)
+	delay = port->chardelay_max;
+    port->chardelay = delay;
+    port_hist_add(&port->stats.chardelay, delay);
+}
+
 static int
 all_net_connectbacks_done(port_info_t *port)
 {
@@ -69,68 +158,344 @@ static bool
 any_net_data_to_write(port_info_t *port)
 {
     net_info_t *netcon;
+    struct gensio_link *l, *l2;
 
-    for_each_connection(port, netcon) {
-	if (!netcon->net)
-	    continue;
+    for_each_active_connection(port, netcon, l, l2) {
 	if (netcon->write_pos < port->dev_to_net.cursize)
 	    return true;
     }
     return false;
 }
 
+/*
+ * Move the data in dev_to_net into the fanout ring and queue it on
+ * every connection.  The device keeps reading unless a connection
+ * is too far behind and the policy is to block.
+ */
+static void
+fanout_net_send(port_info_t *port)
+{
+    struct fanout_ring *ring = &port->dev_to_net_ring;
+    struct fanout_chunk *chunk;
+    net_info_t *netcon;
+    struct gensio_link *l, *l2;
+    bool blocked = false;
+
+    if (port->dev_to_net.cursize == 0)
+	return;
+
+    chunk = fanout_ring_add(ring, port->dev_to_net.buf,
+			    port->dev_to_net.cursize);
+    if (!chunk) {
+	syslog(LOG_ERR, "Out of memory queueing data on port %s,"
+	       " data dropped", port->name);
+	gbuf_reset(&port->dev_to_net);
+	return;
+    }
+    gbuf_reset(&port->dev_to_net);
+
+    for_each_active_connection(port, netcon, l, l2) {
+	if (netcon->closing)
+	    continue;
+	fanout_cursor_queue(&netcon->fanout, chunk);
+	gensio_set_write_callback_enable(netcon->net, true);
+	if (netcon->fanout.queued <= port->fanout_backlog)
+	    continue;
+
+	switch (port->slow_client) {
+	case SLOW_CLIENT_DROP:
+	    netcon->bytes_dropped += fanout_cursor_trim(ring, &netcon->fanout,
+							port->fanout_backlog);
+	    break;
+
+	case SLOW_CLIENT_DISCONNECT:
+	    shutdown_one_netcon(netcon, "client too slow");
+	    break;
+
+	default:
+	    blocked = true;
+	}
+    }
+    fanout_ring_trim(ring);
+
+    if (blocked) {
+	gensio_set_read_callback_enable(port->io, false);
+	port->dev_to_net_state = PORT_WAITING_OUTPUT_CLEAR;
+	dev_read_stall_start(port);
+    }
+}
+
+/*
+ * If the device was stopped because a connection was too far behind,
+ * start it again once everyone has caught up.
+ */
+void
+fanout_check_dev_read(port_info_t *port)
+{
+    net_info_t *netcon;
+    struct gensio_link *l, *l2;
+
+    if (port->dev_to_net_state != PORT_WAITING_OUTPUT_CLEAR)
+	return;
+
+    for_each_active_connection(port, netcon, l, l2) {
+	if (netcon->fanout.queued > port->fanout_backlog)
+	    return;
+    }
+
+    if (port->net_to_dev_state != PORT_CLOSING) {
+	if (!port->monitor_blocked)
+	    gensio_set_read_callback_enable(port->io, true);
+	port->dev_to_net_state = PORT_WAITING_INPUT;
+	dev_read_stall_end(port);
+    }
+}
+
 static void
 start_net_send(port_info_t *port)
 {
     net_info_t *netcon;
+    struct gensio_link *l, *l2;
+    gensio_time now;
 
     if (port->dev_to_net_state == PORT_WAITING_OUTPUT_CLEAR)
 	return;
 
+    if (port->dev_to_net.cursize) {
+	port->o->get_monotonic_time(port->o, &now);
+	port_hist_add(&port->stats.dev_to_net_delay,
+		      sub_time(&now, &port->stats.dev_to_net_start));
+	port_hist_add(&port->stats.dev_to_net_size, port->dev_to_net.cursize);
+	port->stats.net_sends++;
+    }
+
+    if (port->fanout_backlog) {
+	fanout_net_send(port);
+	return;
+    }
+
     gensio_set_read_callback_enable(port->io, false);
-    for_each_connection(port, netcon) {
-	if (!netcon->net)
-	    continue;
+    for_each_active_connection(port, netcon, l, l2) {
 	netcon->write_pos = 0;
 	gensio_set_write_callback_enable(netcon->net, true);
     }
     port->dev_to_net_state = PORT_WAITING_OUTPUT_CLEAR;
+    dev_read_stall_start(port);
 }
 
 static void
 disable_all_net_read(port_info_t *port)
 {
     net_info_t *netcon;
+    struct gensio_link *l, *l2;
 
-    for_each_connection(port, netcon) {
-	if (netcon->net)
-	    gensio_set_read_callback_enable(netcon->net, false);
+    if (!port->stats.net_read_stalled) {
+	port->o->get_monotonic_time(port->o, &port->stats.net_read_stall_start);
+	port->stats.net_read_stalled = true;
+	port->stats.net_read_stalls++;
     }
+
+    for_each_active_connection(port, netcon, l, l2)
+	gensio_set_read_callback_enable(netcon->net, false);
 }
 
 static void
 enable_all_net_read(port_info_t *port)
 {
     net_info_t *netcon;
+    struct gensio_link *l, *l2;
 
-    for_each_connection(port, netcon) {
-	if (netcon->net)
-	    gensio_set_read_callback_enable(netcon->net, true);
+    if (port->monitor_blocked)
+	/* A monitor is holding off reads, it will enable them. */
+	return;
+
+    if (port->stats.net_read_stalled) {
+	gensio_time now;
+
+	port->o->get_monotonic_time(port->o, &now);
+	port_hist_add(&port->stats.net_read_stall,
+		      sub_time(&now, &port->stats.net_read_stall_start));
+	port->stats.net_read_stalled = false;
+    }
+
+    for_each_active_connection(port, netcon, l, l2)
+	gensio_set_read_callback_enable(netcon->net, true);
+}
+
+/* The most a monitor may have queued on its controller. */
+#define MONITOR_BUF_MAX (64 * 1024)
+
+/*
+ * Stop reading from the device and network until the monitor's
+ * controller catches up or the block time runs out.
+ */
+static void
+monitor_block(port_info_t *port, struct port_monitor *mon)
+{
+    mon->blocked = true;
+    port->o->get_monotonic_time(port->o, &mon->block_until);
+    add_usec_to_time(&mon->block_until, mon->block_time * 1000);
+    if (port->monitor_blocked++ == 0) {
+	gensio_set_read_callback_enable(port->io, false);
+	disable_all_net_read(port);
+    }
+    port_restart_timer(port);
+}
+
+void
+monitor_unblock(port_info_t *port, struct port_monitor *mon)
+{
+    if (!mon->blocked)
+	return;
+    mon->blocked = false;
+    if (--port->monitor_blocked > 0)
+	return;
+
+    if (port->dev_to_net_state == PORT_WAITING_INPUT &&
+		!port->nocon_read_enable_pending)
+	gensio_set_read_callback_enable(port->io, true);
+    if (port->net_to_dev_state == PORT_WAITING_INPUT)
+	enable_all_net_read(port);
+}
+
+/* The port is shutting down, forget any monitor blocking. */
+void
+monitor_port_reset(port_info_t *port)
+{
+    struct port_monitor *mon;
+
+    for (mon = port->monitors; mon; mon = mon->next) {
+	mon->blocked = false;
+	mon->gave_up = false;
+    }
+    port->monitor_blocked = 0;
+}
+
+/* Give up on monitors that have been blocking too long. */
+void
+monitor_check_timeout(port_info_t *port, gensio_time *now)
+{
+    struct port_monitor *mon;
+
+    for (mon = port->monitors; mon; mon = mon->next) {
+	if (mon->blocked && cmp_time(&mon->block_until, now) <= 0) {
+	    mon->gave_up = true;
+	    monitor_unblock(port, mon);
+	}
+    }
+}
+
+gensio_time *
+monitor_next_timeout(port_info_t *port)
+{
+    struct port_monitor *mon;
+    gensio_time *due = NULL;
+
+    for (mon = port->monitors; mon; mon = mon->next) {
+	if (mon->blocked && (!due || cmp_time(&mon->block_until, due) < 0))
+	    due = &mon->block_until;
     }
+    return due;
+}
+
+/*
+ * Pass data to the port's monitors.  Each block is prefixed with a
+ * header if the monitor wants timestamps or watches both directions,
+ * and drops are reported once the controller has room again.
+ */
+static void
+monitor_data(port_info_t *port, unsigned int dir,
+	     const unsigned char *buf, gensiods len)
+{
+    struct port_monitor *mon;
+    char hdr[80];
+    int hdrlen;
+    struct timeval tv;
+    bool behind = false, have_tv = false;
+    const char *dirstr = dir == MONITOR_NET ? "tcp" : "term";
+    int rv;
+
+    for (mon = port->monitors; mon; mon = mon->next) {
+	if (!(mon->dirs & dir))
+	    continue;
+
+	if (mon->dropped) {
+	    hdrlen = snprintf(hdr, sizeof(hdr),
+			      "\r\n[monitor dropped %lu bytes]\r\n",
+			      (unsigned long) mon->dropped);
+	    rv = controller_monitor_write(mon->cntlr, hdr, hdrlen, NULL, 0,
+					  MONITOR_BUF_MAX, &behind);
+	    if (rv) {
+		mon->dropped += len;
+		continue;
+	    }
+	    mon->dropped = 0;
+	}
+
+	hdrlen = 0;
+	if (mon->timestamps) {
+	    if (!have_tv) {
+		gettimeofday(&tv, NULL);
+		have_tv = true;
+	    }
+	    hdrlen = snprintf(hdr, sizeof(hdr), "\r\n[%ld.%6.6ld %s %lu]\r\n",
+			      (long) tv.tv_sec, (long) tv.tv_usec, dirstr,
+			      (unsigned long) len);
+	} else if (mon->dirs == (MONITOR_NET | MONITOR_DEV)) {
+	    hdrlen = snprintf(hdr, sizeof(hdr), "\r\n[%s %lu]\r\n",
+			      dirstr, (unsigned long) len);
+	}
+
+	rv = controller_monitor_write(mon->cntlr, hdr, hdrlen,
+				      (const char *) buf, len,
+				      MONITOR_BUF_MAX, &behind);
+	if (rv)
+	    mon->dropped += len;
+	if (behind && mon->block_time && !mon->gave_up && !mon->blocked)
+	    monitor_block(port, mon);
+    }
+}
+
+/*
+ * The remote address is only needed here, so it's generated when
+ * reported instead of being kept in every netcon.  The net is still
+ * set at disconnect time.
+ */
+static void
+report_conchange(const char *type, port_info_t *port, net_info_t *netcon)
+{
+    char remaddr[NI_MAXHOST + NI_MAXSERV + 2];
+
+    if (!netcon->net ||
+		!net_raddr_str(netcon->net, remaddr, sizeof(remaddr)))
+	strcpy(remaddr, "*unknown*");
+    cntlr_report_conchange(type, port->name, remaddr);
 }
 
 static void
 report_newcon(port_info_t *port, net_info_t *netcon)
 {
-    if (!net_raddr_str(netcon->net, netcon->remaddr, sizeof(netcon->remaddr)))
-	strcpy(netcon->remaddr, "*unknown*");
-    cntlr_report_conchange("new connection", port->name, netcon->remaddr);
+    report_conchange("new connection", port, netcon);
 }
 
 void
 report_disconnect(port_info_t *port, net_info_t *netcon)
 {
-    cntlr_report_conchange("disconnect", port->name, netcon->remaddr);
+    report_conchange("disconnect", port, netcon);
+}
+
+/* The netcon just got a net, must be called with the port lock held. */
+static void
+netcon_net_added(net_info_t *netcon)
+{
+    port_info_t *port = netcon->port;
+
+    port->net_count++;
+    gensio_list_add_tail(&port->active_netcons, &netcon->active_link);
+    if (netcon->on_free_list) {
+	gensio_list_rm(&port->free_netcons, &netcon->free_link);
+	netcon->on_free_list = false;
+    }
 }
 
 static void
@@ -141,8 +506,7 @@ connect_back_done(struct gensio *net, int err, void *cb_data)
 
     so->lock(port->lock);
     if (err) {
-	netcon->net = NULL;
-	gensio_free(net);
+	netcon_release_net(netcon);
     } else {
 	report_newcon(port, netcon);
 	setup_port(port, netcon);
@@ -152,7 +516,7 @@ connect_back_done(struct gensio *net, int err, void *cb_data)
     if (port->num_waiting_connect_backs == 0) {
 	if (!all_net_connectbacks_done(port))
 	    /* Not all connections back could be made. */
-	    port->nocon_read_enable_time_left = port->accepter_retry_time;
+	    port_nocon_read_disable(port);
 	else
 	    gensio_set_read_callback_enable(port->io, true);
     }
@@ -191,10 +555,10 @@ port_check_connect_backs(port_info_t *port)
 		       gensio_err_to_str(err));
 		continue;
 	    }
+	    netcon_net_added(netcon);
 	    err = gensio_open(netcon->net, connect_back_done, netcon);
 	    if (err) {
-		gensio_free(netcon->net);
-		netcon->net = NULL;
+		netcon_release_net(netcon);
 		syslog(LOG_ERR, "Unable to open connect back port %s,"
 		       " addr %s: %s\n", port->name, netcon->remote_str,
 		       gensio_err_to_str(err));
@@ -209,18 +573,66 @@ port_check_connect_backs(port_info_t *port)
 	 * This is kind of a bad situation.  We got some data, attempted
 	 * connects, but failed.  Shut down the read enable for a while.
 	 */
-	port->nocon_read_enable_time_left = port->accepter_retry_time;
+	port_nocon_read_disable(port);
     }
 
     return port->num_waiting_connect_backs;
 }
 
+static int net_fd_write_sg(port_info_t *port, net_info_t *netcon,
+			   const struct gensio_sg *sg, gensiods sglen,
+			   gensiods *count);
+
+/*
+ * If the port is a pure byte pipe right now, write the device data
+ * to the connection straight from the read buffer, saving the copy
+ * into dev_to_net.  That needs a single connection with nothing
+ * waiting to be written to it.  Returns how much was taken, the rest
+ * goes the normal way.
+ */
+static gensiods
+dev_passthrough_write(port_info_t *port, unsigned char *buf, gensiods count)
+{
+    net_info_t *netcon;
+    struct gensio_sg sg;
+    gensiods written;
+
+    if (port->chardelay || port->dev_to_net.cursize || port->net_count != 1)
+	return 0;
+    netcon = first_live_net_con(port);
+    if (!netcon || netcon->banner || netcon->closing)
+	return 0;
+
+    sg.buf = buf;
+    sg.buflen = count;
+    if (net_fd_write_sg(port, netcon, &sg, 1, &written))
+	/* The connection is gone, drop the data like a normal send would. */
+	return count;
+    if (written) {
+	port->stats.net_sends++;
+	reset_timer(netcon);
+    }
+    return written;
+}
+
+/*
+ * The device and network read handlers come in variants specialized
+ * for what the port needs done with the data, so the plain transfer
+ * path doesn't test for all the features it isn't using.  Each
+ * variant is the template below compiled with a constant set of
+ * these flags.  port_select_data_path() picks the variants.
+ */
+#define DATA_PATH_INSPECT	(1 << 0) /* Trace, monitor, scan, etc. */
+#define DATA_PATH_PASSTHROUGH	(1 << 1) /* See dev_passthrough_write(). */
+
+#define DATA_PATH_TEMPLATE static inline __attribute__((always_inline))
+
 /* Data is ready to read on the serial port. */
-static int
-handle_dev_read(port_info_t *port, int err, unsigned char *buf,
-		gensiods buflen)
+DATA_PATH_TEMPLATE int
+handle_dev_read_tmpl(port_info_t *port, int err, unsigned char *buf,
+		     gensiods buflen, const unsigned int variant)
 {
-    gensiods count = 0;
+    gensiods count = 0, direct = 0;
     bool send_now = false;
     int nr_handlers = 0;
 
@@ -259,24 +671,58 @@ handle_dev_read(port_info_t *port, int err, unsigned char *buf,
 	goto out_unlock;
     }
 
-    if (port->closeon) {
-	int i;
+    port->stats.dev_reads++;
 
-	for (i = 0; i < count; i++) {
-	    if (buf[i] == port->closeon[port->closeon_pos]) {
-		port->closeon_pos++;
-		if (port->closeon_pos >= port->closeon_len) {
-		    net_info_t *netcon;
+    if ((variant & DATA_PATH_INSPECT) && port->chardelay_adaptive &&
+		port->chardelay && port->framer.type == FRAMER_NONE) {
+	gensio_time now;
 
-		    for_each_connection(port, netcon)
-			netcon->close_on_output_done = true;
-		    /* Ignore everything after the closeon string */
-		    count = i + 1;
-		    break;
-		}
-	    } else {
-		port->closeon_pos = 0;
-	    }
+	port->o->get_monotonic_time(port->o, &now);
+	chardelay_adapt(port, &now);
+    }
+
+    if (variant & DATA_PATH_PASSTHROUGH) {
+	direct = dev_passthrough_write(port, buf, count);
+	port->dev_bytes_received += direct;
+	buf += direct;
+	count -= direct;
+	if (count == 0)
+	    goto out_unlock;
+    }
+
+    if (!(variant & DATA_PATH_INSPECT))
+	goto do_send;
+
+    /*
+     * Find where the data for this send ends before anything else
+     * looks at it, whatever is past that gets handed to us again.
+     */
+    if (port->framer.type != FRAMER_NONE) {
+	count = framer_scan(&port->framer, buf, count, &send_now);
+	if (send_now)
+	    port->stats.frames++;
+    } else if (port->sendon_match) {
+	gensiods n = strmatch_scan(port->sendon_match, &port->sendon_pos,
+				   buf, count);
+
+	if (n) {
+	    count = n;
+	    send_now = true;
+	    port->stats.sendon_matches++;
+	}
+    }
+
+    if (port->closeon_match) {
+	gensiods n = strmatch_scan(port->closeon_match, &port->closeon_pos,
+				   buf, count);
+
+	if (n) {
+	    net_info_t *netcon;
+
+	    for_each_connection(port, netcon)
+		netcon->close_on_output_done = true;
+	    /* Ignore everything after the closeon string */
+	    count = n;
 	}
     }
 
@@ -290,63 +736,72 @@ handle_dev_read(port_info_t *port, int err, unsigned char *buf,
     if (port->led_rx)
 	led_flash(port->led_rx);
 
-    if (port->dev_monitor != NULL)
-	controller_write(port->dev_monitor, (char *) buf, count);
+    if (port->monitors)
+	monitor_data(port, MONITOR_DEV, buf, count);
 
  do_send:
     if (nr_handlers < 0) /* Nobody to handle the data. */
 	goto out_unlock;
 
-    if (port->sendon_len != 0) {
-	int i;
-
-	for (i = 0; i < count; i++) {
-	    if (buf[i] == port->sendon[port->sendon_pos]) {
-		port->sendon_pos++;
-		if (port->sendon_pos >= port->sendon_len) {
-		    count = i + 1;
-		    send_now = true;
-		    port->sendon_pos = 0;
-		    break;
-		}
-	    } else {
-		port->sendon_pos = 0;
-	    }
-	}
-    }
-
+    if (port->dev_to_net.cursize == 0 && count > 0)
+	port->o->get_monotonic_time(port->o, &port->stats.dev_to_net_start);
     gbuf_append(&port->dev_to_net, buf, count);
     port->dev_bytes_received += count;
 
     if (send_now || gbuf_room_left(&port->dev_to_net) == 0 ||
-		port->chardelay == 0) {
+		(port->chardelay == 0 && !framer_holds_data(port))) {
     send_it:
 	start_net_send(port);
     } else {
 	gensio_time then;
 	int delay;
 
-	so->get_monotonic_time(so, &then);
+	port->o->get_monotonic_time(port->o, &then);
 	if (port->send_timer_running) {
-	    so->stop_timer(port->send_timer);
+	    port->o->stop_timer(port->send_timer);
 	} else {
 	    port->send_time = then;
 	    add_usec_to_time(&port->send_time, port->chardelay_max);
 	}
 	delay = sub_time(&port->send_time, &then);
-	if (delay > port->chardelay)
+	if (port->framer.type == FRAMER_MODBUS_RTU) {
+	    /* Only silence ends a modbus frame, chardelay_max is ignored. */
+	    delay = port->chardelay;
+	} else if (delay > port->chardelay && !framer_holds_data(port)) {
 	    delay = port->chardelay;
-	else if (delay < 0) {
+	} else if (delay < 0) {
 	    port->send_timer_running = false;
 	    goto send_it;
 	}
 	add_usec_to_time(&then, delay);
-	so->start_timer_abs(port->send_timer, &then);
+	port->o->start_timer_abs(port->send_timer, &then);
 	port->send_timer_running = true;
     }
  out_unlock:
     so->unlock(port->lock);
-    return count;
+    return count + direct;
+}
+
+static int
+handle_dev_read_plain(port_info_t *port, int err, unsigned char *buf,
+		      gensiods buflen)
+{
+    return handle_dev_read_tmpl(port, err, buf, buflen, 0);
+}
+
+static int
+handle_dev_read_passthrough(port_info_t *port, int err, unsigned char *buf,
+			    gensiods buflen)
+{
+    return handle_dev_read_tmpl(port, err, buf, buflen,
+				DATA_PATH_PASSTHROUGH);
+}
+
+static int
+handle_dev_read_full(port_info_t *port, int err, unsigned char *buf,
+		     gensiods buflen)
+{
+    return handle_dev_read_tmpl(port, err, buf, buflen, DATA_PATH_INSPECT);
 }
 
 static void
@@ -364,6 +819,7 @@ handle_dev_event(struct gensio *io, void *user_data, int event, int err,
 {
     port_info_t *port = user_data;
     net_info_t *netcon;
+    struct gensio_link *l, *l2;
     gensiods len = 0;
 
     if (buflen)
@@ -374,7 +830,7 @@ handle_dev_event(struct gensio *io, void *user_data, int event, int err,
 	if (gensio_str_in_auxdata(auxdata, "oob"))
 	    /* Ignore out of bound data. */
 	    return 0;
-	len = handle_dev_read(port, err, buf, len);
+	len = port->dev_read_handler(port, err, buf, len);
 	if (buflen)
 	    *buflen = len;
 	return 0;
@@ -386,11 +842,9 @@ handle_dev_event(struct gensio *io, void *user_data, int event, int err,
     case GENSIO_EVENT_SER_MODEMSTATE:
 	so->lock(port->lock);
 	port->last_modemstate = *((unsigned int *) buf);
-	for_each_connection(port, netcon) {
+	for_each_active_connection(port, netcon, l, l2) {
 	    struct sergensio *sio;
 
-	    if (!netcon->net)
-		continue;
 	    sio = gensio_to_sergensio(netcon->net);
 	    if (!sio)
 		continue;
@@ -413,11 +867,9 @@ handle_dev_event(struct gensio *io, void *user_data, int event, int err,
     case GENSIO_EVENT_SER_LINESTATE:
 	so->lock(port->lock);
 	port->last_linestate = *((unsigned int *) buf);
-	for_each_connection(port, netcon) {
+	for_each_active_connection(port, netcon, l, l2) {
 	    struct sergensio *sio;
 
-	    if (!netcon->net)
-		continue;
 	    sio = gensio_to_sergensio(netcon->net);
 	    if (!sio)
 		continue;
@@ -448,8 +900,10 @@ port_send_timeout(struct gensio_timer *timer, void *data)
 	return;
     }
 
-    if (port->dev_to_net.cursize)
+    if (port->dev_to_net.cursize) {
+	port->stats.chardelay_timeouts++;
 	start_net_send(port);
+    }
     so->unlock(port->lock);
 }
 
@@ -472,41 +926,186 @@ gbuf_write(port_info_t *port, struct gbuf *buf)
     return 0;
 }
 
-/* The serial port has room to write some data.  This is only activated
-   if a write fails to complete, it is deactivated as soon as writing
-   is available again. */
+/*
+ * Move the oldest queued network data into net_to_dev.  The buffers
+ * are swapped, not copied.  Returns false if nothing was queued.
+ */
+bool
+net_to_dev_next_buf(port_info_t *port)
+{
+    struct gbuf *next;
+    unsigned char *tmp;
+
+    if (port->net_to_dev_qcount == 0)
+	return false;
+
+    next = &port->net_to_dev_q[port->net_to_dev_qhead];
+    tmp = port->net_to_dev.buf;
+    port->net_to_dev.buf = next->buf;
+    port->net_to_dev.cursize = next->cursize;
+    port->net_to_dev.pos = 0;
+    next->buf = tmp;
+    gbuf_reset(next);
+
+    port->net_to_dev_qhead++;
+    if (port->net_to_dev_qhead >= port->net_to_dev_nbufs - 1)
+	port->net_to_dev_qhead = 0;
+    port->net_to_dev_qcount--;
+
+    if (port->net_to_dev_state == PORT_WAITING_OUTPUT_CLEAR) {
+	/* There is a free buffer now, start reading again. */
+	enable_all_net_read(port);
+	port->net_to_dev_state = PORT_WAITING_INPUT;
+    }
+
+    return true;
+}
+
+/*
+ * Queue network data while net_to_dev is being written to the device.
+ * If this uses the last free buffer, stop reading from the network.
+ */
 static void
-dev_fd_write(port_info_t *port, struct gbuf *buf)
+net_to_dev_queue(port_info_t *port, unsigned char *buf, gensiods buflen)
+{
+    unsigned int qlen = port->net_to_dev_nbufs - 1;
+    struct gbuf *next;
+
+    next = &port->net_to_dev_q[(port->net_to_dev_qhead +
+				port->net_to_dev_qcount) % qlen];
+    memcpy(next->buf, buf, buflen);
+    next->cursize = buflen;
+    next->pos = 0;
+    port->net_to_dev_qcount++;
+
+    if (port->net_to_dev_qcount >= qlen) {
+	disable_all_net_read(port);
+	port->net_to_dev_state = PORT_WAITING_OUTPUT_CLEAR;
+    }
+}
+
+/*
+ * The last buffer waiting for the device, the one new data can be
+ * added to with net-batch.
+ */
+static struct gbuf *
+net_to_dev_last_buf(port_info_t *port)
+{
+    if (port->net_to_dev_qcount == 0)
+	return &port->net_to_dev;
+    return &port->net_to_dev_q[(port->net_to_dev_qhead +
+				port->net_to_dev_qcount - 1) %
+			       (port->net_to_dev_nbufs - 1)];
+}
+
+/* Can the data be added to the last waiting buffer with net-batch? */
+static bool
+net_to_dev_fits(port_info_t *port, gensiods buflen)
+{
+    struct gbuf *last;
+
+    if (!port->net_batch || !gbuf_cursize(&port->net_to_dev))
+	return false;
+    last = net_to_dev_last_buf(port);
+    return last->cursize + buflen <= last->maxsize;
+}
+
+/* Most buffers we will give to the device in one write. */
+#define DEV_WRITE_MAX_SG 64
+
+/*
+ * Write net_to_dev and everything queued behind it to the device in
+ * one write, moving the queue up as buffers are completed.
+ */
+static int
+net_to_dev_write_all(port_info_t *port)
 {
+    struct gensio_sg sg[DEV_WRITE_MAX_SG];
+    unsigned int qlen = port->net_to_dev_nbufs - 1, i, sglen = 0;
+    gensiods count, left;
+    struct gbuf *b;
     int err;
 
-    err = gbuf_write(port, buf);
-    if (err) {
-	syslog(LOG_ERR, "The dev write for port %s had error: %s",
-	       port->name, gensio_err_to_str(err));
-	shutdown_port(port, "dev write error");
-	return;
+    if (gbuf_cursize(&port->net_to_dev)) {
+	sg[sglen].buf = port->net_to_dev.buf + port->net_to_dev.pos;
+	sg[sglen].buflen = (gbuf_cursize(&port->net_to_dev) -
+			    port->net_to_dev.pos);
+	sglen++;
     }
+    for (i = 0; i < port->net_to_dev_qcount && sglen < DEV_WRITE_MAX_SG;
+	 i++) {
+	b = &port->net_to_dev_q[(port->net_to_dev_qhead + i) % qlen];
+	sg[sglen].buf = b->buf;
+	sg[sglen].buflen = b->cursize;
+	sglen++;
+    }
+    if (sglen == 0)
+	return 0;
 
-    if (gbuf_cursize(buf) == 0) {
-	/* We are done writing, turn the reader back on. */
-	enable_all_net_read(port);
-	gensio_set_write_callback_enable(port->io, false);
-	port->net_to_dev_state = PORT_WAITING_INPUT;
+    err = gensio_write_sg(port->io, &count, sg, sglen, NULL);
+    if (err)
+	return err;
+    port->dev_bytes_sent += count;
+    if (count && port->led_tx)
+	led_flash(port->led_tx);
+
+    for (;;) {
+	left = gbuf_cursize(&port->net_to_dev) - port->net_to_dev.pos;
+	if (count < left) {
+	    port->net_to_dev.pos += count;
+	    break;
+	}
+	count -= left;
+	gbuf_reset(&port->net_to_dev);
+	if (!net_to_dev_next_buf(port))
+	    break;
     }
+    return 0;
 }
 
+/* The serial port has room to write some data.  This is only activated
+   if a write fails to complete, it is deactivated as soon as everything
+   queued from the network has been written. */
 static void
 handle_dev_fd_normal_write(port_info_t *port)
 {
-    dev_fd_write(port, &port->net_to_dev);
+    int err;
+
+    do {
+	err = net_to_dev_write_all(port);
+	if (err) {
+	    syslog(LOG_ERR, "The dev write for port %s had error: %s",
+		   port->name, gensio_err_to_str(err));
+	    shutdown_port(port, "dev write error");
+	    return;
+	}
+
+	if (gbuf_cursize(&port->net_to_dev))
+	    /* Wait for the device to take more. */
+	    return;
+    } while (net_to_dev_next_buf(port));
+
+    /* We are done writing, turn the reader back on. */
+    if (port->net_to_dev_state == PORT_WAITING_OUTPUT_CLEAR)
+	enable_all_net_read(port);
+    gensio_set_write_callback_enable(port->io, false);
+    port->net_to_dev_state = PORT_WAITING_INPUT;
 }
 
 /* Output the devstr buffer */
 static void
 handle_dev_fd_devstr_write(port_info_t *port)
 {
-    dev_fd_write(port, port->devstr);
+    int err;
+
+    err = gbuf_write(port, port->devstr);
+    if (err) {
+	syslog(LOG_ERR, "The dev write for port %s had error: %s",
+	       port->name, gensio_err_to_str(err));
+	shutdown_port(port, "dev write error");
+	return;
+    }
+
     if (gbuf_cursize(port->devstr) == 0) {
 	port->dev_write_handler = handle_dev_fd_normal_write;
 	gbuf_free(port->devstr);
@@ -518,9 +1117,10 @@ handle_dev_fd_devstr_write(port_info_t *port)
 }
 
 /* Data is ready to read on the network port. */
-static gensiods
-handle_net_fd_read(net_info_t *netcon, struct gensio *net, int readerr,
-		   unsigned char *buf, gensiods buflen)
+DATA_PATH_TEMPLATE gensiods
+handle_net_fd_read_tmpl(net_info_t *netcon, struct gensio *net, int readerr,
+			unsigned char *buf, gensiods buflen,
+			const unsigned int variant)
 {
     port_info_t *port = netcon->port;
     gensiods rv = 0;
@@ -547,23 +1147,61 @@ handle_net_fd_read(net_info_t *netcon, struct gensio *net, int readerr,
     if (buflen > port->net_to_dev.maxsize)
 	buflen = port->net_to_dev.maxsize;
 
+    if (gbuf_cursize(&port->net_to_dev) &&
+		port->net_to_dev_qcount >= port->net_to_dev_nbufs - 1 &&
+		!net_to_dev_fits(port, buflen)) {
+	/* No free buffers, the read should have been disabled. */
+	disable_all_net_read(port);
+	port->net_to_dev_state = PORT_WAITING_OUTPUT_CLEAR;
+	goto out_unlock;
+    }
+
     netcon->bytes_received += buflen;
+    port->stats.net_reads++;
+    port_hist_add(&port->stats.net_to_dev_bufs,
+		  (gbuf_cursize(&port->net_to_dev) ? 1 : 0) +
+		  port->net_to_dev_qcount);
+
+    if (variant & DATA_PATH_INSPECT) {
+	if (port->monitors)
+	    monitor_data(port, MONITOR_NET, buf, buflen);
+
+	if (port->tw)
+	    /* Do write tracing, ignore errors. */
+	    do_trace(port, port->tw, buf, buflen, NET);
+	if (port->tb)
+	    /* Do both tracing, ignore errors. */
+	    do_trace(port, port->tb, buf, buflen, NET);
+    }
 
-    if (port->net_monitor != NULL)
-	controller_write(port->net_monitor, (char *) buf, buflen);
+    if (gbuf_cursize(&port->net_to_dev)) {
+	/*
+	 * The device is still working on the last data, queue this
+	 * until it is done.  The write callback is already enabled.
+	 */
+	if (net_to_dev_fits(port, buflen)) {
+	    struct gbuf *last = net_to_dev_last_buf(port);
 
-    if (port->tw)
-	/* Do write tracing, ignore errors. */
-	do_trace(port, port->tw, buf, buflen, NET);
-    if (port->tb)
-	/* Do both tracing, ignore errors. */
-	do_trace(port, port->tb, buf, buflen, NET);
+	    memcpy(last->buf + last->cursize, buf, buflen);
+	    last->cursize += buflen;
+	} else {
+	    net_to_dev_queue(port, buf, buflen);
+	}
+	goto out_done;
+    }
 
     memcpy(port->net_to_dev.buf, buf, buflen);
     port->net_to_dev.cursize = buflen;
 
     port->net_to_dev.pos = 0;
 
+    /*
+     * With net-batch, let whatever else comes in before the device
+     * is ready collect behind this and write it all at once.  This
+     * is mostly for UDP, where each datagram is a separate read.
+     */
+    if (port->net_batch)
+	goto start_write;
 
     /*
      * Don't write anything to the device until devstr is written.
@@ -573,7 +1211,7 @@ handle_net_fd_read(net_info_t *netcon, struct gensio *net, int readerr,
      * devstr data to go out first.
      */
     if (port->devstr)
-	goto stop_read_start_write;
+	goto start_write;
 
     err = gbuf_write(port, &port->net_to_dev);
     if (err) {
@@ -588,14 +1226,18 @@ handle_net_fd_read(net_info_t *netcon, struct gensio *net, int readerr,
     }
 
     if (gbuf_cursize(&port->net_to_dev)) {
-	/* We didn't write all the data, shut off the reader and
-	   start the write monitor. */
-    stop_read_start_write:
-	disable_all_net_read(port);
+	/* We didn't write all the data, start the write monitor.  If
+	   there are no more buffers, shut off the reader, too. */
+	port->stats.partial_dev_writes++;
+    start_write:
 	gensio_set_write_callback_enable(port->io, true);
-	port->net_to_dev_state = PORT_WAITING_OUTPUT_CLEAR;
+	if (port->net_to_dev_nbufs <= 1 && !port->net_batch) {
+	    disable_all_net_read(port);
+	    port->net_to_dev_state = PORT_WAITING_OUTPUT_CLEAR;
+	}
     }
 
+ out_done:
     reset_timer(netcon);
 
     rv = buflen;
@@ -609,26 +1251,65 @@ handle_net_fd_read(net_info_t *netcon, struct gensio *net, int readerr,
     goto out_unlock;
 }
 
+static gensiods
+handle_net_fd_read_plain(net_info_t *netcon, struct gensio *net, int readerr,
+			 unsigned char *buf, gensiods buflen)
+{
+    return handle_net_fd_read_tmpl(netcon, net, readerr, buf, buflen, 0);
+}
+
+static gensiods
+handle_net_fd_read_full(net_info_t *netcon, struct gensio *net, int readerr,
+			unsigned char *buf, gensiods buflen)
+{
+    return handle_net_fd_read_tmpl(netcon, net, readerr, buf, buflen,
+				   DATA_PATH_INSPECT);
+}
+
 /*
- * Write some network data from a buffer.  Returns -1 on something
- * causing the netcon to shut down, 0 if the write was incomplete, and
- * 1 if the write was completed.
+ * Pick the data path variants for what the port is doing right now.
+ * Must be called with the port lock held whenever something tested
+ * here changes.
  */
-static int
-net_fd_write(port_info_t *port, net_info_t *netcon,
-	     struct gbuf *buf, gensiods *pos)
+void
+port_select_data_path(port_info_t *port)
 {
-    int reterr, to_send;
-    gensiods count = 0;
+    bool dev_inspect, net_inspect;
+
+    dev_inspect = (port->framer.type != FRAMER_NONE || port->sendon_match ||
+		   port->closeon_match || port->tr || port->tb ||
+		   port->led_rx || port->monitors ||
+		   port->chardelay_adaptive);
+    net_inspect = port->tw || port->tb || port->monitors;
+
+    if (dev_inspect)
+	port->dev_read_handler = handle_dev_read_full;
+    else if (port->passthrough_ok)
+	port->dev_read_handler = handle_dev_read_passthrough;
+    else
+	port->dev_read_handler = handle_dev_read_plain;
 
-    to_send = buf->cursize - *pos;
-    if (to_send <= 0)
-	/* Don't send empty packets, that can confuse UDP clients. */
-	return 1;
+    if (net_inspect)
+	port->net_read_handler = handle_net_fd_read_full;
+    else
+	port->net_read_handler = handle_net_fd_read_plain;
+}
+
+/* Most pieces we will send to the network in one write. */
+#define NET_WRITE_MAX_SG 16
 
-    /* Can't use buffer send operation here, multiple writers can send
-       from the buffers. */
-    reterr = gensio_write(netcon->net, &count, buf->buf + *pos, to_send, NULL);
+/*
+ * Write a scatter/gather list to the network.  Returns -1 on something
+ * causing the netcon to shut down, 0 otherwise.
+ */
+static int
+net_fd_write_sg(port_info_t *port, net_info_t *netcon,
+		const struct gensio_sg *sg, gensiods sglen, gensiods *count)
+{
+    int reterr;
+
+    *count = 0;
+    reterr = gensio_write_sg(netcon->net, count, sg, sglen, NULL);
     if (reterr == GE_REMCLOSE) {
 	shutdown_one_netcon(netcon, "Remote closed");
 	return -1;
@@ -639,11 +1320,81 @@ net_fd_write(port_info_t *port, net_info_t *netcon,
 	shutdown_one_netcon(netcon, "network write error");
 	return -1;
     }
-    *pos += count;
-    netcon->bytes_sent += count;
+    netcon->bytes_sent += *count;
 
-    if (*pos < buf->cursize)
-	return 0;
+    return 0;
+}
+
+/*
+ * Write everything pending for the netcon, the banner and, if
+ * dev_data is true, the data from the device, in one write.  Returns
+ * -1 on something causing the netcon to shut down, 0 if the write was
+ * incomplete, and 1 if the write was completed.
+ */
+static int
+net_fd_write_pending(port_info_t *port, net_info_t *netcon, bool dev_data)
+{
+    struct gensio_sg sg[NET_WRITE_MAX_SG];
+    struct gbuf *banner = netcon->banner;
+    struct fanout_chunk *chunk;
+    gensiods sglen = 0, count, left, pos;
+
+    if (banner && banner->pos < banner->cursize) {
+	sg[sglen].buf = banner->buf + banner->pos;
+	sg[sglen].buflen = banner->cursize - banner->pos;
+	sglen++;
+    }
+
+    if (dev_data && port->fanout_backlog) {
+	pos = netcon->fanout.pos;
+	for (chunk = netcon->fanout.chunk; chunk && sglen < NET_WRITE_MAX_SG;
+	     chunk = chunk->next) {
+	    sg[sglen].buf = chunk->data + pos;
+	    sg[sglen].buflen = chunk->len - pos;
+	    sglen++;
+	    pos = 0;
+	}
+    } else if (dev_data && netcon->write_pos < port->dev_to_net.cursize) {
+	/* Can't use buffer send operation here, multiple writers can
+	   send from the buffers. */
+	sg[sglen].buf = port->dev_to_net.buf + netcon->write_pos;
+	sg[sglen].buflen = port->dev_to_net.cursize - netcon->write_pos;
+	sglen++;
+    }
+
+    if (sglen == 0) {
+	/* Don't send empty packets, that can confuse UDP clients. */
+	count = 0;
+	goto written;
+    }
+
+    if (net_fd_write_sg(port, netcon, sg, sglen, &count))
+	return -1;
+
+ written:
+    if (banner) {
+	left = banner->cursize - banner->pos;
+	if (count < left) {
+	    banner->pos += count;
+	    return 0;
+	}
+	count -= left;
+	gbuf_free(banner);
+	netcon->banner = NULL;
+    }
+
+    if (!dev_data)
+	return 1;
+
+    if (port->fanout_backlog) {
+	fanout_cursor_advance(&port->dev_to_net_ring, &netcon->fanout, count);
+	if (netcon->fanout.queued)
+	    return 0;
+    } else {
+	netcon->write_pos += count;
+	if (netcon->write_pos < port->dev_to_net.cursize)
+	    return 0;
+    }
 
     return 1;
 }
@@ -659,8 +1410,10 @@ finish_dev_to_net_write(port_info_t *port)
 
     if (port->net_to_dev_state != PORT_CLOSING) {
 	/* We are done writing on this port, turn the reader back on. */
-	gensio_set_read_callback_enable(port->io, true);
+	if (!port->monitor_blocked)
+	    gensio_set_read_callback_enable(port->io, true);
 	port->dev_to_net_state = PORT_WAITING_INPUT;
+	dev_read_stall_end(port);
     }
 }
 
@@ -671,31 +1424,24 @@ static void
 handle_net_fd_write_ready(net_info_t *netcon, struct gensio *net)
 {
     port_info_t *port = netcon->port;
-    int rv = 1;
+    bool dev_data;
+    int rv;
 
     so->lock(port->lock);
-    if (netcon->banner) {
-	rv = net_fd_write(port, netcon, netcon->banner, &netcon->banner->pos);
-	if (rv <= 0)
-	    goto out_unlock;
+    dev_data = (port->fanout_backlog ||
+		port->dev_to_net_state == PORT_WAITING_OUTPUT_CLEAR);
+    rv = net_fd_write_pending(port, netcon, dev_data);
+    if (rv == 0 || !dev_data)
+	goto out_unlock;
 
-	gbuf_free(netcon->banner);
-	netcon->banner = NULL;
+    if (netcon->close_on_output_done) {
+	shutdown_one_netcon(netcon, "port closing");
+	rv = -1;
     }
-
-    if (port->dev_to_net_state == PORT_WAITING_OUTPUT_CLEAR) {
-	rv = net_fd_write(port, netcon,
-			  &port->dev_to_net, &netcon->write_pos);
-
-	if (rv == 0)
-	    goto out_unlock;
-
-	if (netcon->close_on_output_done) {
-	    shutdown_one_netcon(netcon, "port closing");
-	    rv = -1;
-	}
+    if (port->fanout_backlog)
+	fanout_check_dev_read(port);
+    else
 	finish_dev_to_net_write(port);
-    }
 
  out_unlock:
     if (rv > 0)
@@ -725,13 +1471,12 @@ sergensio_val_set(struct sergensio *sio, int err,
     port_info_t *port = sergensio_get_user_data(sio);
     enum s2n_ser_ops op = (long) cb_data;
     net_info_t *netcon;
+    struct gensio_link *l, *l2;
 
     so->lock(port->lock);
-    for_each_connection(port, netcon) {
+    for_each_active_connection(port, netcon, l, l2) {
 	struct sergensio *rsio;
 
-	if (!netcon->net)
-	    continue;
 	rsio = gensio_to_sergensio(netcon->net);
 	if (!rsio)
 	    continue;
@@ -976,7 +1721,7 @@ handle_net_event(struct gensio *net, void *user_data, int event, int err,
 
     switch (event) {
     case GENSIO_EVENT_READ:
-	len = handle_net_fd_read(netcon, net, err, buf, len);
+	len = netcon->port->net_read_handler(netcon, net, err, buf, len);
 	if (buflen)
 	    *buflen = len;
 	return 0;
@@ -1060,6 +1805,15 @@ recalc_port_chardelay(port_info_t *port)
 {
     unsigned int bpc = port->bpc + port->stopbits + port->paritybits + 1;
 
+    if (port->framer.type == FRAMER_MODBUS_RTU) {
+	/* 3.5 characters, the spec fixes it at 1750us over 19200 baud. */
+	if (port->bps > 19200)
+	    port->chardelay = 1750;
+	else
+	    port->chardelay = (bpc * 100000 * 35) / port->bps;
+	return;
+    }
+
     /* delay is (((1 / bps) * bpc) * scale) seconds */
     if (!port->enable_chardelay) {
 	port->chardelay = 0;
@@ -1070,6 +1824,13 @@ recalc_port_chardelay(port_info_t *port)
     port->chardelay = (bpc * 100000 * port->chardelay_scale) / port->bps;
     if (port->chardelay < port->chardelay_min)
 	port->chardelay = port->chardelay_min;
+
+    /* Adaptive chardelay starts from the calculated value. */
+    port->last_dev_read_valid = false;
+    port->gap_samples = 0;
+    port->gap_burst_avg = port->chardelay / 2;
+    port->gap_burst_dev = port->chardelay / 8;
+    port->gap_idle_avg = port->chardelay_max;
 }
 
 static void
@@ -1150,8 +1911,7 @@ port_dev_open_done(struct gensio *io, int err, void *cb_data)
 		continue;
 	    gensio_write(netcon->net, NULL, errstr, strlen(errstr), NULL);
 	    report_disconnect(port, netcon);
-	    gensio_free(netcon->net);
-	    netcon->net = NULL;
+	    netcon_release_net(netcon);
 	}
 	shutdown_port(port, "Device open failure");
 	goto out_unlock;
@@ -1159,10 +1919,13 @@ port_dev_open_done(struct gensio *io, int err, void *cb_data)
 
     extract_bps_bpc(port);
     recalc_port_chardelay(port);
+    framer_reset(&port->framer);
+    port->sendon_pos = 0;
+    port->closeon_pos = 0;
 
     if (port->devstr)
 	gbuf_free(port->devstr);
-    port->devstr = process_str_to_buf(port, NULL, port->openstr);
+    port->devstr = str_template_render(port, NULL, port->openstr_tmpl);
     if (port->devstr)
 	port->dev_write_handler = handle_dev_fd_devstr_write;
     else
@@ -1173,6 +1936,7 @@ port_dev_open_done(struct gensio *io, int err, void *cb_data)
     gensio_set_read_callback_enable(port->io, true);
 
     setup_trace(port);
+    port_select_data_path(port);
 
     port_start_timer(port);
 
@@ -1222,7 +1986,7 @@ setup_port(port_info_t *port, net_info_t *netcon)
 
     if (netcon->banner)
 	gbuf_free(netcon->banner);
-    netcon->banner = process_str_to_buf(port, netcon, port->bannerstr);
+    netcon->banner = str_template_render(port, netcon, port->banner_tmpl);
 
     if (num_connected_net(port) == 1 && (!port->connbacks || !port->io_open)) {
 	/* We are first, set things up on the device. */
@@ -1234,8 +1998,7 @@ setup_port(port_info_t *port, net_info_t *netcon)
 		     gensio_err_to_str(err));
 	    gensio_write(netcon->net, NULL, errstr, strlen(errstr), NULL);
 	    report_disconnect(port, netcon);
-	    gensio_free(netcon->net);
-	    netcon->net = NULL;
+	    netcon_release_net(netcon);
 	}
 	return;
     }
@@ -1243,10 +2006,33 @@ setup_port(port_info_t *port, net_info_t *netcon)
     finish_setup_net(port, netcon);
 }
 
+/*
+ * Free the network connection on the netcon and let any rotators
+ * know the slot is available.  Must be called with the port lock
+ * held.
+ */
+void
+netcon_release_net(net_info_t *netcon)
+{
+    port_info_t *port = netcon->port;
+
+    gensio_free(netcon->net);
+    netcon->net = NULL;
+    assert(port->net_count > 0);
+    port->net_count--;
+    gensio_list_rm(&port->active_netcons, &netcon->active_link);
+    if (!netcon->remote_fixed && !netcon->on_free_list) {
+	gensio_list_add_tail(&port->free_netcons, &netcon->free_link);
+	netcon->on_free_list = true;
+    }
+    rotator_port_freed(port);
+}
+
 void
 handle_new_net(port_info_t *port, struct gensio *net, net_info_t *netcon)
 {
     netcon->net = net;
+    netcon_net_added(netcon);
 
     report_newcon(port, netcon);
 
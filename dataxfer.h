@@ -67,6 +67,10 @@ void showports(struct controller_info *cntlr, const char *portspec, bool yaml);
 /* Show information about a port (as above) but in a one-line format. */
 void showshortports(struct controller_info *cntlr, const char *portspec);
 
+/* Show the data path statistics for a port. */
+void showportstats(struct controller_info *cntlr, const char *portspec,
+		   bool yaml);
+
 /* Set the port's timeout.  The parameters are all strings that the
    routine will convert to integers.  Error output will be generated
    on invalid data. */
@@ -86,18 +90,23 @@ void setportenable(struct controller_info *cntlr,
 		   const char *portspec,
 		   const char *enable);
 
-/* Start data monitoring on the given port, type may be either "tcp" or
-   "term" and only one direction may be monitored.  This return NULL if
-   the monitor fails.  The monitor output will go to the controller
-   via the controller_write() call. */
+/* Start data monitoring on the given port, type may be "tcp", "term"
+   or "both".  options is a NULL terminated list of monitor options.
+   This return NULL if the monitor fails.  The monitor output will go
+   to the controller via the controller_monitor_write() call. */
 void *data_monitor_start(struct controller_info *cntlr,
 			 const char *type,
-			 const char *portspec);
+			 const char *portspec,
+			 const char * const *options);
 
 /* Stop monitoring the given id. */
 void data_monitor_stop(struct controller_info *cntlr,
 		       void   *monitor_id);
 
+/* The controller has caught up with the monitor output. */
+void data_monitor_drained(struct controller_info *cntlr,
+			  void   *monitor_id);
+
 /* Shut down the port, if it is connected. */
 void disconnect_port(struct controller_info *cntlr,
 		     const char *portspec);
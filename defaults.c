@@ -28,6 +28,7 @@
 #include <gensio/gensio.h>
 #include "ser2net.h"
 #include "defaults.h"
+#include "port.h"
 
 #define PORT_BUFSIZE	64	/* Default data transfer buffer size */
 
@@ -44,6 +45,13 @@ struct default_data
     struct gensio_enum_val *enums;
 };
 
+struct gensio_enum_val slow_client_enums[] = {
+    { "block", SLOW_CLIENT_BLOCK },
+    { "drop", SLOW_CLIENT_DROP },
+    { "disconnect", SLOW_CLIENT_DISCONNECT },
+    { NULL }
+};
+
 static struct default_data defaults[] = {
     /* All port types */
     { "telnet-brk-on-sync",GENSIO_DEFAULT_BOOL,.def.intval = 0 },
@@ -55,12 +63,21 @@ static struct default_data defaults[] = {
 					.def.intval = 1000 },
     { "chardelay-max",	GENSIO_DEFAULT_INT,	.min = 1, .max = 1000000,
 					.def.intval = 20000 },
+    { "chardelay-adaptive", GENSIO_DEFAULT_BOOL,.def.intval = 0 },
     { "dev-to-net-bufsize", GENSIO_DEFAULT_INT,.min = 1, .max = 65536,
 					.def.intval = PORT_BUFSIZE },
     { "net-to-dev-bufsize", GENSIO_DEFAULT_INT,.min = 1, .max = 65536,
 					.def.intval = PORT_BUFSIZE },
+    { "net-to-dev-buffers", GENSIO_DEFAULT_INT,.min = 1, .max = 64,
+					.def.intval = 2 },
+    { "net-batch",	GENSIO_DEFAULT_BOOL,	.def.intval = 0 },
+    { "passthrough",	GENSIO_DEFAULT_BOOL,	.def.intval = 0 },
     { "max-connections", GENSIO_DEFAULT_INT,	.min=1, .max=65536,
 					.def.intval = 1 },
+    { "fanout-backlog", GENSIO_DEFAULT_INT,	.min=0, .max=16777216,
+					.def.intval = 0 },
+    { "slow-client",	GENSIO_DEFAULT_ENUM,	.enums = slow_client_enums,
+					.def.intval = SLOW_CLIENT_BLOCK },
     { "connector-retry-time", GENSIO_DEFAULT_INT, .min=1, .max=10000000,
 					.def.intval = 10 },
     { "accepter-retry-time", GENSIO_DEFAULT_INT, .min=1, .max=10000000,
@@ -119,6 +136,70 @@ setup_ser2net_defaults(void)
     return 0;
 }
 
+static char *defaults_sig;
+static gensiods defaults_sig_len;
+static gensiods defaults_sig_size;
+
+static int
+defaults_sig_add(const char *op, const char *class, const char *name,
+		 const char *value)
+{
+    const char *parts[4] = { op, class, name, value };
+    gensiods len = 0, i;
+    char *n;
+
+    for (i = 0; i < 4; i++)
+	len += (parts[i] ? strlen(parts[i]) : 0) + 1;
+    if (defaults_sig_len + len > defaults_sig_size) {
+	gensiods nsize = defaults_sig_size ? defaults_sig_size : 256;
+
+	while (nsize < defaults_sig_len + len)
+	    nsize *= 2;
+	n = realloc(defaults_sig, nsize);
+	if (!n)
+	    return GE_NOMEM;
+	defaults_sig = n;
+	defaults_sig_size = nsize;
+    }
+    for (i = 0; i < 4; i++) {
+	/* A missing value is an empty string followed by a 1, not 0. */
+	len = parts[i] ? strlen(parts[i]) : 0;
+	memcpy(defaults_sig + defaults_sig_len, parts[i] ? parts[i] : "", len);
+	defaults_sig_len += len;
+	defaults_sig[defaults_sig_len++] = parts[i] ? '\0' : '\1';
+    }
+    return 0;
+}
+
+int
+set_config_default(const char *class, const char *name, const char *value)
+{
+    int err;
+
+    err = gensio_set_default(so, class, name, value, 0);
+    if (!err)
+	err = defaults_sig_add("set", class, name, value);
+    return err;
+}
+
+int
+del_config_default(const char *class, const char *name)
+{
+    int err;
+
+    err = gensio_del_default(so, class, name, false);
+    if (!err)
+	err = defaults_sig_add("del", class, name, NULL);
+    return err;
+}
+
+const char *
+config_defaults_sig(gensiods *len)
+{
+    *len = defaults_sig_len;
+    return defaults_sig;
+}
+
 int
 setup_defaults(void)
 {
@@ -126,6 +207,7 @@ setup_defaults(void)
     int err;
     static bool defaults_added = false;
 
+    defaults_sig_len = 0;
     if (defaults_added) {
 	gensio_reset_defaults(so);
     } else {
@@ -30,6 +30,24 @@
 
 int setup_defaults(void);
 
+/*
+ * Set or delete a default from the configuration.  The changes are
+ * recorded, in order, so ports can tell if the defaults they were
+ * configured with are still the same on a reload.
+ */
+int set_config_default(const char *class, const char *name,
+		       const char *value);
+int del_config_default(const char *class, const char *name);
+
+/*
+ * Return the changes to the defaults made so far by the configuration
+ * in a canonical form.  The result is valid until the next change.
+ */
+const char *config_defaults_sig(gensiods *len);
+
+/* Values for the slow-client option. */
+extern struct gensio_enum_val slow_client_enums[];
+
 /* Return the default int/bool value for the given name. */
 int find_default_int(const char *name);
 bool find_default_bool(const char *name);
@@ -0,0 +1,160 @@
+/*
+ *  ser2net - A program for allowing telnet connection to serial ports
+ *  Copyright (C) 2001-2020  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ *
+ *  In addition, as a special exception, the copyright holders of
+ *  ser2net give you permission to combine ser2net with free software
+ *  programs or libraries that are released under the GNU LGPL and
+ *  with code included in the standard release of OpenSSL under the
+ *  OpenSSL license (or modified versions of such code, with unchanged
+ *  license). You may copy and distribute such a system following the
+ *  terms of the GNU GPL for ser2net and the licenses of the other code
+ *  concerned, provided that you include the source code of that
+ *  other code when and as the GNU GPL requires distribution of source
+ *  code.
+ *
+ *  Note that people who make modified versions of ser2net are not
+ *  obligated to grant this special exception for their modified
+ *  versions; it is their choice whether to do so. The GNU General
+ *  Public License gives permission to release a modified version
+ *  without this exception; this exception also makes it possible to
+ *  release a modified version which carries forward this exception.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "fanout.h"
+
+struct fanout_chunk *
+fanout_ring_add(struct fanout_ring *ring, const unsigned char *data,
+		gensiods len)
+{
+    struct fanout_chunk *chunk;
+
+    chunk = malloc(sizeof(*chunk) + len);
+    if (!chunk)
+	return NULL;
+
+    chunk->next = NULL;
+    chunk->refcount = 0;
+    chunk->len = len;
+    memcpy(chunk->data, data, len);
+
+    if (ring->tail)
+	ring->tail->next = chunk;
+    else
+	ring->head = chunk;
+    ring->tail = chunk;
+    ring->size += len;
+
+    return chunk;
+}
+
+/*
+ * A cursor holds a reference to every chunk from its current chunk
+ * to the tail, so chunks always become unreferenced in order from
+ * the head.
+ */
+void
+fanout_ring_trim(struct fanout_ring *ring)
+{
+    struct fanout_chunk *chunk;
+
+    while (ring->head && ring->head->refcount == 0) {
+	chunk = ring->head;
+	ring->head = chunk->next;
+	ring->size -= chunk->len;
+	free(chunk);
+    }
+    if (!ring->head)
+	ring->tail = NULL;
+}
+
+void
+fanout_ring_free(struct fanout_ring *ring)
+{
+    struct fanout_chunk *chunk;
+
+    while (ring->head) {
+	chunk = ring->head;
+	ring->head = chunk->next;
+	free(chunk);
+    }
+    ring->tail = NULL;
+    ring->size = 0;
+}
+
+void
+fanout_cursor_queue(struct fanout_cursor *cursor, struct fanout_chunk *chunk)
+{
+    chunk->refcount++;
+    if (!cursor->chunk) {
+	cursor->chunk = chunk;
+	cursor->pos = 0;
+    }
+    cursor->queued += chunk->len;
+}
+
+/* Drop the reference to the cursor's current chunk and move to the next. */
+static void
+fanout_cursor_next(struct fanout_cursor *cursor)
+{
+    struct fanout_chunk *chunk = cursor->chunk;
+
+    cursor->queued -= chunk->len - cursor->pos;
+    cursor->pos = 0;
+    assert(chunk->refcount > 0);
+    chunk->refcount--;
+    if (cursor->queued)
+	cursor->chunk = chunk->next;
+    else
+	cursor->chunk = NULL;
+}
+
+void
+fanout_cursor_advance(struct fanout_ring *ring, struct fanout_cursor *cursor,
+		      gensiods count)
+{
+    gensiods left;
+
+    while (count && cursor->chunk) {
+	left = cursor->chunk->len - cursor->pos;
+	if (count < left) {
+	    cursor->pos += count;
+	    cursor->queued -= count;
+	    break;
+	}
+	count -= left;
+	fanout_cursor_next(cursor);
+    }
+    fanout_ring_trim(ring);
+}
+
+gensiods
+fanout_cursor_trim(struct fanout_ring *ring, struct fanout_cursor *cursor,
+		   gensiods maxqueued)
+{
+    gensiods dropped = 0, left;
+
+    while (cursor->queued > maxqueued && cursor->chunk
+		&& cursor->chunk != ring->tail) {
+	left = cursor->chunk->len - cursor->pos;
+	dropped += left;
+	fanout_cursor_next(cursor);
+    }
+    if (dropped)
+	fanout_ring_trim(ring);
+
+    return dropped;
+}
+
+void
+fanout_cursor_release(struct fanout_ring *ring, struct fanout_cursor *cursor)
+{
+    while (cursor->chunk)
+	fanout_cursor_next(cursor);
+    fanout_ring_trim(ring);
+}
@@ -0,0 +1,99 @@
+/*
+ *  ser2net - A program for allowing telnet connection to serial ports
+ *  Copyright (C) 2001-2020  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ *
+ *  In addition, as a special exception, the copyright holders of
+ *  ser2net give you permission to combine ser2net with free software
+ *  programs or libraries that are released under the GNU LGPL and
+ *  with code included in the standard release of OpenSSL under the
+ *  OpenSSL license (or modified versions of such code, with unchanged
+ *  license). You may copy and distribute such a system following the
+ *  terms of the GNU GPL for ser2net and the licenses of the other code
+ *  concerned, provided that you include the source code of that
+ *  other code when and as the GNU GPL requires distribution of source
+ *  code.
+ *
+ *  Note that people who make modified versions of ser2net are not
+ *  obligated to grant this special exception for their modified
+ *  versions; it is their choice whether to do so. The GNU General
+ *  Public License gives permission to release a modified version
+ *  without this exception; this exception also makes it possible to
+ *  release a modified version which carries forward this exception.
+ */
+
+/*
+ * A chunked ring for fanning out data from the device to multiple
+ * network connections.  Each chunk is written into the ring once and
+ * referenced by every connection that has not sent it yet; each
+ * connection keeps its own cursor into the ring.  A chunk is freed
+ * when the last connection is done with it.
+ */
+
+#ifndef FANOUT
+#define FANOUT
+
+#include <gensio/gensio.h>
+
+struct fanout_chunk {
+    struct fanout_chunk *next;
+    unsigned int refcount;	/* Number of cursors that still need this. */
+    gensiods len;
+    unsigned char data[];
+};
+
+struct fanout_ring {
+    struct fanout_chunk *head;	/* Oldest chunk. */
+    struct fanout_chunk *tail;	/* Newest chunk. */
+    gensiods size;		/* Bytes held by all chunks in the ring. */
+};
+
+struct fanout_cursor {
+    struct fanout_chunk *chunk;	/* Next chunk to send, NULL if none. */
+    gensiods pos;		/* Position in chunk to send next. */
+    gensiods queued;		/* Total bytes left to send. */
+};
+
+/*
+ * Add a new chunk holding a copy of data to the end of the ring.  The
+ * chunk starts with no references, use fanout_cursor_queue() to add
+ * it to each cursor that should send it.  Returns NULL on out of
+ * memory.
+ */
+struct fanout_chunk *fanout_ring_add(struct fanout_ring *ring,
+				     const unsigned char *data, gensiods len);
+
+/*
+ * Free any chunks without references at the head of the ring.  This
+ * must be called after fanout_ring_add() if no cursor took the chunk.
+ */
+void fanout_ring_trim(struct fanout_ring *ring);
+
+/* Free everything in the ring, used when the port is freed. */
+void fanout_ring_free(struct fanout_ring *ring);
+
+/* Queue the chunk on the cursor. */
+void fanout_cursor_queue(struct fanout_cursor *cursor,
+			 struct fanout_chunk *chunk);
+
+/*
+ * Mark count bytes as sent from the cursor, dropping references to
+ * chunks that have been completely sent.
+ */
+void fanout_cursor_advance(struct fanout_ring *ring,
+			   struct fanout_cursor *cursor, gensiods count);
+
+/*
+ * Drop the oldest queued chunks until no more than maxqueued bytes
+ * are queued on the cursor.  The newest chunk is never dropped.
+ * Returns the number of bytes dropped.
+ */
+gensiods fanout_cursor_trim(struct fanout_ring *ring,
+			    struct fanout_cursor *cursor, gensiods maxqueued);
+
+/* Drop everything queued on the cursor. */
+void fanout_cursor_release(struct fanout_ring *ring,
+			   struct fanout_cursor *cursor);
+
+#endif /* FANOUT */
@@ -0,0 +1,237 @@
+/*
+ *  ser2net - A program for allowing telnet connection to serial ports
+ *  Copyright (C) 2001-2020  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ *
+ *  In addition, as a special exception, the copyright holders of
+ *  ser2net give you permission to combine ser2net with free software
+ *  programs or libraries that are released under the GNU LGPL and
+ *  with code included in the standard release of OpenSSL under the
+ *  OpenSSL license (or modified versions of such code, with unchanged
+ *  license). You may copy and distribute such a system following the
+ *  terms of the GNU GPL for ser2net and the licenses of the other code
+ *  concerned, provided that you include the source code of that
+ *  other code when and as the GNU GPL requires distribution of source
+ *  code.
+ *
+ *  Note that people who make modified versions of ser2net are not
+ *  obligated to grant this special exception for their modified
+ *  versions; it is their choice whether to do so. The GNU General
+ *  Public License gives permission to release a modified version
+ *  without this exception; this exception also makes it possible to
+ *  release a modified version which carries forward this exception.
+ */
+
+/* This code handles finding frames in device data. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "framer.h"
+
+#define STRMATCH_NONE	0xffff
+#define STRMATCH_MAX_STATES 0xfffe
+
+struct strmatch {
+    unsigned int nstates;
+
+    /* The next state for each state and input byte. */
+    uint16_t *next;
+
+    /* Set if a string ends at this state. */
+    bool *accept;
+};
+
+struct strmatch *
+strmatch_alloc(const char * const *strs, const gensiods *lens,
+	       unsigned int nstrs)
+{
+    struct strmatch *m;
+    unsigned int i, s, t, c, nstates = 1, maxstates = 1;
+    unsigned int qhead = 0, qtail = 0;
+    uint16_t *fail = NULL, *queue = NULL;
+    gensiods j;
+
+    for (i = 0; i < nstrs; i++)
+	maxstates += lens[i];
+    if (maxstates == 1 || maxstates > STRMATCH_MAX_STATES)
+	return NULL;
+
+    m = calloc(1, sizeof(*m));
+    if (!m)
+	return NULL;
+    m->next = malloc(maxstates * 256 * sizeof(*m->next));
+    m->accept = calloc(maxstates, sizeof(*m->accept));
+    fail = calloc(maxstates, sizeof(*fail));
+    queue = malloc(maxstates * sizeof(*queue));
+    if (!m->next || !m->accept || !fail || !queue)
+	goto out_err;
+    memset(m->next, 0xff, maxstates * 256 * sizeof(*m->next));
+
+    /* Build the trie of the strings. */
+    for (i = 0; i < nstrs; i++) {
+	if (lens[i] == 0)
+	    continue;
+	s = 0;
+	for (j = 0; j < lens[i]; j++) {
+	    c = (unsigned char) strs[i][j];
+	    if (m->next[s * 256 + c] == STRMATCH_NONE)
+		m->next[s * 256 + c] = nstates++;
+	    s = m->next[s * 256 + c];
+	}
+	m->accept[s] = true;
+    }
+
+    /*
+     * Go through the trie breadth first, setting each state's failure
+     * state and filling in the missing transitions from it.  The
+     * failure state is always shallower, so it is already complete.
+     */
+    for (c = 0; c < 256; c++) {
+	t = m->next[c];
+	if (t == STRMATCH_NONE) {
+	    m->next[c] = 0;
+	} else {
+	    fail[t] = 0;
+	    queue[qtail++] = t;
+	}
+    }
+    while (qhead < qtail) {
+	s = queue[qhead++];
+	for (c = 0; c < 256; c++) {
+	    t = m->next[s * 256 + c];
+	    if (t == STRMATCH_NONE) {
+		m->next[s * 256 + c] = m->next[fail[s] * 256 + c];
+	    } else {
+		fail[t] = m->next[fail[s] * 256 + c];
+		if (m->accept[fail[t]])
+		    m->accept[t] = true;
+		queue[qtail++] = t;
+	    }
+	}
+    }
+
+    m->nstates = nstates;
+    free(fail);
+    free(queue);
+    return m;
+
+ out_err:
+    free(fail);
+    free(queue);
+    strmatch_free(m);
+    return NULL;
+}
+
+void
+strmatch_free(struct strmatch *m)
+{
+    if (!m)
+	return;
+    free(m->next);
+    free(m->accept);
+    free(m);
+}
+
+gensiods
+strmatch_scan(const struct strmatch *m, unsigned int *state,
+	      const unsigned char *buf, gensiods len)
+{
+    unsigned int s = *state;
+    gensiods i;
+
+    for (i = 0; i < len; i++) {
+	s = m->next[s * 256 + buf[i]];
+	if (m->accept[s]) {
+	    *state = 0;
+	    return i + 1;
+	}
+    }
+    *state = s;
+    return 0;
+}
+
+void
+framer_reset(struct framer *f)
+{
+    f->state = 0;
+    f->pos = 0;
+    f->frame_len = 0;
+    f->field = 0;
+}
+
+static gensiods
+framer_scan_length(struct framer *f, const unsigned char *buf,
+		   gensiods len, bool *done)
+{
+    gensiods count = 0, hdrend = f->len_offset + f->len_size, n;
+    unsigned int shift;
+
+    /* Pick up the length field as it comes in. */
+    while (f->frame_len == 0 && count < len) {
+	if (f->pos >= f->len_offset) {
+	    shift = f->pos - f->len_offset;
+	    if (f->len_le)
+		f->field |= (uint32_t) buf[count] << (shift * 8);
+	    else
+		f->field = (f->field << 8) | buf[count];
+	}
+	count++;
+	f->pos++;
+	if (f->pos == hdrend) {
+	    int64_t flen = (int64_t) f->field + f->len_adjust;
+
+	    /* A bad length just ends the frame after the field. */
+	    if (flen < (int64_t) hdrend)
+		flen = hdrend;
+	    f->frame_len = flen;
+	}
+    }
+
+    if (f->frame_len) {
+	n = f->frame_len - f->pos;
+	if (n > len - count)
+	    n = len - count;
+	count += n;
+	f->pos += n;
+	if (f->pos == f->frame_len) {
+	    *done = true;
+	    framer_reset(f);
+	}
+    }
+
+    return count;
+}
+
+gensiods
+framer_scan(struct framer *f, const unsigned char *buf, gensiods len,
+	    bool *done)
+{
+    gensiods count;
+
+    *done = false;
+    switch (f->type) {
+    case FRAMER_LENGTH:
+	return framer_scan_length(f, buf, len, done);
+
+    case FRAMER_DELIM:
+	count = strmatch_scan(f->delims, &f->state, buf, len);
+	if (count) {
+	    *done = true;
+	    return count;
+	}
+	return len;
+
+    default:
+	return len;
+    }
+}
+
+void
+framer_free(struct framer *f)
+{
+    strmatch_free(f->delims);
+    f->delims = NULL;
+    f->type = FRAMER_NONE;
+}
@@ -0,0 +1,113 @@
+/*
+ *  ser2net - A program for allowing telnet connection to serial ports
+ *  Copyright (C) 2001-2020  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ *
+ *  In addition, as a special exception, the copyright holders of
+ *  ser2net give you permission to combine ser2net with free software
+ *  programs or libraries that are released under the GNU LGPL and
+ *  with code included in the standard release of OpenSSL under the
+ *  OpenSSL license (or modified versions of such code, with unchanged
+ *  license). You may copy and distribute such a system following the
+ *  terms of the GNU GPL for ser2net and the licenses of the other code
+ *  concerned, provided that you include the source code of that
+ *  other code when and as the GNU GPL requires distribution of source
+ *  code.
+ *
+ *  Note that people who make modified versions of ser2net are not
+ *  obligated to grant this special exception for their modified
+ *  versions; it is their choice whether to do so. The GNU General
+ *  Public License gives permission to release a modified version
+ *  without this exception; this exception also makes it possible to
+ *  release a modified version which carries forward this exception.
+ */
+
+#ifndef FRAMER
+#define FRAMER
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <gensio/gensio.h>
+
+/*
+ * Multi-string matching.  The strings are compiled into an
+ * Aho-Corasick automaton, fully expanded so every byte is a single
+ * table lookup.  A match is found even if it overlaps a partial
+ * match of the same or another string, which a simple compare that
+ * restarts on a mismatch would miss.
+ */
+struct strmatch;
+
+/*
+ * Compile the strings.  Empty strings are ignored.  Returns NULL if
+ * out of memory, or if there are no non-empty strings.
+ */
+struct strmatch *strmatch_alloc(const char * const *strs,
+				const gensiods *lens, unsigned int nstrs);
+
+void strmatch_free(struct strmatch *m);
+
+/*
+ * Scan buf for a match, continuing from the state in *state, which
+ * should start at zero.  On a match, returns the number of bytes up
+ * to and including the end of the match, and the state is reset.
+ * If no match, returns 0 and *state is updated for the next call.
+ */
+gensiods strmatch_scan(const struct strmatch *m, unsigned int *state,
+		       const unsigned char *buf, gensiods len);
+
+/*
+ * A framer decides where the frames are in the data coming from the
+ * device so each one can be sent to the network in one write.
+ */
+enum framer_type {
+    FRAMER_NONE,
+
+    /* A frame ends after 3.5 character times of silence. */
+    FRAMER_MODBUS_RTU,
+
+    /* A frame length field at a fixed offset in the frame. */
+    FRAMER_LENGTH,
+
+    /* A frame ends with one of a set of strings. */
+    FRAMER_DELIM
+};
+
+struct framer {
+    enum framer_type type;
+
+    /*
+     * For FRAMER_LENGTH, the frame is len_size bytes at len_offset,
+     * plus len_adjust.
+     */
+    unsigned int len_offset;
+    unsigned int len_size;
+    int len_adjust;
+    bool len_le;
+
+    /* For FRAMER_DELIM. */
+    struct strmatch *delims;
+
+    /* Where we are in the current frame. */
+    unsigned int state;
+    gensiods pos;
+    gensiods frame_len;
+    uint32_t field;
+};
+
+/* Start looking for a new frame, when the device is opened. */
+void framer_reset(struct framer *f);
+
+/*
+ * Look at len bytes from the device.  Returns the number of bytes
+ * that belong to the current frame.  If that finishes the frame,
+ * *done is set to true.  FRAMER_NONE and FRAMER_MODBUS_RTU just
+ * take everything, modbus frames are ended by a timer.
+ */
+gensiods framer_scan(struct framer *f, const unsigned char *buf,
+		     gensiods len, bool *done);
+
+void framer_free(struct framer *f);
+
+#endif /* FRAMER */
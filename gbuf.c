@@ -26,8 +26,197 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <stdbool.h>
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
 #include "gbuf.h"
 
+/*
+ * Buffer memory comes from a pool of power of two size classes, from
+ * 64 bytes to 128K, so the per-connection banner and string buffers
+ * and the port buffers freed on a reconfig get reused instead of
+ * going back to malloc.  Larger buffers use malloc directly.  Each
+ * thread keeps a few free buffers per class to avoid the pool lock,
+ * the rest are shared, up to GBUF_POOL_BYTES for all the classes
+ * together.  A thread's buffers go back to the pool when it exits.
+ */
+#define GBUF_MIN_SHIFT		6
+#define GBUF_NUM_CLASSES	12
+#define GBUF_POOL_BYTES		(8 * 1024 * 1024)
+#define GBUF_CACHE_MAX		8
+
+#define GBUF_CLASS_SIZE(c)	((gensiods) 1 << ((c) + GBUF_MIN_SHIFT))
+
+struct gbuf_freemem {
+    struct gbuf_freemem *next;
+};
+
+struct gbuf_freelist {
+    struct gbuf_freemem *head;
+    unsigned int count;
+};
+
+static struct gbuf_freelist gbuf_pool[GBUF_NUM_CLASSES];
+static gensiods gbuf_pool_bytes;
+
+#ifdef USE_PTHREADS
+static pthread_mutex_t gbuf_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+#define POOL_LOCK() pthread_mutex_lock(&gbuf_pool_lock)
+#define POOL_UNLOCK() pthread_mutex_unlock(&gbuf_pool_lock)
+static pthread_once_t gbuf_cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t gbuf_cache_key;
+static bool gbuf_cache_key_ok;
+static __thread struct gbuf_freelist *gbuf_cache;
+#else
+#define POOL_LOCK() do { } while (0)
+#define POOL_UNLOCK() do { } while (0)
+#endif
+
+/* Return the size class for the size, or -1 if it is too big. */
+static int
+gbuf_class(gensiods size)
+{
+    int c = 0;
+
+    while (c < GBUF_NUM_CLASSES && GBUF_CLASS_SIZE(c) < size)
+	c++;
+    return c < GBUF_NUM_CLASSES ? c : -1;
+}
+
+/* Put m in the shared pool if there is room, free it if not. */
+static void
+gbuf_pool_put(int c, struct gbuf_freemem *m)
+{
+    POOL_LOCK();
+    if (gbuf_pool_bytes + GBUF_CLASS_SIZE(c) <= GBUF_POOL_BYTES) {
+	m->next = gbuf_pool[c].head;
+	gbuf_pool[c].head = m;
+	gbuf_pool[c].count++;
+	gbuf_pool_bytes += GBUF_CLASS_SIZE(c);
+	m = NULL;
+    }
+    POOL_UNLOCK();
+    if (m)
+	free(m);
+}
+
+#ifdef USE_PTHREADS
+/* Called at thread exit, hand the thread's buffers to the pool. */
+static void
+gbuf_cache_destroy(void *data)
+{
+    struct gbuf_freelist *cache = data;
+    struct gbuf_freemem *m;
+    int c;
+
+    gbuf_cache = NULL;
+    for (c = 0; c < GBUF_NUM_CLASSES; c++) {
+	while (cache[c].head) {
+	    m = cache[c].head;
+	    cache[c].head = m->next;
+	    gbuf_pool_put(c, m);
+	}
+    }
+    free(cache);
+}
+
+static void
+gbuf_cache_key_init(void)
+{
+    gbuf_cache_key_ok = pthread_key_create(&gbuf_cache_key,
+					   gbuf_cache_destroy) == 0;
+}
+
+/*
+ * Return the thread's cache, allocating it on first use.  NULL means
+ * the thread goes straight to the pool.
+ */
+static struct gbuf_freelist *
+gbuf_get_cache(void)
+{
+    struct gbuf_freelist *cache;
+
+    if (gbuf_cache)
+	return gbuf_cache;
+
+    pthread_once(&gbuf_cache_once, gbuf_cache_key_init);
+    if (!gbuf_cache_key_ok)
+	return NULL;
+    cache = calloc(GBUF_NUM_CLASSES, sizeof(*cache));
+    if (!cache)
+	return NULL;
+    if (pthread_setspecific(gbuf_cache_key, cache)) {
+	free(cache);
+	return NULL;
+    }
+    gbuf_cache = cache;
+    return cache;
+}
+#endif
+
+void *
+gbuf_mem_alloc(gensiods size)
+{
+    int c = gbuf_class(size);
+    struct gbuf_freemem *m = NULL;
+#ifdef USE_PTHREADS
+    struct gbuf_freelist *cache;
+#endif
+
+    if (c < 0)
+	return malloc(size);
+
+#ifdef USE_PTHREADS
+    cache = gbuf_cache;
+    if (cache && cache[c].head) {
+	m = cache[c].head;
+	cache[c].head = m->next;
+	cache[c].count--;
+	return m;
+    }
+#endif
+    POOL_LOCK();
+    if (gbuf_pool[c].head) {
+	m = gbuf_pool[c].head;
+	gbuf_pool[c].head = m->next;
+	gbuf_pool[c].count--;
+	gbuf_pool_bytes -= GBUF_CLASS_SIZE(c);
+    }
+    POOL_UNLOCK();
+    if (!m)
+	m = malloc(GBUF_CLASS_SIZE(c));
+    return m;
+}
+
+void
+gbuf_mem_free(void *mem, gensiods size)
+{
+    int c = gbuf_class(size);
+    struct gbuf_freemem *m = mem;
+#ifdef USE_PTHREADS
+    struct gbuf_freelist *cache;
+#endif
+
+    if (!mem)
+	return;
+    if (c < 0) {
+	free(mem);
+	return;
+    }
+
+#ifdef USE_PTHREADS
+    cache = gbuf_get_cache();
+    if (cache && cache[c].count < GBUF_CACHE_MAX) {
+	m->next = cache[c].head;
+	cache[c].head = m;
+	cache[c].count++;
+	return;
+    }
+#endif
+    gbuf_pool_put(c, m);
+}
+
 gensiods
 gbuf_room_left(struct gbuf *buf) {
     return buf->maxsize - buf->cursize;
@@ -57,7 +246,7 @@ gbuf_reset(struct gbuf *buf)
 int
 gbuf_init(struct gbuf *buf, gensiods size)
 {
-    buf->buf = malloc(size);
+    buf->buf = gbuf_mem_alloc(size);
     if (!buf->buf)
 	return ENOMEM;
 
@@ -66,10 +255,49 @@ gbuf_init(struct gbuf *buf, gensiods size)
     return 0;
 }
 
+void
+gbuf_cleanup(struct gbuf *buf)
+{
+    gbuf_mem_free(buf->buf, buf->maxsize);
+    buf->buf = NULL;
+}
+
+struct gbuf *
+gbuf_alloc(gensiods size)
+{
+    struct gbuf *buf;
+
+    /* Keep the header and data together, one allocation. */
+    buf = gbuf_mem_alloc(sizeof(*buf) + size);
+    if (!buf)
+	return NULL;
+    buf->buf = (unsigned char *) (buf + 1);
+    buf->maxsize = size;
+    gbuf_reset(buf);
+    return buf;
+}
+
+struct gbuf *
+gbuf_alloc_ref(const unsigned char *data, gensiods len)
+{
+    struct gbuf *buf;
+
+    buf = gbuf_mem_alloc(sizeof(*buf));
+    if (!buf)
+	return NULL;
+    buf->buf = (unsigned char *) data;
+    buf->maxsize = len;
+    buf->cursize = len;
+    buf->pos = 0;
+    return buf;
+}
+
 void
 gbuf_free(struct gbuf *buf)
 {
-    if (buf->buf)
-	free(buf->buf);
-    free(buf);
+    if (buf->buf != (unsigned char *) (buf + 1))
+	/* From gbuf_alloc_ref(), the data isn't ours. */
+	gbuf_mem_free(buf, sizeof(*buf));
+    else
+	gbuf_mem_free(buf, sizeof(*buf) + buf->maxsize);
 }
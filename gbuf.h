@@ -43,8 +43,26 @@ gensiods gbuf_cursize(struct gbuf *buf);
 
 void gbuf_reset(struct gbuf *buf);
 
+/*
+ * Buffer memory is pooled by size class, gbuf_mem_free() must be
+ * given the same size passed to gbuf_mem_alloc().
+ */
+void *gbuf_mem_alloc(gensiods size);
+void gbuf_mem_free(void *mem, gensiods size);
+
+/* Set up and release a gbuf embedded in another structure. */
 int gbuf_init(struct gbuf *buf, gensiods size);
+void gbuf_cleanup(struct gbuf *buf);
 
+/* Allocate and free a standalone gbuf holding size bytes. */
+struct gbuf *gbuf_alloc(gensiods size);
 void gbuf_free(struct gbuf *buf);
 
+/*
+ * Allocate a gbuf holding len bytes of data owned by someone else,
+ * which must not change or go away before the gbuf is freed.  Only
+ * pos may be modified in the result.
+ */
+struct gbuf *gbuf_alloc_ref(const unsigned char *data, gensiods len);
+
 #endif /* GBUF */
@@ -30,6 +30,9 @@
 #include <stdio.h>
 #include <syslog.h>
 
+#include <gensio/gensio.h>
+
+#include "ser2net.h"
 #include "led.h"
 #include "led_sysfs.h"
 
@@ -39,6 +42,9 @@ static struct led_driver_s *led_drivers = NULL;
 /* all LEDs in the system. */
 static struct led_s *leds = NULL;
 
+/* LEDs from the previous configuration, see retire_leds(). */
+static struct led_s *retired_leds = NULL;
+
 static struct led_driver_s *
 led_driver_by_name(const char *name)
 {
@@ -85,6 +91,119 @@ find_led(const char *name)
     return NULL;
 }
 
+/*
+ * A coalescing LED can only be freed when its timer is stopped and no
+ * timer handler is in the driver's flash.  Call with led->lock held.
+ */
+static bool
+led_can_free(struct led_s *led)
+{
+    return led->dying && !led->timer_running && !led->in_flash;
+}
+
+static void led_free_now(struct led_s *led);
+
+/*
+ * The coalescing timer.  A flash is done if any came in since the
+ * last one, then the window is waited out before the next.
+ */
+static void
+led_timeout(struct gensio_timer *timer, void *cb_data)
+{
+    struct led_s *led = cb_data;
+    gensio_time timeout;
+    bool do_flash = false, do_free;
+
+    so->lock(led->lock);
+    if (led->dying) {
+	led->timer_running = false;
+    } else {
+	do_flash = led->flash_pending;
+	led->flash_pending = false;
+	if (do_flash) {
+	    memset(&timeout, 0, sizeof(timeout));
+	    add_usec_to_time(&timeout, led->flash_window * 1000);
+	    so->start_timer(led->timer, &timeout);
+	    led->in_flash++;
+	} else {
+	    led->timer_running = false;
+	}
+    }
+    do_free = led_can_free(led);
+    so->unlock(led->lock);
+
+    if (do_flash) {
+	led->driver->flash(led->drv_data);
+	so->lock(led->lock);
+	led->in_flash--;
+	do_free = led_can_free(led);
+	so->unlock(led->lock);
+    }
+    if (do_free)
+	led_free_now(led);
+}
+
+static void
+led_free_now(struct led_s *led)
+{
+    /* let driver deconfigure the LED */
+    if (led->driver->deconfigure)
+	led->driver->deconfigure(led->drv_data);
+
+    /* let driver free its own data when it registered a cleanup function */
+    if (led->driver->free)
+	led->driver->free(led);
+
+    if (led->timer)
+	so->free_timer(led->timer);
+    if (led->lock)
+	so->free_lock(led->lock);
+    free(led->name);
+    free(led);
+}
+
+static void
+led_timer_stopped(struct gensio_timer *timer, void *cb_data)
+{
+    struct led_s *led = cb_data;
+    bool do_free;
+
+    so->lock(led->lock);
+    led->timer_running = false;
+    do_free = led_can_free(led);
+    so->unlock(led->lock);
+    if (do_free)
+	led_free_now(led);
+}
+
+/*
+ * Mark the LED dead and free it once nothing is using it.  If the
+ * timer is in its handler, the handler does the free.
+ */
+static void
+led_free(struct led_s *led)
+{
+    bool do_free;
+
+    if (!led->timer) {
+	led_free_now(led);
+	return;
+    }
+
+    so->lock(led->lock);
+    led->dying = true;
+    /*
+     * If the stop times out the handler is running or about to,
+     * it will see dying.  Otherwise led_timer_stopped() is called.
+     */
+    if (led->timer_running)
+	so->stop_timer_with_done(led->timer, led_timer_stopped, led);
+    do_free = led_can_free(led);
+    so->unlock(led->lock);
+    if (do_free)
+	led_free_now(led);
+}
+
 int
 add_led(const char *name, const char *driverstr, const char * const *options,
 	int lineno)
@@ -142,33 +261,83 @@ add_led(const char *name, const char *driverstr, const char * const *options,
 	}
     }
 
+    if (led->flash_window) {
+	led->lock = so->alloc_lock(so);
+	if (led->lock)
+	    led->timer = so->alloc_timer(so, led_timeout, led);
+	if (!led->timer) {
+	    syslog(LOG_ERR, "Out of memory handling LED '%s' on %d",
+		   name, lineno);
+	    led_free_now(led);
+	    return -1;
+	}
+    }
+
     led->next = leds;
     leds = led;
     return 0;
 }
 
+/*
+ * Ports keep pointers to their LEDs, so the LEDs of the old
+ * configuration are put aside while a new one is read.  Once the
+ * ports have been moved over with led_rebind(), free_retired_leds()
+ * gets rid of them.
+ */
 void
-free_leds(void)
+retire_leds(void)
 {
+    struct led_s *led;
+
     while (leds) {
-	struct led_s *led = leds;
-	leds = leds->next;
+	led = leds;
+	leds = led->next;
+	led->retired = true;
+	led->next = retired_leds;
+	retired_leds = led;
+    }
+}
 
-	/* let driver deconfigure the LED */
-	if (led->driver->deconfigure)
-	    led->driver->deconfigure(led);
+struct led_s *
+led_rebind(struct led_s *led)
+{
+    if (!led || !led->retired)
+	return led;
+    return find_led(led->name);
+}
 
-	/* let driver free its own data when it registered a cleanup function */
-	if (led->driver->free)
-	    led->driver->free(led);
+void
+free_retired_leds(void)
+{
+    struct led_s *led;
 
-	free(led->name);
-	free(led);
+    while (retired_leds) {
+	led = retired_leds;
+	retired_leds = led->next;
+	led_free(led);
     }
 }
 
 int
 led_flash(struct led_s *led)
 {
-    return led->driver->flash(led->drv_data);
+    gensio_time timeout;
+
+    if (!led->flash_window)
+	return led->driver->flash(led->drv_data);
+
+    /* Just note it, the timer does the work. */
+    so->lock(led->lock);
+    if (led->dying) {
+	so->unlock(led->lock);
+	return 0;
+    }
+    led->flash_pending = true;
+    if (!led->timer_running) {
+	led->timer_running = true;
+	memset(&timeout, 0, sizeof(timeout));
+	so->start_timer(led->timer, &timeout);
+    }
+    so->unlock(led->lock);
+    return 0;
 }
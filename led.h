@@ -27,7 +27,11 @@
 #ifndef LED_H
 #define LED_H
 
+#include <stdbool.h>
+
 struct led_driver_s;
+struct gensio_lock;
+struct gensio_timer;
 
 struct led_s
 {
@@ -36,6 +40,22 @@ struct led_s
 
     struct led_driver_s *driver;
     void *drv_data;
+
+    /*
+     * Coalescing mode.  If the driver's init sets flash_window (in
+     * milliseconds), led_flash() only notes that a flash is wanted,
+     * and the driver's flash is called from a timer, at most once per
+     * window.  Otherwise the driver's flash is called directly.
+     */
+    unsigned int flash_window;
+    struct gensio_lock *lock;
+    struct gensio_timer *timer;
+    bool timer_running;
+    bool flash_pending;
+    unsigned int in_flash;	/* Timer handlers in the driver's flash. */
+    bool dying;			/* Being freed, don't flash or rearm. */
+
+    bool retired;		/* From a previous configuration. */
 };
 
 struct led_driver_s {
@@ -51,7 +71,10 @@ struct led_driver_s {
     /* optional: called once during initialization, prepares the LED */
     int (*configure)(void *drv_data, int lineno);
 
-    /* required: called when data transfer should be signaled */
+    /*
+     * required: called when data transfer should be signaled.  In
+     * coalescing mode this is called from a timer, not the data path.
+     */
     int (*flash)(void *drv_data);
 
     /* optional: called during deinitialization, could switch the LED off */
@@ -71,8 +94,17 @@ int add_led(const char *name, const char *driverstr,
 /* Search for a LED by name */
 struct led_s *find_led(const char *name);
 
-/* Free all registered LEDs in the system */
-void free_leds(void);
+/*
+ * Put all the current LEDs aside before reading a new configuration.
+ * They stay valid until free_retired_leds().
+ */
+void retire_leds(void);
+
+/* Return the current LED with the same name as a retired one, or NULL. */
+struct led_s *led_rebind(struct led_s *led);
+
+/* Free the retired LEDs, no port may be using them any more. */
+void free_retired_leds(void);
 
 /* Flash the given LED */
 int led_flash(struct led_s *led);
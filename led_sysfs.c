@@ -49,6 +49,7 @@ struct led_sysfs_s
     char *device;
     int state;
     int duration;
+    int activate_fd; /* Kept open for flashing, -1 if not open. */
 };
 
 static int
@@ -81,6 +82,25 @@ led_is_trigger_missing(const char *led)
     return trigger == NULL;
 }
 
+static int
+led_open(const char *led, const char *property, int lineno)
+{
+    char filename[255];
+    int fd;
+    char linestr[100] = "";
+
+    snprintf(filename, sizeof(filename), "%s/%s/%s",
+	     SYSFS_LED_BASE, led, property);
+
+    if ((fd = open(filename, O_WRONLY | O_TRUNC | O_CLOEXEC)) == -1) {
+	if (lineno)
+	    snprintf(linestr, sizeof(linestr), "on line %d ", lineno);
+	syslog(LOG_ERR, "Unable to open to LED %s%s: %s", linestr, led,
+	       strerror(errno));
+    }
+    return fd;
+}
+
 static int
 led_write(const char *led, const char *property, const char *buf, int lineno)
 {
@@ -129,6 +149,7 @@ led_sysfs_init(struct led_s *led, const char * const *options, int lineno)
 
     /* preset to detect default and/or wrong user input */
     drv_data->state = -1;
+    drv_data->activate_fd = -1;
 
     for (i = 0; options[i]; i++) {
 	value = strchr(options[i], '=');
@@ -195,6 +216,13 @@ led_sysfs_init(struct led_s *led, const char * const *options, int lineno)
 
     led->drv_data = (void *)drv_data;
 
+    /*
+     * The transient trigger keeps the LED on for the duration after
+     * an activate, more activates in that time don't do anything
+     * visible.  So only do one per duration.
+     */
+    led->flash_window = drv_data->duration;
+
     return 0;
 
  out_err:
@@ -207,6 +235,8 @@ led_sysfs_free(struct led_s *led)
 {
     struct led_sysfs_s *ctx = (struct led_sysfs_s *)led->drv_data;
 
+    if (ctx->activate_fd != -1)
+	close(ctx->activate_fd);
     free(ctx->device);
     free(ctx);
 
@@ -241,6 +271,9 @@ led_sysfs_configure(void *led_driver_data, int lineno)
     snprintf(buffer, sizeof(buffer), "%d", ctx->state);
     rv |= led_write(ctx->device, "state", buffer, lineno);
 
+    if (!rv)
+	ctx->activate_fd = led_open(ctx->device, "activate", lineno);
+
     return rv;
 }
 
@@ -248,8 +281,27 @@ static int
 led_sysfs_flash(void *led_driver_data)
 {
     struct led_sysfs_s *ctx = (struct led_sysfs_s *)led_driver_data;
+    int retried = 0;
 
-    return led_write(ctx->device, "activate", "1", 0);
+ retry:
+    if (ctx->activate_fd == -1) {
+	ctx->activate_fd = led_open(ctx->device, "activate", 0);
+	if (ctx->activate_fd == -1)
+	    return -1;
+    }
+
+    /* sysfs attributes take each write as a whole new value. */
+    if (pwrite(ctx->activate_fd, "1", 1, 0) != 1) {
+	/* The attribute may have gone away and come back, reopen once. */
+	close(ctx->activate_fd);
+	ctx->activate_fd = -1;
+	if (!retried++)
+	    goto retry;
+	syslog(LOG_ERR, "Unable to write to LED %s: %s", ctx->device,
+	       strerror(errno));
+	return -1;
+    }
+    return 0;
 }
 
 static int
@@ -258,6 +310,11 @@ led_sysfs_deconfigure(void *led_driver_data)
     struct led_sysfs_s *ctx = (struct led_sysfs_s *)led_driver_data;
     int rv = 0;
 
+    /* The activate file goes away with the trigger. */
+    if (ctx->activate_fd != -1) {
+	close(ctx->activate_fd);
+	ctx->activate_fd = -1;
+    }
 
     rv |= led_write(ctx->device, "trigger", "none", 0);
     rv |= led_write(ctx->device, "brightness", "0", 0);
@@ -0,0 +1,847 @@
+/*
+ *  ser2net - A program for allowing telnet connection to serial ports
+ *  Copyright (C) 2001-2020  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ *
+ *  In addition, as a special exception, the copyright holders of
+ *  ser2net give you permission to combine ser2net with free software
+ *  programs or libraries that are released under the GNU LGPL and
+ *  with code included in the standard release of OpenSSL under the
+ *  OpenSSL license (or modified versions of such code, with unchanged
+ *  license). You may copy and distribute such a system following the
+ *  terms of the GNU GPL for ser2net and the licenses of the other code
+ *  concerned, provided that you include the source code of that
+ *  other code when and as the GNU GPL requires distribution of source
+ *  code.
+ *
+ *  Note that people who make modified versions of ser2net are not
+ *  obligated to grant this special exception for their modified
+ *  versions; it is their choice whether to do so. The GNU General
+ *  Public License gives permission to release a modified version
+ *  without this exception; this exception also makes it possible to
+ *  release a modified version which carries forward this exception.
+ */
+
+/*
+ * This file holds the code that serves port statistics over HTTP in
+ * the Prometheus text exposition format.
+ *
+ * Scrapes do not walk the ports themselves.  The page is rendered
+ * from a snapshot of the ports, taken by holding ports_lock and each
+ * port's lock just long enough to copy the counters out, and the
+ * rendered page is cached and shared by all scrapes that come in
+ * within cache-time of each other.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <gensio/gensio.h>
+
+#include "ser2net.h"
+#include "port.h"
+#include "metrics.h"
+
+#define METRICS_REQ_SIZE	 2048 /* Largest HTTP request we take. */
+#define METRICS_MAX_CONNS	 16   /* Simultaneous scrapes allowed. */
+
+static struct gensio_lock *metrics_lock;
+static struct gensio_accepter *metrics_accepter;
+static struct gensio_waiter *metrics_accept_waiter;
+static struct gensio_waiter *metrics_close_waiter;
+static unsigned int metrics_cache_msec = 1000;
+static bool metrics_freeing;
+
+/* A rendered page, shared by the cache and the connections sending it. */
+struct metrics_page {
+    unsigned int refcount;
+    char *data;
+    gensiods len;
+};
+
+static struct metrics_page *metrics_cache;
+static gensio_time metrics_cache_time;
+
+struct metrics_conn {
+    struct gensio *net;
+
+    char req[METRICS_REQ_SIZE];
+    gensiods reqlen;
+
+    /* The response is hdr followed by page (if set). */
+    char hdr[256];
+    gensiods hdrlen;
+    struct metrics_page *page;
+    gensiods pos;
+
+    bool closing;
+    struct metrics_conn *next;
+};
+
+static struct metrics_conn *metrics_conns;
+static unsigned int num_metrics_conns;
+
+/* Counters and histograms copied from a port. */
+struct metrics_netcon {
+    unsigned int slot;
+    unsigned long bytes_received;
+    unsigned long bytes_sent;
+    unsigned long bytes_queued;
+    unsigned long bytes_dropped;
+};
+
+struct metrics_port {
+    char *name;
+    struct port_stats stats;
+    unsigned long dev_bytes_received;
+    unsigned long dev_bytes_sent;
+    unsigned long trace_dropped;
+    unsigned long chardelay;
+    unsigned int connected;
+    unsigned int max_connections;
+    unsigned int num_netcons;
+    struct metrics_netcon *netcons;
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+    size_t offset;
+} metrics_counters[] = {
+    { "dev_reads", "Reads from the device.",
+      offsetof(struct port_stats, dev_reads) },
+    { "net_reads", "Reads from network connections.",
+      offsetof(struct port_stats, net_reads) },
+    { "net_sends", "Device data sends started to the network.",
+      offsetof(struct port_stats, net_sends) },
+    { "dev_read_stalls", "Times device reads waited on the network.",
+      offsetof(struct port_stats, dev_read_stalls) },
+    { "net_read_stalls", "Times network reads waited on the device.",
+      offsetof(struct port_stats, net_read_stalls) },
+    { "chardelay_timeouts", "Sends started by the chardelay timer.",
+      offsetof(struct port_stats, chardelay_timeouts) },
+    { "sendon_matches", "Sends started by a sendon match.",
+      offsetof(struct port_stats, sendon_matches) },
+    { "frames", "Frames found by the framer.",
+      offsetof(struct port_stats, frames) },
+    { "partial_dev_writes", "Device writes that did not complete at once.",
+      offsetof(struct port_stats, partial_dev_writes) },
+    {}
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+    size_t offset;
+} metrics_hists[] = {
+    { "dev_to_net_delay_microseconds",
+      "Time from device read to network send.",
+      offsetof(struct port_stats, dev_to_net_delay) },
+    { "dev_to_net_size_bytes", "Size of device data sends to the network.",
+      offsetof(struct port_stats, dev_to_net_size) },
+    { "dev_read_stall_microseconds",
+      "Time device reads were held off by the network.",
+      offsetof(struct port_stats, dev_read_stall) },
+    { "net_read_stall_microseconds",
+      "Time network reads were held off by the device.",
+      offsetof(struct port_stats, net_read_stall) },
+    { "net_to_dev_buffers",
+      "Network to device buffers in use when network data arrived.",
+      offsetof(struct port_stats, net_to_dev_bufs) },
+    { "adaptive_chardelay_microseconds",
+      "Chardelay picked by adaptive chardelay.",
+      offsetof(struct port_stats, chardelay) },
+    {}
+};
+
+/*
+ * Copy out what we need from all the ports.  Nothing is allocated or
+ * formatted with a lock held, a first pass sizes the snapshot and the
+ * second just copies into it.  The snapshot is a single block, the
+ * ports, then the netcons, then the port names.  If ports or
+ * connections come in between the passes, whatever doesn't fit is
+ * left for the next scrape.
+ */
+static struct metrics_port *
+take_snapshot(unsigned int *rcount)
+{
+    struct metrics_port *mp, *p;
+    struct metrics_netcon *netcons;
+    char *names;
+    port_info_t *port;
+    net_info_t *netcon;
+    struct gensio_link *l, *l2;
+    unsigned int count = 0, nnetcons = 0, i = 0, n = 0;
+    size_t namesize = 0, namepos = 0, len;
+
+    so->lock(ports_lock);
+    for (port = ports; port; port = port->next) {
+	count++;
+	namesize += strlen(port->name) + 1;
+	so->lock(port->lock);
+	nnetcons += port->net_count;
+	so->unlock(port->lock);
+    }
+    so->unlock(ports_lock);
+
+    mp = calloc(1, (count * sizeof(*mp) + nnetcons * sizeof(*netcons) +
+		    namesize + 1));
+    if (!mp)
+	return NULL;
+    netcons = (struct metrics_netcon *) (mp + count);
+    names = (char *) (netcons + nnetcons);
+
+    so->lock(ports_lock);
+    for (port = ports; port && i < count; port = port->next) {
+	len = strlen(port->name) + 1;
+	if (namepos + len > namesize)
+	    break;
+	p = &mp[i++];
+	p->name = names + namepos;
+	memcpy(p->name, port->name, len);
+	namepos += len;
+
+	so->lock(port->lock);
+	p->stats = port->stats;
+	p->dev_bytes_received = port->dev_bytes_received;
+	p->dev_bytes_sent = port->dev_bytes_sent;
+	p->trace_dropped = trace_dropped(port);
+	p->chardelay = port->chardelay;
+	p->connected = num_connected_net(port);
+	p->max_connections = port->max_connections;
+	/* Only connected netcons are recorded. */
+	p->netcons = netcons + n;
+	for_each_active_connection(port, netcon, l, l2) {
+	    struct metrics_netcon *mn = &p->netcons[p->num_netcons];
+
+	    if (n >= nnetcons)
+		break;
+	    mn->slot = netcon->slot;
+	    mn->bytes_received = netcon->bytes_received;
+	    mn->bytes_sent = netcon->bytes_sent;
+	    mn->bytes_queued = netcon->fanout.queued;
+	    mn->bytes_dropped = netcon->bytes_dropped;
+	    p->num_netcons++;
+	    n++;
+	}
+	so->unlock(port->lock);
+    }
+    so->unlock(ports_lock);
+
+    *rcount = i;
+    return mp;
+}
+
+struct metrics_buf {
+    char *data;
+    gensiods len;
+    gensiods size;
+    bool err;
+};
+
+static void
+mb_grow(struct metrics_buf *mb, gensiods need)
+{
+    gensiods size = mb->size ? mb->size : 16384;
+    char *n;
+
+    while (size - mb->len < need)
+	size *= 2;
+    n = realloc(mb->data, size);
+    if (!n) {
+	mb->err = true;
+	return;
+    }
+    mb->data = n;
+    mb->size = size;
+}
+
+static void
+mb_printf(struct metrics_buf *mb, const char *fmt, ...)
+{
+    va_list ap;
+    int len;
+
+    if (mb->err)
+	return;
+
+    va_start(ap, fmt);
+    len = vsnprintf(mb->data + mb->len, mb->size - mb->len, fmt, ap);
+    va_end(ap);
+    if (len < 0) {
+	mb->err = true;
+	return;
+    }
+    if (len >= mb->size - mb->len) {
+	mb_grow(mb, len + 1);
+	if (mb->err)
+	    return;
+	va_start(ap, fmt);
+	vsnprintf(mb->data + mb->len, mb->size - mb->len, fmt, ap);
+	va_end(ap);
+    }
+    mb->len += len;
+}
+
+/* Output a label value, with the escapes the exposition format wants. */
+static void
+mb_label(struct metrics_buf *mb, const char *s)
+{
+    for (; *s; s++) {
+	if (*s == '\\')
+	    mb_printf(mb, "\\\\");
+	else if (*s == '"')
+	    mb_printf(mb, "\\\"");
+	else if (*s == '\n')
+	    mb_printf(mb, "\\n");
+	else
+	    mb_printf(mb, "%c", *s);
+    }
+}
+
+static void
+mb_family(struct metrics_buf *mb, const char *name, const char *type,
+	  const char *help)
+{
+    mb_printf(mb, "# HELP ser2net_%s %s\n# TYPE ser2net_%s %s\n",
+	      name, help, name, type);
+}
+
+static void
+mb_port_val(struct metrics_buf *mb, const char *name, const char *suffix,
+	    struct metrics_port *p, unsigned long val)
+{
+    mb_printf(mb, "ser2net_%s%s{port=\"", name, suffix);
+    mb_label(mb, p->name);
+    mb_printf(mb, "\"} %lu\n", val);
+}
+
+/*
+ * Histogram buckets are cumulative for this format.  Only buckets up
+ * to the highest one used are given, the counts never go down so the
+ * set of buckets for a port only grows.
+ */
+static void
+mb_hist(struct metrics_buf *mb, const char *name, struct metrics_port *p,
+	struct port_hist *h)
+{
+    unsigned long cumulative = 0;
+    unsigned int i, last = 0;
+
+    for (i = 0; i < PORT_HIST_BUCKETS - 1; i++) {
+	if (h->buckets[i])
+	    last = i;
+    }
+    for (i = 0; i <= last; i++) {
+	cumulative += h->buckets[i];
+	mb_printf(mb, "ser2net_%s_bucket{port=\"", name);
+	mb_label(mb, p->name);
+	mb_printf(mb, "\",le=\"%lu\"} %lu\n", (1UL << i) - 1, cumulative);
+    }
+    mb_printf(mb, "ser2net_%s_bucket{port=\"", name);
+    mb_label(mb, p->name);
+    mb_printf(mb, "\",le=\"+Inf\"} %lu\n", h->count);
+    mb_port_val(mb, name, "_sum", p, h->total);
+    mb_port_val(mb, name, "_count", p, h->count);
+}
+
+static void
+mb_netcon_val(struct metrics_buf *mb, const char *name,
+	      struct metrics_port *p, struct metrics_netcon *mn,
+	      unsigned long val)
+{
+    mb_printf(mb, "ser2net_%s{port=\"", name);
+    mb_label(mb, p->name);
+    mb_printf(mb, "\",slot=\"%u\"} %lu\n", mn->slot, val);
+}
+
+#define for_each_mport(mp, count, p)				\
+    for (p = mp; p < mp + count; p++) if (p->name)
+
+static struct metrics_page *
+render_page(void)
+{
+    struct metrics_page *page;
+    struct metrics_port *mp, *p;
+    struct metrics_buf mb = { NULL, 0, 0, false };
+    unsigned int count, i, j;
+    char name[80];
+
+    mp = take_snapshot(&count);
+    if (!mp)
+	return NULL;
+
+    mb_grow(&mb, 1);
+
+    mb_family(&mb, "port_connections", "gauge",
+	      "Network connections currently on the port.");
+    for_each_mport(mp, count, p)
+	mb_port_val(&mb, "port_connections", "", p, p->connected);
+    mb_family(&mb, "port_max_connections", "gauge",
+	      "Network connections allowed on the port.");
+    for_each_mport(mp, count, p)
+	mb_port_val(&mb, "port_max_connections", "", p, p->max_connections);
+    mb_family(&mb, "port_chardelay_microseconds", "gauge",
+	      "Current chardelay, 0 if disabled.");
+    for_each_mport(mp, count, p)
+	mb_port_val(&mb, "port_chardelay_microseconds", "", p, p->chardelay);
+    mb_family(&mb, "port_dev_bytes_received_total", "counter",
+	      "Bytes read from the device.");
+    for_each_mport(mp, count, p)
+	mb_port_val(&mb, "port_dev_bytes_received_total", "", p,
+		    p->dev_bytes_received);
+    mb_family(&mb, "port_dev_bytes_sent_total", "counter",
+	      "Bytes written to the device.");
+    for_each_mport(mp, count, p)
+	mb_port_val(&mb, "port_dev_bytes_sent_total", "", p,
+		    p->dev_bytes_sent);
+    mb_family(&mb, "port_trace_dropped_bytes_total", "counter",
+	      "Bytes dropped because a trace file could not keep up.");
+    for_each_mport(mp, count, p)
+	mb_port_val(&mb, "port_trace_dropped_bytes_total", "", p,
+		    p->trace_dropped);
+
+    for (i = 0; metrics_counters[i].name; i++) {
+	snprintf(name, sizeof(name), "port_%s_total", metrics_counters[i].name);
+	mb_family(&mb, name, "counter", metrics_counters[i].help);
+	for_each_mport(mp, count, p)
+	    mb_port_val(&mb, name, "", p,
+			*(unsigned long *) (((char *) &p->stats) +
+					    metrics_counters[i].offset));
+    }
+
+    for (i = 0; metrics_hists[i].name; i++) {
+	snprintf(name, sizeof(name), "port_%s", metrics_hists[i].name);
+	mb_family(&mb, name, "histogram", metrics_hists[i].help);
+	for_each_mport(mp, count, p)
+	    mb_hist(&mb, name, p,
+		    (struct port_hist *) (((char *) &p->stats) +
+					  metrics_hists[i].offset));
+    }
+
+    mb_family(&mb, "connection_bytes_received_total", "counter",
+	      "Bytes read from the network connection.");
+    for_each_mport(mp, count, p)
+	for (j = 0; j < p->num_netcons; j++)
+	    mb_netcon_val(&mb, "connection_bytes_received_total", p,
+			  &p->netcons[j], p->netcons[j].bytes_received);
+    mb_family(&mb, "connection_bytes_sent_total", "counter",
+	      "Bytes written to the network connection.");
+    for_each_mport(mp, count, p)
+	for (j = 0; j < p->num_netcons; j++)
+	    mb_netcon_val(&mb, "connection_bytes_sent_total", p,
+			  &p->netcons[j], p->netcons[j].bytes_sent);
+    mb_family(&mb, "connection_bytes_queued", "gauge",
+	      "Bytes waiting to go to the network connection.");
+    for_each_mport(mp, count, p)
+	for (j = 0; j < p->num_netcons; j++)
+	    mb_netcon_val(&mb, "connection_bytes_queued", p,
+			  &p->netcons[j], p->netcons[j].bytes_queued);
+    mb_family(&mb, "connection_bytes_dropped_total", "counter",
+	      "Bytes dropped because the connection was too slow.");
+    for_each_mport(mp, count, p)
+	for (j = 0; j < p->num_netcons; j++)
+	    mb_netcon_val(&mb, "connection_bytes_dropped_total", p,
+			  &p->netcons[j], p->netcons[j].bytes_dropped);
+
+    free(mp);
+
+    if (mb.err)
+	goto out_err;
+    page = malloc(sizeof(*page));
+    if (!page)
+	goto out_err;
+    page->refcount = 1;
+    page->data = mb.data;
+    page->len = mb.len;
+    return page;
+
+ out_err:
+    free(mb.data);
+    return NULL;
+}
+
+static void
+metrics_page_put(struct metrics_page *page)
+{
+    if (--page->refcount == 0) {
+	free(page->data);
+	free(page);
+    }
+}
+
+/* Return the cached page, rendering a new one if it is too old. */
+static struct metrics_page *
+metrics_get_page(void)
+{
+    struct metrics_page *page;
+    gensio_time now;
+
+    so->get_monotonic_time(so, &now);
+    if (metrics_cache && sub_time(&now, &metrics_cache_time) <
+			 (int) metrics_cache_msec * 1000) {
+	metrics_cache->refcount++;
+	return metrics_cache;
+    }
+
+    page = render_page();
+    if (!page)
+	return NULL;
+    if (metrics_cache)
+	metrics_page_put(metrics_cache);
+    metrics_cache = page;
+    metrics_cache_time = now;
+    page->refcount++;
+    return page;
+}
+
+static void
+metrics_close_done(struct gensio *net, void *cb_data)
+{
+    struct metrics_conn *mc = cb_data, **prev;
+
+    gensio_free(net);
+
+    so->lock(metrics_lock);
+    for (prev = &metrics_conns; *prev; prev = &(*prev)->next) {
+	if (*prev == mc) {
+	    *prev = mc->next;
+	    num_metrics_conns--;
+	    break;
+	}
+    }
+    if (mc->page)
+	metrics_page_put(mc->page);
+    if (metrics_freeing)
+	so->wake(metrics_close_waiter);
+    so->unlock(metrics_lock);
+
+    free(mc);
+}
+
+/* Call with metrics_lock held, it is released. */
+static void
+metrics_close(struct metrics_conn *mc)
+{
+    if (mc->closing) {
+	so->unlock(metrics_lock);
+	return;
+    }
+    mc->closing = true;
+    so->unlock(metrics_lock);
+    gensio_set_read_callback_enable(mc->net, false);
+    gensio_set_write_callback_enable(mc->net, false);
+    gensio_close(mc->net, metrics_close_done, mc);
+}
+
+static void
+metrics_respond(struct metrics_conn *mc, const char *status,
+		const char *body)
+{
+    mc->hdrlen = snprintf(mc->hdr, sizeof(mc->hdr),
+			  "HTTP/1.0 %s\r\n"
+			  "Content-Type: text/plain; charset=utf-8\r\n"
+			  "Content-Length: %lu\r\n"
+			  "Connection: close\r\n\r\n%s",
+			  status, (unsigned long) strlen(body), body);
+}
+
+/* Handle a complete request header. */
+static void
+metrics_handle_request(struct metrics_conn *mc)
+{
+    char *path, *end;
+
+    if (strncmp(mc->req, "GET ", 4) != 0) {
+	metrics_respond(mc, "405 Method Not Allowed", "Only GET is allowed\n");
+	return;
+    }
+
+    path = mc->req + 4;
+    end = path + strcspn(path, " ?\r\n");
+    *end = '\0';
+    if (strcmp(path, "/metrics") != 0 && strcmp(path, "/") != 0) {
+	metrics_respond(mc, "404 Not Found", "Not found\n");
+	return;
+    }
+
+    mc->page = metrics_get_page();
+    if (!mc->page) {
+	metrics_respond(mc, "500 Internal Server Error", "Out of memory\n");
+	return;
+    }
+
+    mc->hdrlen = snprintf(mc->hdr, sizeof(mc->hdr),
+			  "HTTP/1.0 200 OK\r\n"
+			  "Content-Type: text/plain; version=0.0.4;"
+			  " charset=utf-8\r\n"
+			  "Content-Length: %lu\r\n"
+			  "Connection: close\r\n\r\n",
+			  (unsigned long) mc->page->len);
+}
+
+static void
+metrics_read(struct metrics_conn *mc, int err, unsigned char *buf,
+	     gensiods *buflen)
+{
+    gensiods count;
+
+    so->lock(metrics_lock);
+    if (mc->closing) {
+	so->unlock(metrics_lock);
+	return;
+    }
+    if (err) {
+	metrics_close(mc);
+	return;
+    }
+
+    count = *buflen;
+    if (count > sizeof(mc->req) - 1 - mc->reqlen)
+	count = sizeof(mc->req) - 1 - mc->reqlen;
+    memcpy(mc->req + mc->reqlen, buf, count);
+    mc->reqlen += count;
+    mc->req[mc->reqlen] = '\0';
+
+    if (strstr(mc->req, "\r\n\r\n") || strstr(mc->req, "\n\n"))
+	metrics_handle_request(mc);
+    else if (mc->reqlen >= sizeof(mc->req) - 1)
+	metrics_respond(mc, "400 Bad Request", "Request too large\n");
+    else
+	goto out_unlock;
+
+    /* We have a response, stop reading and send it. */
+    gensio_set_read_callback_enable(mc->net, false);
+    gensio_set_write_callback_enable(mc->net, true);
+ out_unlock:
+    so->unlock(metrics_lock);
+}
+
+static void
+metrics_write_ready(struct metrics_conn *mc)
+{
+    struct gensio_sg sg[2];
+    gensiods sglen = 0, count, pos;
+    int err;
+
+    so->lock(metrics_lock);
+    if (mc->closing) {
+	so->unlock(metrics_lock);
+	return;
+    }
+
+    pos = mc->pos;
+    if (pos < mc->hdrlen) {
+	sg[sglen].buf = mc->hdr + pos;
+	sg[sglen++].buflen = mc->hdrlen - pos;
+	pos = 0;
+    } else {
+	pos -= mc->hdrlen;
+    }
+    if (mc->page && pos < mc->page->len) {
+	sg[sglen].buf = mc->page->data + pos;
+	sg[sglen++].buflen = mc->page->len - pos;
+    }
+    if (sglen == 0) {
+	metrics_close(mc);
+	return;
+    }
+
+    err = gensio_write_sg(mc->net, &count, sg, sglen, NULL);
+    if (err) {
+	metrics_close(mc);
+	return;
+    }
+    mc->pos += count;
+    if (mc->pos >= mc->hdrlen + (mc->page ? mc->page->len : 0)) {
+	metrics_close(mc);
+	return;
+    }
+    so->unlock(metrics_lock);
+}
+
+static int
+metrics_io_event(struct gensio *net, void *user_data, int event, int err,
+		 unsigned char *buf, gensiods *buflen,
+		 const char *const *auxdata)
+{
+    struct metrics_conn *mc = user_data;
+
+    switch (event) {
+    case GENSIO_EVENT_READ:
+	metrics_read(mc, err, buf, buflen);
+	return 0;
+
+    case GENSIO_EVENT_WRITE_READY:
+	metrics_write_ready(mc);
+	return 0;
+    }
+
+    return GE_NOTSUP;
+}
+
+static int
+metrics_acc_new_child(struct gensio *net)
+{
+    struct metrics_conn *mc;
+
+    so->lock(metrics_lock);
+    if (num_metrics_conns >= METRICS_MAX_CONNS) {
+	so->unlock(metrics_lock);
+	syslog(LOG_WARNING, "Too many metrics connections, refusing one");
+	gensio_free(net);
+	return 0;
+    }
+
+    mc = calloc(1, sizeof(*mc));
+    if (!mc) {
+	so->unlock(metrics_lock);
+	syslog(LOG_ERR, "Out of memory allocating metrics connection");
+	gensio_free(net);
+	return 0;
+    }
+    mc->net = net;
+    mc->next = metrics_conns;
+    metrics_conns = mc;
+    num_metrics_conns++;
+    so->unlock(metrics_lock);
+
+    gensio_set_callback(net, metrics_io_event, mc);
+    gensio_set_read_callback_enable(net, true);
+    return 0;
+}
+
+static int
+metrics_acc_child_event(struct gensio_accepter *accepter, void *user_data,
+			int event, void *data)
+{
+    switch (event) {
+    case GENSIO_ACC_EVENT_NEW_CONNECTION:
+	return metrics_acc_new_child(data);
+
+    default:
+	return handle_acc_auth_event(NULL, NULL, event, data);
+    }
+}
+
+int
+metrics_init(const char *accepter, const char * const *options,
+	     struct absout *eout)
+{
+    unsigned int i, uval;
+    int rv;
+
+    if (metrics_accepter) {
+	eout->out(eout, "Metrics accepter already configured");
+	return -1;
+    }
+
+    metrics_cache_msec = 1000;
+    for (i = 0; options && options[i]; i++) {
+	if (gensio_check_keyuint(options[i], "cache-time", &uval) > 0) {
+	    metrics_cache_msec = uval;
+	    continue;
+	}
+	eout->out(eout, "Invalid option to metrics: %s", options[i]);
+	return -1;
+    }
+
+    if (!metrics_lock) {
+	metrics_lock = so->alloc_lock(so);
+	if (!metrics_lock)
+	    goto out_nomem;
+    }
+    if (!metrics_accept_waiter) {
+	metrics_accept_waiter = so->alloc_waiter(so);
+	if (!metrics_accept_waiter)
+	    goto out_nomem;
+    }
+    if (!metrics_close_waiter) {
+	metrics_close_waiter = so->alloc_waiter(so);
+	if (!metrics_close_waiter)
+	    goto out_nomem;
+    }
+
+    rv = str_to_gensio_accepter(accepter, so, metrics_acc_child_event, NULL,
+				&metrics_accepter);
+    if (rv) {
+	eout->out(eout, "Unable to allocate metrics accepter: %s",
+		  gensio_err_to_str(rv));
+	return -1;
+    }
+
+    rv = gensio_acc_startup(metrics_accepter);
+    if (rv) {
+	eout->out(eout, "Unable to start metrics accepter: %s",
+		  gensio_err_to_str(rv));
+	gensio_acc_free(metrics_accepter);
+	metrics_accepter = NULL;
+	return -1;
+    }
+
+    return 0;
+
+ out_nomem:
+    eout->out(eout, "Unable to allocate memory for metrics");
+    return -1;
+}
+
+static void
+metrics_shutdown_done(struct gensio_accepter *acc, void *cb_data)
+{
+    so->wake(metrics_accept_waiter);
+}
+
+void
+metrics_shutdown(void)
+{
+    if (metrics_accepter) {
+	gensio_acc_shutdown(metrics_accepter, metrics_shutdown_done, NULL);
+	so->wait(metrics_accept_waiter, 1, NULL);
+	gensio_acc_free(metrics_accepter);
+	metrics_accepter = NULL;
+    }
+}
+
+void
+free_metrics(void)
+{
+    struct metrics_conn *mc;
+    unsigned int count;
+
+    metrics_shutdown();
+
+    if (metrics_lock) {
+	so->lock(metrics_lock);
+	metrics_freeing = true;
+	count = num_metrics_conns;
+	for (;;) {
+	    for (mc = metrics_conns; mc && mc->closing; mc = mc->next)
+		;
+	    if (!mc)
+		break;
+	    metrics_close(mc); /* Releases the lock. */
+	    so->lock(metrics_lock);
+	}
+	so->unlock(metrics_lock);
+	if (count)
+	    so->wait(metrics_close_waiter, count, NULL);
+
+	if (metrics_cache)
+	    metrics_page_put(metrics_cache);
+	metrics_cache = NULL;
+	so->free_lock(metrics_lock);
+	metrics_lock = NULL;
+    }
+    if (metrics_accept_waiter)
+	so->free_waiter(metrics_accept_waiter);
+    metrics_accept_waiter = NULL;
+    if (metrics_close_waiter)
+	so->free_waiter(metrics_close_waiter);
+    metrics_close_waiter = NULL;
+}
@@ -32,6 +32,7 @@
 #include "ser2net.h"
 #include "port.h"
 #include "gbuf.h"
+#include "led.h"
 #include <gensio/gensio_mdns.h>
 #include <gensio/argvutils.h>
 #include <gensio/gensio_err.h>
@@ -42,19 +43,102 @@ port_info_t *ports = NULL; /* Linked list of ports. */
 port_info_t *new_ports = NULL; /* New ports during config/reconfig. */
 port_info_t *new_ports_end = NULL;
 
-net_info_t *
-first_live_net_con(port_info_t *port)
+/*
+ * Hash tables indexing the ports list by port name and by device
+ * name, so lookups don't have to walk the list.  These are rebuilt
+ * with ports_lock held whenever the list changes, and may only be
+ * used with ports_lock held.  If NULL (out of memory), the list is
+ * walked instead.
+ */
+static port_info_t **port_name_hash;
+static port_info_t **port_dev_hash;
+static unsigned int port_hash_size;
+unsigned int port_index_gen;
+
+static unsigned int
+port_hash_str(const char *s)
 {
-    net_info_t *netcon;
+    unsigned int h = 2166136261U; /* FNV-1a */
 
-    for_each_connection(port, netcon) {
-	if (netcon->net)
-	    return netcon;
+    while (*s) {
+	h ^= (unsigned char) *s++;
+	h *= 16777619U;
+    }
+    return h & (port_hash_size - 1);
+}
+
+void
+port_index_rebuild(void)
+{
+    port_info_t *port;
+    unsigned int count = 0, size = 16, h;
+
+    port_index_gen++;
+    for (port = ports; port; port = port->next)
+	count++;
+    while (size < count * 2)
+	size *= 2;
+
+    if (size != port_hash_size || !port_name_hash || !port_dev_hash) {
+	free(port_name_hash);
+	free(port_dev_hash);
+	port_name_hash = calloc(size, sizeof(*port_name_hash));
+	port_dev_hash = calloc(size, sizeof(*port_dev_hash));
+	if (!port_name_hash || !port_dev_hash) {
+	    syslog(LOG_ERR, "Out of memory allocating port index");
+	    free(port_name_hash);
+	    free(port_dev_hash);
+	    port_name_hash = NULL;
+	    port_dev_hash = NULL;
+	    port_hash_size = 0;
+	    return;
+	}
+	port_hash_size = size;
+    } else {
+	memset(port_name_hash, 0, size * sizeof(*port_name_hash));
+	memset(port_dev_hash, 0, size * sizeof(*port_dev_hash));
+    }
+
+    for (port = ports; port; port = port->next) {
+	h = port_hash_str(port->name);
+	port->name_hnext = port_name_hash[h];
+	port_name_hash[h] = port;
+	h = port_hash_str(port->devname);
+	port->dev_hnext = port_dev_hash[h];
+	port_dev_hash[h] = port;
+    }
+}
+
+port_info_t *
+port_index_find(const char *name)
+{
+    port_info_t *port;
+
+    if (!port_name_hash) {
+	for (port = ports; port; port = port->next) {
+	    if (strcmp(name, port->name) == 0)
+		return port;
+	}
+	return NULL;
     }
 
+    for (port = port_name_hash[port_hash_str(name)]; port;
+		port = port->name_hnext) {
+	if (strcmp(name, port->name) == 0)
+	    return port;
+    }
     return NULL;
 }
 
+net_info_t *
+first_live_net_con(port_info_t *port)
+{
+    if (gensio_list_empty(&port->active_netcons))
+	return NULL;
+    return gensio_container_of(gensio_list_first(&port->active_netcons),
+			       net_info_t, active_link);
+}
+
 bool
 port_in_use(port_info_t *port)
 {
@@ -67,7 +151,13 @@ port_in_use(port_info_t *port)
 int
 is_device_already_inuse(port_info_t *check_port)
 {
-    port_info_t *port = ports;
+    port_info_t *port;
+    bool hashed = port_dev_hash != NULL;
+
+    if (hashed)
+	port = port_dev_hash[port_hash_str(check_port->devname)];
+    else
+	port = ports;
 
     while (port != NULL) {
 	if (port != check_port) {
@@ -76,7 +166,7 @@ is_device_already_inuse(port_info_t *check_port)
 		return 1;
 	    }
 	}
-	port = port->next;
+	port = hashed ? port->dev_hnext : port->next;
     }
 
     return 0;
@@ -84,16 +174,88 @@ is_device_already_inuse(port_info_t *check_port)
 
 int
 num_connected_net(port_info_t *port)
+{
+    return port->net_count;
+}
+
+void
+init_netcon_lists(port_info_t *port)
 {
     net_info_t *netcon;
-    int count = 0;
 
+    gensio_list_init(&port->active_netcons);
+    gensio_list_init(&port->free_netcons);
     for_each_connection(port, netcon) {
-	if (netcon->net)
-	    count++;
+	if (netcon->remote_fixed)
+	    continue;
+	gensio_list_add_tail(&port->free_netcons, &netcon->free_link);
+	netcon->on_free_list = true;
+    }
+}
+
+/*
+ * Allocate a new connection slot and add it to the end of the port's
+ * netcons.  Returns NULL if the port already has max_connections
+ * slots or memory runs out.  Must be called with the port lock held
+ * or before the port is visible.
+ */
+net_info_t *
+netcon_alloc(port_info_t *port)
+{
+    net_info_t *netcon;
+
+    if (port->netcon_slots >= port->max_connections)
+	return NULL;
+
+    netcon = calloc(1, sizeof(*netcon));
+    if (!netcon)
+	return NULL;
+    netcon->port = port;
+    netcon->slot = port->netcon_slots;
+    if (port->netcons_tail)
+	port->netcons_tail->next = netcon;
+    else
+	port->netcons = netcon;
+    port->netcons_tail = netcon;
+    port->netcon_slots++;
+
+    return netcon;
+}
+
+void
+netcon_free_all(port_info_t *port)
+{
+    net_info_t *netcon;
+
+    while (port->netcons) {
+	netcon = port->netcons;
+	port->netcons = netcon->next;
+	free(netcon);
     }
+    port->netcons_tail = NULL;
+    port->netcon_slots = 0;
+}
+
+/*
+ * A netcon new connections can use, NULL if none.  Slots are only
+ * allocated when all the existing ones are in use, so a port with a
+ * large max-connections only pays for what it actually uses.
+ */
+net_info_t *
+first_free_netcon(port_info_t *port)
+{
+    net_info_t *netcon;
 
-    return count;
+    if (gensio_list_empty(&port->free_netcons)) {
+	netcon = netcon_alloc(port);
+	if (!netcon)
+	    return NULL;
+	gensio_list_add_tail(&port->free_netcons, &netcon->free_link);
+	netcon->on_free_list = true;
+	return netcon;
+    }
+    return gensio_container_of(gensio_list_first(&port->free_netcons),
+			       net_info_t, free_link);
 }
 
 gensiods
@@ -113,20 +275,58 @@ net_raddr(struct gensio *io, struct sockaddr_storage *addr, gensiods *socklen)
 void
 reset_timer(net_info_t *netcon)
 {
-    netcon->timeout_left = netcon->port->timeout;
+    port_info_t *port = netcon->port;
+
+    if (!port->timeout)
+	return;
+    port->o->get_monotonic_time(port->o, &netcon->timeout_at);
+    add_sec_to_time(&netcon->timeout_at, port->timeout);
 }
 
+/*
+ * Start the port timer.  While connections are up, the timer is only
+ * run when something is due, the first netcon inactivity timeout or
+ * the read re-enable for connect backs, so busy and idle ports don't
+ * wake up every second.  The retry and shutdown states still tick.
+ */
 void
 port_start_timer(port_info_t *port)
 {
-    gensio_time timeout;
+    gensio_time timeout, now, *due = NULL;
+    net_info_t *netcon;
+    struct gensio_link *l, *l2;
     unsigned int timeout_sec = 1;
 
-    if (port->dev_to_net_state == PORT_UNCONNECTED)
+    if (port->dev_to_net_state == PORT_UNCONNECTED) {
 	timeout_sec = port->connector_retry_time;
-
-    if (port->dev_to_net_state == PORT_CLOSED)
+    } else if (port->dev_to_net_state == PORT_CLOSED) {
 	timeout_sec = port->accepter_retry_time;
+    } else if (port->dev_to_net_state != PORT_CLOSING) {
+	if (port->nocon_read_enable_pending) {
+	    due = &port->nocon_read_enable_time;
+	} else if (port->timeout && port_in_use(port)) {
+	    for_each_active_connection(port, netcon, l, l2) {
+		if (!due || cmp_time(&netcon->timeout_at, due) < 0)
+		    due = &netcon->timeout_at;
+	    }
+	}
+	if (port->monitor_blocked) {
+	    gensio_time *mdue = monitor_next_timeout(port);
+
+	    if (mdue && (!due || cmp_time(mdue, due) < 0))
+		due = mdue;
+	}
+	if (!due)
+	    /* Nothing to wait for, another event will start us. */
+	    return;
+
+	port->o->get_monotonic_time(port->o, &now);
+	if (cmp_time(due, &now) < 0)
+	    due = &now; /* Already due, run it right away. */
+	diff_time(&timeout, due, &now);
+	port->o->start_timer(port->timer, &timeout);
+	return;
+    }
 
 #ifdef gensio_version_major
     timeout.secs = timeout_sec;
@@ -135,7 +335,31 @@ port_start_timer(port_info_t *port)
     timeout.tv_sec = timeout_sec;
     timeout.tv_usec = 0;
 #endif
-    so->start_timer(port->timer, &timeout);
+    port->o->start_timer(port->timer, &timeout);
+}
+
+void
+port_restart_timer(port_info_t *port)
+{
+    /*
+     * If the timer is already running its handler, that will re-arm
+     * it and our start fails harmlessly.
+     */
+    port->o->stop_timer(port->timer);
+    port_start_timer(port);
+}
+
+/*
+ * A connect back attempt failed, turn off device reads for
+ * accepter-retry-time and then try again.
+ */
+void
+port_nocon_read_disable(port_info_t *port)
+{
+    port->o->get_monotonic_time(port->o, &port->nocon_read_enable_time);
+    add_sec_to_time(&port->nocon_read_enable_time, port->accepter_retry_time);
+    port->nocon_read_enable_pending = true;
+    port_restart_timer(port);
 }
 
 static void
@@ -182,7 +406,8 @@ static int
 port_new_con(port_info_t *port, struct gensio *net)
 {
     const char *err = NULL;
-    unsigned int i, j;
+    net_info_t *netcon;
+    struct gensio_link *l, *l2;
     struct sockaddr_storage addr;
     gensiods socklen;
 
@@ -213,18 +438,16 @@ port_new_con(port_info_t *port, struct gensio *net)
 	}
     }
 
-    for (j = port->max_connections, i = 0; i < port->max_connections; i++) {
-	if (!port->netcons[i].net && !port->netcons[i].remote_fixed)
-	    break;
-	if (!port->netcons[i].remote_fixed)
-	    j = i;
-    }
-
-    if (i == port->max_connections) {
-	if (port->kickolduser_mode && j < port->max_connections) {
-	    /* Kick off the first non-fixed user. */
-	    kick_old_user(port, &port->netcons[j], net);
-	    goto out;
+    netcon = first_free_netcon(port);
+    if (!netcon) {
+	if (port->kickolduser_mode) {
+	    /* Kick off the oldest non-fixed user. */
+	    for_each_active_connection(port, netcon, l, l2) {
+		if (!netcon->remote_fixed) {
+		    kick_old_user(port, netcon, net);
+		    goto out;
+		}
+	    }
 	}
 
 	err = "Port already in use\r\n";
@@ -247,7 +470,7 @@ port_new_con(port_info_t *port, struct gensio *net)
 
     /* We have to hold the ports_lock until after this call so the
        device won't get used (from is_device_already_inuse()). */
-    handle_new_net(port, net, &(port->netcons[i]));
+    handle_new_net(port, net, netcon);
  out:
     so->unlock(port->lock);
     so->unlock(ports_lock);
@@ -392,6 +615,23 @@ mdns_addstack(struct absout *eout, port_info_t *port)
 	so->free(so, stack);
 }
 
+static void mdns_add_service(struct absout *eout, port_info_t *port);
+
+/*
+ * Runs in the job pool.  The port can't go away while this runs,
+ * mdns_shutdown() waits for it, and nothing else touches the mdns
+ * txt or service until then.
+ */
+static void
+mdns_sysattrs_job(struct ser2net_job *job)
+{
+    port_info_t *port = gensio_container_of(job, port_info_t, mdns_job);
+
+    add_sys_attrs(&syslog_absout, port->name, port->devname, &port->mdns_txt,
+		  &port->mdns_txt_args, &port->mdns_txt_argc);
+    mdns_add_service(&syslog_absout, port);
+}
+
 static void
 mdns_setup(struct absout *eout, port_info_t *port)
 {
@@ -448,9 +688,24 @@ mdns_setup(struct absout *eout, port_info_t *port)
 	return;
     }
 
-    if (port->do_mdns_sysattrs)
-	add_sys_attrs(eout, port->name, port->devname, &port->mdns_txt,
-		      &port->mdns_txt_args, &port->mdns_txt_argc);
+    if (port->do_mdns_sysattrs) {
+	/*
+	 * Finding the sysfs attributes can take a while with a lot of
+	 * devices, don't make the other ports wait for it.  The
+	 * service is added when it's done.
+	 */
+	port->mdns_job.func = mdns_sysattrs_job;
+	ser2net_job_queue(&port->mdns_job);
+	return;
+    }
+
+    mdns_add_service(eout, port);
+}
+
+static void
+mdns_add_service(struct absout *eout, port_info_t *port)
+{
+    int err;
 
     err = gensio_mdns_add_service(mdns, port->mdns_interface,
 				  port->mdns_nettype,
@@ -463,9 +718,10 @@ mdns_setup(struct absout *eout, port_info_t *port)
 		  port->name, gensio_err_to_str(err));
 }
 
-static void
+void
 mdns_shutdown(port_info_t *port)
 {
+    ser2net_job_cancel(&port->mdns_job);
     if (port->mdns_service)
 	gensio_mdns_remove_service(port->mdns_service);
     port->mdns_service = NULL;
@@ -478,7 +734,7 @@ mdns_setup(struct absout *eout, port_info_t *port)
 {
 }
 
-static void
+void
 mdns_shutdown(port_info_t *port)
 {
 }
@@ -547,11 +803,16 @@ finish_shutdown_port(struct gensio_runner *runner, void *cb_data)
 	port->dev_to_net_state = PORT_CLOSED;
     }
     gbuf_reset(&port->net_to_dev);
+    port->net_to_dev_qhead = 0;
+    port->net_to_dev_qcount = 0;
+    monitor_port_reset(port);
     if (port->devstr) {
 	gbuf_free(port->devstr);
 	port->devstr = NULL;
     }
     gbuf_reset(&port->dev_to_net);
+    port->stats.dev_read_stalled = false;
+    port->stats.net_read_stalled = false;
     port->dev_bytes_received = 0;
     port->dev_bytes_sent = 0;
 
@@ -577,6 +838,7 @@ finish_shutdown_port(struct gensio_runner *runner, void *cb_data)
 	    else
 		prev->next = curr->next;
 	}
+	port_index_rebuild();
 	so->unlock(port->lock);
 
 	free_port(port);
@@ -591,6 +853,7 @@ finish_shutdown_port(struct gensio_runner *runner, void *cb_data)
 		new->next = ports;
 		ports = new;
 	    }
+	    port_index_rebuild();
 	    if (new->enabled)
 		startup_port(&syslog_absout, new);
 	    so->unlock(new->lock);
@@ -619,7 +882,7 @@ io_shutdown_done(struct gensio *io, void *cb_data)
     port_info_t *port = cb_data;
 
     port->io_open = false;
-    so->run(port->runshutdown);
+    port->o->run(port->runshutdown);
 }
 
 void
@@ -628,13 +891,14 @@ shutdown_port_io(port_info_t *port)
     int err = 1;
 
     shutdown_trace(port);
+    port_select_data_path(port);
 
     if (port->io)
 	err = gensio_close(port->io, io_shutdown_done, port);
 
     if (err) {
 	port->io_open = false;
-	so->run(port->runshutdown);
+	port->o->run(port->runshutdown);
     }
 }
 
@@ -655,6 +919,10 @@ handle_dev_fd_close_write(port_info_t *port)
 {
     int err;
 
+    if (gbuf_cursize(&port->net_to_dev) == 0)
+	/* Pull in anything still queued from the network. */
+	net_to_dev_next_buf(port);
+
     if (gbuf_cursize(&port->net_to_dev) != 0)
 	err = gbuf_write(port, &port->net_to_dev);
     else if (port->devstr)
@@ -668,14 +936,14 @@ handle_dev_fd_close_write(port_info_t *port)
 	goto closeit;
     }
 
-    if (gbuf_cursize(&port->net_to_dev) ||
+    if (gbuf_cursize(&port->net_to_dev) || port->net_to_dev_qcount ||
 		(port->devstr && gbuf_cursize(port->devstr)))
 	return;
 
 closeit:
     if (port->shutdown_timeout_count) {
 	gensio_set_write_callback_enable(port->io, false);
-	err = so->stop_timer_with_done(port->timer, timer_shutdown_done, port);
+	err = port->o->stop_timer_with_done(port->timer, timer_shutdown_done, port);
 	if (err == GE_TIMEDOUT) {
 	    port->shutdown_timeout_count = 0;
 	    shutdown_port_io(port);
@@ -687,13 +955,13 @@ static void
 start_shutdown_port_io(port_info_t *port)
 {
     if (!port->io_open) {
-	so->run(port->runshutdown);
+	port->o->run(port->runshutdown);
 	return;
     }
 
     if (port->devstr)
 	gbuf_free(port->devstr);
-    port->devstr = process_str_to_buf(port, NULL, port->closestr);
+    port->devstr = str_template_render(port, NULL, port->closestr_tmpl);
     port->dev_write_handler = handle_dev_fd_close_write;
     gensio_set_write_callback_enable(port->io, true);
 }
@@ -705,14 +973,15 @@ netcon_finish_shutdown(net_info_t *netcon)
 
     if (netcon->net) {
 	report_disconnect(port, netcon);
-	gensio_free(netcon->net);
-	netcon->net = NULL;
+	netcon_release_net(netcon);
     }
 
     netcon->closing = false;
     netcon->bytes_received = 0;
     netcon->bytes_sent = 0;
     netcon->write_pos = 0;
+    fanout_cursor_release(&port->dev_to_net_ring, &netcon->fanout);
+    netcon->bytes_dropped = 0;
     if (netcon->banner) {
 	gbuf_free(netcon->banner);
 	netcon->banner = NULL;
@@ -755,6 +1024,13 @@ shutdown_one_netcon(net_info_t *netcon, const char *reason)
 	return;
 
     netcon->write_pos = 0;
+    if (netcon->fanout.chunk) {
+	port_info_t *port = netcon->port;
+
+	/* Don't let our unsent data hold up the other connections. */
+	fanout_cursor_release(&port->dev_to_net_ring, &netcon->fanout);
+	fanout_check_dev_read(port);
+    }
     footer_trace(netcon->port, "netcon", reason);
 
     netcon->close_on_output_done = false;
@@ -831,8 +1107,9 @@ accept_read_disabled(struct gensio_accepter *acc, void *cb_data)
 		netcon->new_net = NULL;
 	    }
 
-	    if (port->dev_to_net_state == PORT_WAITING_OUTPUT_CLEAR &&
-			netcon->write_pos < port->dev_to_net.cursize)
+	    if ((port->dev_to_net_state == PORT_WAITING_OUTPUT_CLEAR &&
+			netcon->write_pos < port->dev_to_net.cursize) ||
+			netcon->fanout.queued)
 		/* Net has data to send, wait until it's done. */
 		netcon->close_on_output_done = true;
 	    else
@@ -842,6 +1119,7 @@ accept_read_disabled(struct gensio_accepter *acc, void *cb_data)
 
     port->dev_to_net_state = PORT_CLOSING;
     port->net_to_dev_state = PORT_CLOSING;
+    port_restart_timer(port); /* Tick for shutdown_timeout_count. */
 
     if (!some_to_close)
 	start_shutdown_port_io(port);
@@ -911,6 +1189,8 @@ port_timeout(struct gensio_timer *timer, void *data)
 {
     port_info_t *port = (port_info_t *) data;
     net_info_t *netcon;
+    struct gensio_link *l, *l2;
+    gensio_time now;
     int err;
 
     so->lock(port->lock);
@@ -945,19 +1225,21 @@ port_timeout(struct gensio_timer *timer, void *data)
 	}
     }
 
-    if (port->nocon_read_enable_time_left) {
-	port->nocon_read_enable_time_left--;
-	if (port->nocon_read_enable_time_left == 0)
+    port->o->get_monotonic_time(port->o, &now);
+    if (port->monitor_blocked)
+	monitor_check_timeout(port, &now);
+
+    if (port->nocon_read_enable_pending) {
+	if (cmp_time(&port->nocon_read_enable_time, &now) <= 0) {
+	    port->nocon_read_enable_pending = false;
 	    gensio_set_read_callback_enable(port->io, true);
+	}
 	goto out;
     }
 
     if (port->timeout && port_in_use(port)) {
-	for_each_connection(port, netcon) {
-	    if (!netcon->net)
-		continue;
-	    netcon->timeout_left--;
-	    if (netcon->timeout_left < 0)
+	for_each_active_connection(port, netcon, l, l2) {
+	    if (cmp_time(&netcon->timeout_at, &now) <= 0)
 		shutdown_one_netcon(netcon, "timeout");
 	}
     }
@@ -968,13 +1250,72 @@ port_timeout(struct gensio_timer *timer, void *data)
     so->unlock(port->lock);
 }
 
+/*
+ * Is the running port configured exactly as the new one?  If so it
+ * can be left alone on a reload.
+ */
+static bool
+port_config_same(port_info_t *curr, port_info_t *new)
+{
+    if (curr->deleted || curr->new_config)
+	return false;
+    if (!curr->config_sig || !new->config_sig)
+	return false;
+    return (curr->config_sig_len == new->config_sig_len &&
+	    memcmp(curr->config_sig, new->config_sig,
+		   curr->config_sig_len) == 0);
+}
+
+/*
+ * Keep a running port across a reload in place of its identical new
+ * config.  The LED definitions are recreated by every reload, so
+ * take the new ones.
+ */
+static void
+port_keep_config(port_info_t *curr, port_info_t *new)
+{
+    so->lock(curr->lock);
+    curr->led_rx = new->led_rx;
+    curr->led_tx = new->led_tx;
+    port_select_data_path(curr);
+    curr->reload_kept = true;
+    so->unlock(curr->lock);
+}
+
 void
 apply_new_ports(struct absout *eout)
 {
     port_info_t *new, *curr, *next, *prev, *new_prev;
 
     so->lock(ports_lock);
-    /* First turn off all the accepters. */
+
+    /*
+     * Find the ports whose configuration didn't change.  Those are
+     * left running untouched, with their accepters, buffers and
+     * connections, and are pulled out of the ports list so the rest
+     * of this doesn't see them.
+     */
+    for (new = new_ports; new; new = new->next) {
+	curr = port_index_find(new->name);
+	if (curr && !curr->reload_kept && port_config_same(curr, new)) {
+	    port_keep_config(curr, new);
+	    new->reload_keep = curr;
+	}
+    }
+    for (prev = NULL, curr = ports; curr; curr = next) {
+	next = curr->next;
+	if (curr->reload_kept) {
+	    if (prev)
+		prev->next = next;
+	    else
+		ports = next;
+	} else {
+	    prev = curr;
+	}
+    }
+    port_index_rebuild();
+
+    /* Turn off all the accepters of the ports being changed. */
     for (curr = ports; curr; curr = curr->next) {
 	int err;
 
@@ -1008,6 +1349,8 @@ apply_new_ports(struct absout *eout)
      */
     for (new_prev = NULL, new = new_ports; new;
 			new_prev = new, new = new->next) {
+	if (new->reload_keep)
+	    continue;
 	so->lock(new->lock);
 	for (prev = NULL, curr = ports; curr; prev = curr, curr = curr->next) {
 	    so->lock(curr->lock);
@@ -1096,14 +1439,39 @@ apply_new_ports(struct absout *eout)
 	}
     }
 
+    /* Put the kept ports back in place of their new configs. */
+    for (new_prev = NULL, new = new_ports; new; new = next) {
+	next = new->next;
+	curr = new->reload_keep;
+	if (!curr) {
+	    new_prev = new;
+	    continue;
+	}
+	curr->next = next;
+	if (new_prev)
+	    new_prev->next = curr;
+	else
+	    new_ports = curr;
+	if (new_ports_end == new)
+	    new_ports_end = curr;
+	free_port(new);
+	new_prev = curr;
+    }
+
     /* Now start up the new ports. */
     ports = new_ports;
     new_ports = NULL;
     new_ports_end = NULL;
+    port_index_rebuild();
 
     for (curr = ports; curr; curr = curr->next) {
 	so->lock(curr->lock);
-	if (!curr->deleted) {
+	/* Ports still running from the old config get the new LEDs. */
+	curr->led_rx = led_rebind(curr->led_rx);
+	curr->led_tx = led_rebind(curr->led_tx);
+	if (curr->reload_kept) {
+	    curr->reload_kept = false;
+	} else if (!curr->deleted) {
 	    curr->dev_to_net_state = PORT_CLOSED;
 	    curr->net_to_dev_state = PORT_CLOSED;
 	    if (curr->accepter_stopped) {
@@ -1123,6 +1491,9 @@ apply_new_ports(struct absout *eout)
 	so->unlock(curr->lock);
     }
     so->unlock(ports_lock);
+
+    /* Nothing points to the old LEDs now. */
+    free_retired_leds();
 }
 
 int
@@ -1131,34 +1502,57 @@ dataxfer_setup_port(port_info_t *new_port, struct absout *eout,
 {
     int err;
 
-    new_port->timer = so->alloc_timer(so, port_timeout, new_port);
+    new_port->o = port_os_funcs();
+
+    /*
+     * Pass-through only works if nothing has to see or hold the
+     * device data in ser2net.  Monitors can come and go, so they are
+     * checked on each read.
+     */
+    new_port->passthrough_ok = (new_port->passthrough &&
+				!new_port->trace_read.filename &&
+				!new_port->trace_both.filename &&
+				!new_port->sendon_len &&
+				!new_port->closeon_len &&
+				new_port->framer.type == FRAMER_NONE &&
+				!new_port->led_rx &&
+				!new_port->fanout_backlog &&
+				!new_port->chardelay_adaptive &&
+				new_port->max_connections == 1);
+    port_select_data_path(new_port);
+
+    new_port->timer = new_port->o->alloc_timer(new_port->o, port_timeout,
+					       new_port);
     if (!new_port->timer) {
 	eout->out(eout, "Could not allocate timer data");
 	return -1;
     }
 
-    new_port->send_timer = so->alloc_timer(so, port_send_timeout, new_port);
+    new_port->send_timer = new_port->o->alloc_timer(new_port->o,
+						    port_send_timeout,
+						    new_port);
     if (!new_port->send_timer) {
 	eout->out(eout, "Could not allocate timer data");
 	return -1;
     }
 
-    new_port->runshutdown = so->alloc_runner(so, finish_shutdown_port,
-					     new_port);
+    new_port->runshutdown = new_port->o->alloc_runner(new_port->o,
+						      finish_shutdown_port,
+						      new_port);
     if (!new_port->runshutdown) {
 	eout->out(eout, "Could not allocate shutdown runner");
 	return -1;
     }
 
-    err = str_to_gensio(new_port->devname, so, handle_dev_event, new_port,
-			&new_port->io);
+    err = str_to_gensio(new_port->devname, new_port->o, handle_dev_event,
+			new_port, &new_port->io);
     if (err) {
 	eout->out(eout, "device configuration %s invalid: %s",
 		  new_port->devname, gensio_err_to_str(err));
 	return -1;
     }
 
-    err = str_to_gensio_accepter(new_port->accstr, so,
+    err = str_to_gensio_accepter(new_port->accstr, new_port->o,
 				handle_port_child_event, new_port,
 				&new_port->accepter);
     if (err) {
@@ -1173,7 +1567,7 @@ dataxfer_setup_port(port_info_t *new_port, struct absout *eout,
 	if (new_port->allow_2217)
 	    str = "telnet(rfc2217=true)";
 	err = str_to_gensio_accepter_child(new_port->accepter, str,
-					   so,
+					   new_port->o,
 					   handle_port_child_event,
 					   new_port, &parent);
 	if (err) {
@@ -1216,6 +1610,7 @@ shutdown_ports(void)
 	    free_port(port);
 	}
     }
+    port_index_rebuild();
     so->unlock(ports_lock);
 }
 
@@ -1229,8 +1624,13 @@ void
 shutdown_dataxfer(void)
 {
     shutdown_rotators();
+    shutdown_tracing();
     if (ports_lock)
 	so->free_lock(ports_lock);
+    free(port_name_hash);
+    free(port_dev_hash);
+    port_name_hash = NULL;
+    port_dev_hash = NULL;
 }
 
 int
@@ -1251,6 +1651,10 @@ init_dataxfer(void)
 	fprintf(stderr, "Unable to start mdns: %s\n", gensio_err_to_str(rv));
 #endif /* DO_MDNS */
 
+    rv = init_tracing();
+    if (rv)
+	goto out;
+
     rv = init_rotators();
 
  out:
@@ -29,8 +29,13 @@
 #include <netdb.h>
 #include <sys/time.h>
 #include "gbuf.h"
+#include "fanout.h"
+#include "portstats.h"
+#include "framer.h"
 #include "absout.h"
+#include "ser2net.h"
 #include <gensio/gensio.h>
+#include <gensio/gensio_list.h>
 
 #if (defined(gensio_version_major) && (gensio_version_major > 2 ||	\
      (gensio_version_major == 2 && gensio_version_minor >= 2)))
@@ -47,47 +52,80 @@
 					     so I can send data. */
 #define PORT_CLOSING			4 /* Waiting for output close
 					     string to be sent. */
+
+/* What to do with a connection that falls behind in fanout mode. */
+#define SLOW_CLIENT_BLOCK		0 /* Stop reading the device until
+					     the connection catches up. */
+#define SLOW_CLIENT_DROP		1 /* Drop the oldest data queued for
+					     the connection. */
+#define SLOW_CLIENT_DISCONNECT		2 /* Close the connection. */
+struct trace_file;
+struct port_rotator_ref;
+struct str_template;
+
 typedef struct trace_info_s
 {
     bool hexdump;     /* output each block as a hexdump */
     bool timestamp;   /* preceed each line with a timestamp */
+    bool pcap;        /* write a pcap file instead of text */
     char *filename;   /* open file.  NULL if not used */
-    int  fd;          /* open file.  -1 if not used */
+    struct trace_file *file; /* open file.  NULL if not used */
+    time_t ts_time;   /* time ts_str was formatted for */
+    char ts_str[32];  /* last formatted timestamp */
+    int ts_len;       /* length of ts_str, 0 if not set */
 } trace_info_t;
 
 typedef struct port_info port_info_t;
 typedef struct net_info net_info_t;
 
-struct net_info {
-    port_info_t	   *port;		/* My port. */
+#define MONITOR_NET	(1 << 0)	/* Data from the network. */
+#define MONITOR_DEV	(1 << 1)	/* Data from the device. */
 
-    bool	   closing;		/* Is the connection in the process
-					   of closing? */
+/*
+ * A controller subscribed to a port's data, see data_monitor_start().
+ * Kept on the port's monitors list, protected by the port lock.
+ */
+struct port_monitor {
+    struct controller_info *cntlr;
+    unsigned int dirs;			/* MONITOR_xxx flags. */
+    bool timestamps;			/* Put a time on each block. */
 
-    struct gensio   *net;		/* When connected, the network
-					   connection, NULL otherwise. */
+    /*
+     * If block_time is set, stop reading the port when the controller
+     * falls behind, for at most block_time milliseconds, instead of
+     * dropping data.
+     */
+    unsigned int block_time;
+    bool blocked;
+    bool gave_up;			/* Blocked too long, drop until
+					   the controller catches up. */
+    gensio_time block_until;
 
-    bool remote_fixed;			/* Tells if the remote address was
-					   set in the configuration, and
-					   cannot be changed. */
-    bool connect_back;			/* True if we connect to the remote
-					   address when data comes in. */
-    const char *remote_str;
+    gensiods dropped;			/* Not yet reported to the user. */
 
-    gensiods bytes_received;		/* Number of bytes read from the
-					   network port. */
-    gensiods bytes_sent;		/* Number of bytes written to the
-					   network port. */
+    struct port_monitor *next;
+};
 
-    struct gbuf *banner;		/* Outgoing banner */
+/*
+ * The fields touched on every data transfer come first so they share
+ * the first cache lines, the ones only used at connect and disconnect
+ * time follow.  Connection slots are allocated as they are first
+ * needed, see netcon_alloc(), and stay until the port is freed.
+ */
+struct net_info {
+    port_info_t	   *port;		/* My port. */
+
+    struct gensio   *net;		/* When connected, the network
+					   connection, NULL otherwise. */
 
     gensiods write_pos;			/* Our current position in the
 					   output buffer where we need
 					   to start writing next. */
 
-    int            timeout_left;	/* The amount of time left (in
-					   seconds) before the timeout
-					   goes off. */
+    struct gbuf *banner;		/* Outgoing banner */
+
+    bool	   closing;		/* Is the connection in the process
+					   of closing? */
 
     /*
      * Close the session when all the output has been written to the
@@ -100,7 +138,36 @@ struct net_info {
     bool modemstate_sent;	/* Has a modemstate been sent? */
     bool linestate_sent;	/* Has a linestate been sent? */
 
-    char remaddr[NI_MAXHOST + NI_MAXSERV + 2];
+    gensio_time    timeout_at;		/* When the inactivity timeout
+					   goes off, if the port has a
+					   timeout. */
+
+    gensiods bytes_received;		/* Number of bytes read from the
+					   network port. */
+    gensiods bytes_sent;		/* Number of bytes written to the
+					   network port. */
+
+    struct fanout_cursor fanout;	/* Our position in the port's
+					   dev_to_net_ring, if fanout is
+					   enabled. */
+    gensiods bytes_dropped;		/* Bytes dropped because the
+					   connection was too slow. */
+
+    struct gensio_link active_link;	/* In active_netcons when net is
+					   set. */
+
+    /* Everything below here is only used at connection changes. */
+
+    struct gensio_link free_link;	/* In free_netcons when net is not
+					   set and the remote isn't fixed. */
+    bool on_free_list;
+
+    bool remote_fixed;			/* Tells if the remote address was
+					   set in the configuration, and
+					   cannot be changed. */
+    bool connect_back;			/* True if we connect to the remote
+					   address when data comes in. */
+    const char *remote_str;
 
     /*
      * If a user gets kicked, store the information for the new user
@@ -108,12 +175,25 @@ struct net_info {
      * the packet, we have to store it someplace.
      */
     struct gensio *new_net;
+
+    unsigned int slot;			/* Position in the port's netcons
+					   list, stays the same while
+					   the netcon exists. */
+    net_info_t *next;			/* In the port's netcons list. */
 };
 
 struct port_info
 {
     struct gensio_lock *lock;
 
+    /*
+     * The os funcs the port's device, accepter, connections and timers
+     * run on, see port_os_funcs().  Connections that come in through
+     * a rotator are the exception, they run on the rotator's os funcs,
+     * so the port lock must be used even with workers.
+     */
+    struct gensio_os_funcs *o;
+
     /* If false, port is not accepting, if true it is. */
     bool enabled;
 
@@ -146,9 +226,10 @@ struct port_info
     unsigned int connector_retry_time;
     unsigned int accepter_retry_time;
 
-    unsigned int nocon_read_enable_time_left;
+    bool nocon_read_enable_pending;
+    gensio_time nocon_read_enable_time;
     /* Used if a connect back is requested an no connections could
-       be made, to try again. */
+       be made, to try again at nocon_read_enable_time. */
 
     /*
      * Used to count timeouts during a shutdown, to make sure close
@@ -190,6 +271,20 @@ struct port_info
 					   data, no matter what, set
 					   by chardelay_max. */
 
+    /*
+     * Adaptive chardelay.  The gaps between device reads are sorted
+     * into gaps inside a burst and gaps between bursts, and chardelay
+     * is set to wait out the first but not the second.  All times
+     * are in microseconds.
+     */
+    bool chardelay_adaptive;
+    bool last_dev_read_valid;
+    gensio_time last_dev_read;
+    int gap_burst_avg;			/* Average gap inside a burst. */
+    int gap_burst_dev;			/* Mean deviation of the above. */
+    int gap_idle_avg;			/* Average gap between bursts. */
+    unsigned int gap_samples;
+
     /* Information about the network port. */
     char               *name;           /* The name given for the port. */
     char               *accstr;         /* The accepter string. */
@@ -203,11 +298,32 @@ struct port_info
     unsigned int max_connections;	/* Maximum number of connections
 					   we can accept at a time for this
 					   port. */
-    net_info_t *netcons;
+    net_info_t *netcons;		/* All allocated netcons, in
+					   allocation order. */
+    net_info_t *netcons_tail;
+    unsigned int netcon_slots;		/* Number of netcons allocated, at
+					   most max_connections. */
+    unsigned int net_count;		/* Number of netcons with a net. */
+
+    /*
+     * Connected netcons, oldest first, and netcons available for new
+     * connections, so nothing has to scan all of netcons.
+     */
+    struct gensio_list active_netcons;
+    struct gensio_list free_netcons;
+
+    /*
+     * Rotators this port is a member of, used to tell them when a
+     * connection slot frees up.  Modified with ports_lock and the
+     * port lock held.
+     */
+    struct port_rotator_ref *rotator_refs;
 
     gensiods dev_bytes_received;    /* Number of bytes read from the device. */
     gensiods dev_bytes_sent;        /* Number of bytes written to the device. */
 
+    struct port_stats stats;
+
     /*
      * Informationd use when transferring information from the network
      * port to the terminal device.
@@ -218,9 +334,25 @@ struct port_info
 
     struct gbuf    net_to_dev;			/* Buffer for network
 						   to dev transfers. */
-    struct controller_info *net_monitor; /* If non-null, send any input
-					    received from the network port
-					    to this controller port. */
+
+    /*
+     * Extra buffers that are filled from the network while net_to_dev
+     * is being written to the device.  net_to_dev_nbufs is the total
+     * number of buffers, including net_to_dev, so net_to_dev_q has
+     * net_to_dev_nbufs - 1 entries.  Network reads are only stopped
+     * when all of them are full.
+     */
+    unsigned int   net_to_dev_nbufs;
+    struct gbuf    *net_to_dev_q;
+    unsigned int   net_to_dev_qhead;		/* Oldest full entry. */
+    unsigned int   net_to_dev_qcount;		/* Number of full entries. */
+
+    /*
+     * Don't write network data to the device as soon as it comes in,
+     * add it to the last waiting buffer and write everything waiting
+     * in one go when the device is ready.
+     */
+    bool net_batch;
     struct gbuf *devstr;		 /* Outgoing string */
 
     /*
@@ -233,18 +365,44 @@ struct port_info
 
     struct gbuf dev_to_net;
 
+    /*
+     * If fanout_backlog is non-zero, data in dev_to_net is moved into
+     * dev_to_net_ring when it is sent and each connection writes it
+     * from there at its own pace.  The device is not held up unless
+     * a connection has more than fanout_backlog bytes queued and
+     * slow_client is SLOW_CLIENT_BLOCK.
+     */
+    struct fanout_ring dev_to_net_ring;
+    gensiods fanout_backlog;
+    int slow_client;
+
+    /*
+     * The passthrough option was given, and passthrough_ok is set at
+     * setup if nothing configured on the port needs to look at the
+     * device data.  Then device data is written to a single caught up
+     * connection straight from the read buffer, see
+     * dev_passthrough_write().
+     */
+    bool passthrough;
+    bool passthrough_ok;
+
     /*
      * We have called shutdown_port but the accepter has not yet been
      * read disabled.
      */
     bool shutdown_started;
 
-    struct controller_info *dev_monitor; /* If non-null, send any input
-					    received from the device
-					    to this controller port. */
+    /*
+     * Controllers watching the data on the port, and the number of
+     * them currently holding off reads because they are behind.
+     */
+    struct port_monitor *monitors;
+    unsigned int monitor_blocked;
 
     struct port_info *next;		/* Used to keep a linked list
 					   of these. */
+    struct port_info *name_hnext;	/* Hash chains for the port */
+    struct port_info *dev_hnext;	/* name and device indexes. */
 
     /*
      * The port was reconfigured but had pending users.  This holds the
@@ -252,6 +410,22 @@ struct port_info
      */
     struct port_info *new_config;
 
+    /*
+     * Everything the port was configured from, in a canonical form.
+     * On a reload, a port whose signature didn't change is left
+     * running as it is.
+     */
+    char *config_sig;
+    gensiods config_sig_len;
+
+    /*
+     * Used while applying a reload.  reload_keep is set in a new port
+     * to the running port it matched, which is kept in its place.
+     * reload_kept is set in that running port.
+     */
+    struct port_info *reload_keep;
+    bool reload_kept;
+
     char *rs485; /* If not NULL, rs485 was specified. */
 
     /* For RFC 2217 */
@@ -279,13 +453,19 @@ struct port_info
     /* String to send to device at close, or NULL if none. */
     char *closestr;
 
+    /* The above three strings compiled by str_template_compile(). */
+    struct str_template *banner_tmpl;
+    struct str_template *openstr_tmpl;
+    struct str_template *closestr_tmpl;
+
     /*
      * Close on string to shutdown connection when received from
      * serial side, or NULL if none.
      */
     char *closeon;
-    gensiods closeon_pos;
     gensiods closeon_len;
+    struct strmatch *closeon_match;
+    unsigned int closeon_pos;
 
     /*
      * File to read/write trace, NULL if none.  If the same, then
@@ -308,6 +488,13 @@ struct port_info
     bool io_open;
     void (*dev_write_handler)(port_info_t *);
 
+    /* Set by port_select_data_path(). */
+    int (*dev_read_handler)(port_info_t *port, int err, unsigned char *buf,
+			    gensiods buflen);
+    gensiods (*net_read_handler)(net_info_t *netcon, struct gensio *net,
+				 int readerr, unsigned char *buf,
+				 gensiods buflen);
+
     /*
      * devname as specified on the line, not the substituted version.  Only
      * non-null if devname was substituted.
@@ -336,8 +523,15 @@ struct port_info
      * Delimiter for sending.
      */
     char *sendon;
-    gensiods sendon_pos;
     gensiods sendon_len;
+    struct strmatch *sendon_match;
+    unsigned int sendon_pos;
+
+    /*
+     * Splits the device data into frames, each frame is sent to the
+     * network by itself.  If set, sendon is not used.
+     */
+    struct framer framer;
 
 #ifdef DO_MDNS
     /*
@@ -356,6 +550,7 @@ struct port_info
     gensiods mdns_txt_argc;
     gensiods mdns_txt_args;
     struct gensio_mdns_service *mdns_service;
+    struct ser2net_job mdns_job;	/* Finds the sysfs attributes. */
 #endif /* DO_MDNS */
 };
 
@@ -366,8 +561,10 @@ int handle_dev_event(struct gensio *io, void *user_data, int event, int err,
 		     const char *const *auxdata);
 int port_dev_enable(port_info_t *port);
 int gbuf_write(port_info_t *port, struct gbuf *buf);
+bool net_to_dev_next_buf(port_info_t *port);
 void report_disconnect(port_info_t *port, net_info_t *netcon);
 void port_send_timeout(struct gensio_timer *timer, void *data);
+void fanout_check_dev_read(port_info_t *port);
 
 /* In port.c */
 extern struct gensio_lock *ports_lock;
@@ -377,20 +574,55 @@ extern port_info_t *new_ports_end;
 net_info_t *first_live_net_con(port_info_t *port);
 bool port_in_use(port_info_t *port);
 int is_device_already_inuse(port_info_t *check_port);
+/*
+ * Index the ports list by name and device.  Must be called with
+ * ports_lock held, rebuild every time the ports list changes.
+ */
+void port_index_rebuild(void);
+port_info_t *port_index_find(const char *name);
+/* Incremented every time the index is rebuilt. */
+extern unsigned int port_index_gen;
+void netcon_release_net(net_info_t *netcon);
 int num_connected_net(port_info_t *port);
 gensiods net_raddr(struct gensio *io, struct sockaddr_storage *addr,
 		   gensiods *socklen);
 void reset_timer(net_info_t *netcon);
+/* Call with the port lock held when the port's data handling changes. */
+void port_select_data_path(port_info_t *port);
 #define for_each_connection(port, netcon)			\
-    for (netcon = port->netcons;				\
-	 netcon < &(port->netcons[port->max_connections]);	\
-	 netcon++)
+    for (netcon = port->netcons; netcon; netcon = netcon->next)
+
+/*
+ * Iterate over the connected netcons.  The current netcon may be
+ * disconnected in the loop body.
+ */
+#define for_each_active_connection(port, netcon, l, l2)			\
+    gensio_list_for_each_safe(&(port)->active_netcons, l, l2)		\
+	if (!((netcon) = gensio_container_of(l, net_info_t, active_link))) \
+	    ;								\
+	else
+
+void init_netcon_lists(port_info_t *port);
+net_info_t *netcon_alloc(port_info_t *port);
+void netcon_free_all(port_info_t *port);
+net_info_t *first_free_netcon(port_info_t *port);
 void shutdown_one_netcon(net_info_t *netcon, const char *reason);
 int dataxfer_setup_port(port_info_t *new_port, struct absout *eout,
 			bool do_telnet);
 int startup_port(struct absout *eout, port_info_t *port);
 int shutdown_port(port_info_t *port, const char *errreason);
+/* Stop any pending mdns setup and remove the port's mdns service. */
+void mdns_shutdown(port_info_t *port);
 void port_start_timer(port_info_t *port);
+/* Re-arm the port timer after something it waits for changed. */
+void port_restart_timer(port_info_t *port);
+void port_nocon_read_disable(port_info_t *port);
+
+/* In dataxfer.c */
+void monitor_unblock(port_info_t *port, struct port_monitor *mon);
+void monitor_port_reset(port_info_t *port);
+void monitor_check_timeout(port_info_t *port, gensio_time *now);
+gensio_time *monitor_next_timeout(port_info_t *port);
 
 /* In portconfig.c */
 bool remaddr_check(const struct port_remaddr *list,
@@ -405,10 +637,23 @@ char *process_str_to_str(port_info_t *port, net_info_t *netcon,
 			 const char *str, struct timeval *tv,
 			 gensiods *lenrv, int isfilename);
 gensiods net_raddr_str(struct gensio *io, char *buf, gensiods buflen);
+/*
+ * Pre-expand everything in str that doesn't change between uses.  A
+ * NULL or empty string results in a NULL template, which renders as
+ * NULL.
+ */
+int str_template_compile(port_info_t *port, const char *str,
+			 struct str_template **rtmpl);
+struct gbuf *str_template_render(port_info_t *port, net_info_t *netcon,
+				 struct str_template *t);
+void str_template_free(struct str_template *t);
 
 /* In rotator.c */
 void shutdown_rotators(void);
 int init_rotators(void);
+/* Called with the port lock held when a connection goes away. */
+void rotator_port_freed(port_info_t *port);
+void free_port_rotator_refs(port_info_t *port);
 
 /* In trace.c */
 void header_trace(port_info_t *port, net_info_t *netcon);
@@ -417,6 +662,10 @@ void do_trace(port_info_t *port, trace_info_t *t, const unsigned char *buf,
 	      gensiods buf_len, const char *prefix);
 void setup_trace(port_info_t *port);
 void shutdown_trace(port_info_t *port);
+/* Bytes dropped from the port's trace files.  Call with port->lock held. */
+unsigned long trace_dropped(port_info_t *port);
+int init_tracing(void);
+void shutdown_tracing(void);
 
 /* In addsyattrs.c */
 void add_sys_attrs(struct absout *eout, const char *portname,
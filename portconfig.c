@@ -272,6 +272,8 @@ port_add_connback(struct absout *eout, port_info_t *port, const char *istr)
 static void
 finish_free_port(port_info_t *port)
 {
+    unsigned int i;
+
     assert(port->free_count > 0);
     port->free_count--;
     if (port->free_count != 0) {
@@ -281,19 +283,30 @@ finish_free_port(port_info_t *port)
     so->unlock(port->lock);
     so->free_lock(port->lock);
     remaddr_list_free(port->remaddrs);
+    free_port_rotator_refs(port);
+    while (port->monitors) {
+	struct port_monitor *mon = port->monitors;
+
+	port->monitors = mon->next;
+	free(mon);
+    }
     remaddr_list_free(port->connbacks);
     if (port->accepter)
 	gensio_acc_free(port->accepter);
-    if (port->dev_to_net.buf)
-	free(port->dev_to_net.buf);
-    if (port->net_to_dev.buf)
-	free(port->net_to_dev.buf);
+    gbuf_cleanup(&port->dev_to_net);
+    fanout_ring_free(&port->dev_to_net_ring);
+    gbuf_cleanup(&port->net_to_dev);
+    if (port->net_to_dev_q) {
+	for (i = 0; i < port->net_to_dev_nbufs - 1; i++)
+	    gbuf_cleanup(&port->net_to_dev_q[i]);
+	free(port->net_to_dev_q);
+    }
     if (port->timer)
-	so->free_timer(port->timer);
+	port->o->free_timer(port->timer);
     if (port->send_timer)
-	so->free_timer(port->send_timer);
+	port->o->free_timer(port->send_timer);
     if (port->runshutdown)
-	so->free_runner(port->runshutdown);
+	port->o->free_runner(port->runshutdown);
     if (port->io)
 	gensio_free(port->io);
     if (port->trace_read.filename)
@@ -323,14 +336,22 @@ finish_free_port(port_info_t *port)
 	free(port->openstr);
     if (port->closestr)
 	free(port->closestr);
+    if (port->config_sig)
+	free(port->config_sig);
+    str_template_free(port->banner_tmpl);
+    str_template_free(port->openstr_tmpl);
+    str_template_free(port->closestr_tmpl);
     if (port->closeon)
 	free(port->closeon);
-    if (port->netcons)
-	free(port->netcons);
+    netcon_free_all(port);
     if (port->orig_devname)
 	free(port->orig_devname);
     if (port->sendon)
 	free(port->sendon);
+    strmatch_free(port->sendon_match);
+    strmatch_free(port->closeon_match);
+    framer_free(&port->framer);
+    mdns_shutdown(port);
 #ifdef DO_MDNS
     if (port->mdns_name)
 	free(port->mdns_name);
@@ -361,13 +382,11 @@ free_port(port_info_t *port)
     net_info_t *netcon;
     int err;
 
-    if (port->netcons) {
-	for_each_connection(port, netcon) {
-	    char *err = "Port was deleted\n\r";
-	    if (netcon->new_net) {
-		gensio_write(netcon->new_net, NULL, err, strlen(err), NULL);
-		gensio_free(netcon->new_net);
-	    }
+    for_each_connection(port, netcon) {
+	char *err = "Port was deleted\n\r";
+	if (netcon->new_net) {
+	    gensio_write(netcon->new_net, NULL, err, strlen(err), NULL);
+	    gensio_free(netcon->new_net);
 	}
     }
 
@@ -376,14 +395,14 @@ free_port(port_info_t *port)
 
     /* Make sure all the timers are stopped. */
     if (port->send_timer) {
-	err = so->stop_timer_with_done(port->send_timer,
+	err = port->o->stop_timer_with_done(port->send_timer,
 				       gen_timer_shutdown_done, port);
 	if (err != GE_TIMEDOUT)
 	    port->free_count++;
     }
 
     if (port->timer) {
-	err = so->stop_timer_with_done(port->timer,
+	err = port->o->stop_timer_with_done(port->timer,
 				       gen_timer_shutdown_done, port);
 	if (err != GE_TIMEDOUT)
 	    port->free_count++;
@@ -469,6 +488,119 @@ update_str_val(const char *str, char **outstr, const char *name,
     return 0;
 }
 
+/*
+ * Parse a framer specification, one of:
+ *   none
+ *   modbus-rtu
+ *   length,<offset>,<size>[,<adjust>[,le|be]]
+ *   delim,<string>[,<string>...]
+ */
+static int
+framer_config(port_info_t *port, struct absout *eout, const char *val)
+{
+    struct framer *f = &port->framer;
+    char *spec, *args, *end, *tok;
+    char **strs = NULL;
+    gensiods *lens = NULL;
+    unsigned int nstrs = 0, i;
+    unsigned long v;
+    long adj;
+    int rv = -1;
+
+    spec = strdup(val);
+    if (!spec) {
+	eout->out(eout, "Out of memory allocating framer");
+	return -1;
+    }
+    args = strchr(spec, ',');
+    if (args)
+	*args++ = '\0';
+
+    framer_free(f);
+    if (strcmp(spec, "none") == 0 && !args) {
+	rv = 0;
+    } else if (strcmp(spec, "modbus-rtu") == 0 && !args) {
+	f->type = FRAMER_MODBUS_RTU;
+	rv = 0;
+    } else if (strcmp(spec, "length") == 0 && args) {
+	v = strtoul(args, &end, 0);
+	if (*end != ',' || end == args)
+	    goto out_inval;
+	f->len_offset = v;
+	args = end + 1;
+	v = strtoul(args, &end, 0);
+	if ((*end != ',' && *end != '\0') || end == args ||
+		(v != 1 && v != 2 && v != 4))
+	    goto out_inval;
+	f->len_size = v;
+	if (*end == ',') {
+	    args = end + 1;
+	    adj = strtol(args, &end, 0);
+	    if ((*end != ',' && *end != '\0') || end == args)
+		goto out_inval;
+	    f->len_adjust = adj;
+	    if (*end == ',') {
+		if (strcmp(end + 1, "le") == 0)
+		    f->len_le = true;
+		else if (strcmp(end + 1, "be") != 0)
+		    goto out_inval;
+	    }
+	}
+	f->type = FRAMER_LENGTH;
+	rv = 0;
+    } else if (strcmp(spec, "delim") == 0 && args) {
+	struct timeval tv = { 0, 0 };
+
+	for (tok = args, nstrs = 1; *tok; tok++) {
+	    if (*tok == ',')
+		nstrs++;
+	}
+	strs = calloc(nstrs, sizeof(*strs));
+	lens = calloc(nstrs, sizeof(*lens));
+	if (!strs || !lens)
+	    goto out_nomem;
+	for (i = 0; i < nstrs; i++) {
+	    tok = args;
+	    args = strchr(args, ',');
+	    if (args)
+		*args++ = '\0';
+	    strs[i] = process_str_to_str(port, NULL, tok, &tv, &lens[i], false);
+	    if (!strs[i])
+		goto out_nomem;
+	}
+	f->delims = strmatch_alloc((const char **) strs, lens, nstrs);
+	if (!f->delims) {
+	    eout->out(eout, "No delimiters, or out of memory, in framer: %s",
+		      val);
+	    goto out;
+	}
+	f->type = FRAMER_DELIM;
+	rv = 0;
+    } else {
+	goto out_inval;
+    }
+    goto out;
+
+ out_nomem:
+    eout->out(eout, "Out of memory allocating framer");
+    goto out;
+
+ out_inval:
+    eout->out(eout, "Invalid framer: %s", val);
+ out:
+    if (strs) {
+	for (i = 0; i < nstrs; i++) {
+	    if (strs[i])
+		free(strs[i]);
+	}
+	free(strs);
+    }
+    if (lens)
+	free(lens);
+    free(spec);
+    return rv;
+}
+
 #ifdef DO_MDNS
 static struct gensio_enum_val mdns_nettypes[] = {
     { "unspec", GENSIO_NETTYPE_UNSPEC },
@@ -508,6 +640,16 @@ myconfig(port_info_t *port, struct absout *eout, const char *pos)
 				    &port->trace_read.timestamp) > 0) {
 	port->trace_write.timestamp = port->trace_read.timestamp;
 	port->trace_both.timestamp = port->trace_read.timestamp;
+    } else if (gensio_check_keybool(pos, "trace-pcap",
+				    &port->trace_read.pcap) > 0) {
+	port->trace_write.pcap = port->trace_read.pcap;
+	port->trace_both.pcap = port->trace_read.pcap;
+    } else if (gensio_check_keybool(pos, "trace-read-pcap",
+				    &port->trace_read.pcap) > 0) {
+    } else if (gensio_check_keybool(pos, "trace-write-pcap",
+				    &port->trace_write.pcap) > 0) {
+    } else if (gensio_check_keybool(pos, "trace-both-pcap",
+				    &port->trace_both.pcap) > 0) {
     } else if (gensio_check_keybool(pos, "trace-read-hexdump",
 				    &port->trace_read.hexdump) > 0) {
     } else if (gensio_check_keybool(pos, "trace-read-timestamp",
@@ -557,6 +699,8 @@ myconfig(port_info_t *port, struct absout *eout, const char *pos)
 				   &port->chardelay_min) > 0) {
     } else if (gensio_check_keyuint(pos, "chardelay-max",
 				   &port->chardelay_max) > 0) {
+    } else if (gensio_check_keybool(pos, "chardelay-adaptive",
+				    &port->chardelay_adaptive) > 0) {
     } else if (gensio_check_keyds(pos, "dev-to-net-bufsize",
 				  &port->dev_to_net.maxsize) > 0) {
 	if (port->dev_to_net.maxsize < 2)
@@ -565,6 +709,18 @@ myconfig(port_info_t *port, struct absout *eout, const char *pos)
 				  &port->net_to_dev.maxsize) > 0) {
 	if (port->net_to_dev.maxsize < 2)
 	    port->net_to_dev.maxsize = 2;
+    } else if (gensio_check_keyuint(pos, "net-to-dev-buffers",
+				   &port->net_to_dev_nbufs) > 0) {
+	if (port->net_to_dev_nbufs < 1)
+	    port->net_to_dev_nbufs = 1;
+    } else if (gensio_check_keybool(pos, "net-batch",
+				    &port->net_batch) > 0) {
+    } else if (gensio_check_keybool(pos, "passthrough",
+				    &port->passthrough) > 0) {
+    } else if (gensio_check_keyds(pos, "fanout-backlog",
+				  &port->fanout_backlog) > 0) {
+    } else if (gensio_check_keyenum(pos, "slow-client", slow_client_enums,
+				    &port->slow_client) > 0) {
     } else if (gensio_check_keyuint(pos, "max-connections",
 				   &port->max_connections) > 0) {
 	if (port->max_connections < 1)
@@ -647,6 +803,9 @@ myconfig(port_info_t *port, struct absout *eout, const char *pos)
 	if (port->signaturestr)
 	    free(port->signaturestr);
 	port->signaturestr = fval;
+    } else if (gensio_check_keyvalue(pos, "framer", &val) > 0) {
+	if (framer_config(port, eout, val))
+	    return -1;
     } else if (gensio_check_keyvalue(pos, "sendon", &val) > 0) {
 	struct timeval tv =  { 0, 0 };
 	gensiods len;
@@ -792,19 +951,23 @@ process_connect_back(struct absout *eout, port_info_t *port,
 {
     net_info_t *netcon;
 
-    for_each_connection(port, netcon) {
-        if (netcon->remote_fixed)
-            continue;
-
-	netcon->remote_fixed = true;
-	netcon->remote_str = r->str;
-	netcon->connect_back = true;
+    if (port->netcon_slots >= port->max_connections) {
+	if (eout)
+	    eout->out(eout, "Too many connect back remote addresses specified"
+		      " for the max-connections given");
 	return;
     }
 
-    if (eout)
-	eout->out(eout, "Too many connect back remote addresses specified"
-		  " for the max-connections given");
+    netcon = netcon_alloc(port);
+    if (!netcon) {
+	if (eout)
+	    eout->out(eout, "Out of memory allocating connect back for %s",
+		      r->str);
+	return;
+    }
+    netcon->remote_fixed = true;
+    netcon->remote_str = r->str;
+    netcon->connect_back = true;
 }
 
 static int
@@ -814,9 +977,6 @@ init_port_data(port_info_t *port)
 
     port->net_to_dev_state = PORT_CLOSED;
     port->dev_to_net_state = PORT_CLOSED;
-    port->trace_read.fd = -1;
-    port->trace_write.fd = -1;
-    port->trace_both.fd = -1;
 
     port->telnet_brk_on_sync = find_default_bool("telnet-brk-on-sync");
     port->kickolduser_mode = find_default_bool("kickolduser");
@@ -824,9 +984,15 @@ init_port_data(port_info_t *port)
     port->chardelay_scale = find_default_int("chardelay-scale");
     port->chardelay_min = find_default_int("chardelay-min");
     port->chardelay_max = find_default_int("chardelay-max");
+    port->chardelay_adaptive = find_default_bool("chardelay-adaptive");
     port->dev_to_net.maxsize = find_default_int("dev-to-net-bufsize");
     port->net_to_dev.maxsize = find_default_int("net-to-dev-bufsize");
+    port->net_to_dev_nbufs = find_default_int("net-to-dev-buffers");
+    port->net_batch = find_default_bool("net-batch");
+    port->passthrough = find_default_bool("passthrough");
     port->max_connections = find_default_int("max-connections");
+    port->fanout_backlog = find_default_int("fanout-backlog");
+    port->slow_client = find_default_int("slow-client");
     port->connector_retry_time = find_default_int("connector-retry-time");
     port->accepter_retry_time = find_default_int("accepter-retry-time");
     if (find_default_str("authdir", &port->authdir))
@@ -864,6 +1030,106 @@ init_port_data(port_info_t *port)
     return 0;
 }
 
+struct sig_data {
+    char *buf;
+    gensiods len;
+    gensiods size;
+    bool failed;
+};
+
+/*
+ * Add a length-prefixed item to a port's config signature, so items
+ * can't run into each other.  A NULL item is distinct from an empty
+ * one.
+ */
+static void
+sig_add(struct sig_data *sig, const char *data, gensiods len)
+{
+    char lenstr[24];
+    gensiods llen;
+    char *n;
+
+    if (sig->failed)
+	return;
+    if (data)
+	llen = snprintf(lenstr, sizeof(lenstr), "%lu:", (unsigned long) len);
+    else
+	llen = snprintf(lenstr, sizeof(lenstr), "-:");
+    if (sig->len + llen + len > sig->size) {
+	gensiods nsize = sig->size ? sig->size : 256;
+
+	while (nsize < sig->len + llen + len)
+	    nsize *= 2;
+	n = realloc(sig->buf, nsize);
+	if (!n) {
+	    sig->failed = true;
+	    return;
+	}
+	sig->buf = n;
+	sig->size = nsize;
+    }
+    memcpy(sig->buf + sig->len, lenstr, llen);
+    sig->len += llen;
+    if (data) {
+	memcpy(sig->buf + sig->len, data, len);
+	sig->len += len;
+    }
+}
+
+static void
+sig_add_str(struct sig_data *sig, const char *str)
+{
+    sig_add(sig, str, str ? strlen(str) : 0);
+}
+
+/*
+ * Build the port's config signature from the parameters it was
+ * created from, with all the things they refer to (long strings,
+ * trace files, rs485 configs, defaults) resolved.  LEDs are not
+ * part of it, they are rebound on a reload.
+ */
+static int
+port_config_sig(port_info_t *port, const char *state, unsigned int timeout,
+		const char * const *devcfg)
+{
+    struct sig_data sig;
+    char tostr[16];
+    const char *dsig;
+    gensiods dlen;
+    unsigned int i;
+
+    memset(&sig, 0, sizeof(sig));
+    sig_add_str(&sig, port->name);
+    sig_add_str(&sig, port->accstr);
+    sig_add_str(&sig, state);
+    snprintf(tostr, sizeof(tostr), "%u", timeout);
+    sig_add_str(&sig, tostr);
+    sig_add_str(&sig, port->devname);
+    sig_add_str(&sig, port->orig_devname);
+    for (i = 0; devcfg[i]; i++)
+	sig_add_str(&sig, devcfg[i]);
+    sig_add_str(&sig, port->bannerstr);
+    sig_add_str(&sig, port->signaturestr);
+    sig_add_str(&sig, port->openstr);
+    sig_add_str(&sig, port->closestr);
+    sig_add(&sig, port->closeon, port->closeon_len);
+    sig_add(&sig, port->sendon, port->sendon_len);
+    sig_add_str(&sig, port->trace_read.filename);
+    sig_add_str(&sig, port->trace_write.filename);
+    sig_add_str(&sig, port->trace_both.filename);
+    dsig = config_defaults_sig(&dlen);
+    sig_add(&sig, dsig ? dsig : "", dlen);
+
+    if (sig.failed) {
+	if (sig.buf)
+	    free(sig.buf);
+	return ENOMEM;
+    }
+    port->config_sig = sig.buf;
+    port->config_sig_len = sig.len;
+    return 0;
+}
+
 /* Create a port based on a set of parameters passed in. */
 int
 portconfig(struct absout *eout,
@@ -875,7 +1141,6 @@ portconfig(struct absout *eout,
 	   const char * const *devcfg)
 {
     port_info_t *new_port, *curr;
-    net_info_t *netcon;
     enum str_type str_type;
     int err;
     bool do_telnet = false;
@@ -992,6 +1257,55 @@ portconfig(struct absout *eout,
 	}
     }
 
+    /*
+     * The default closeon and sendon strings don't come with a
+     * length, they can't have nil characters in them.
+     */
+    if (new_port->closeon && !new_port->closeon_len)
+	new_port->closeon_len = strlen(new_port->closeon);
+    if (new_port->closeon_len) {
+	new_port->closeon_match = strmatch_alloc(
+			(const char **) &new_port->closeon,
+			&new_port->closeon_len, 1);
+	if (!new_port->closeon_match) {
+	    eout->out(eout, "Out of memory compiling closeon");
+	    goto errout;
+	}
+    }
+
+    if (new_port->sendon && !new_port->sendon_len)
+	new_port->sendon_len = strlen(new_port->sendon);
+    if (new_port->sendon_len) {
+	new_port->sendon_match = strmatch_alloc(
+			(const char **) &new_port->sendon,
+			&new_port->sendon_len, 1);
+	if (!new_port->sendon_match) {
+	    eout->out(eout, "Out of memory compiling sendon");
+	    goto errout;
+	}
+    }
+
+    if (port_config_sig(new_port, state, timeout, devcfg)) {
+	eout->out(eout, "Out of memory building port config signature");
+	goto errout;
+    }
+
+    if (str_template_compile(new_port, new_port->bannerstr,
+			     &new_port->banner_tmpl)) {
+	eout->out(eout, "Out of memory compiling banner");
+	goto errout;
+    }
+    if (str_template_compile(new_port, new_port->openstr,
+			     &new_port->openstr_tmpl)) {
+	eout->out(eout, "Out of memory compiling openstr");
+	goto errout;
+    }
+    if (str_template_compile(new_port, new_port->closestr,
+			     &new_port->closestr_tmpl)) {
+	eout->out(eout, "Out of memory compiling closestr");
+	goto errout;
+    }
+
     if (!new_port->allowed_users && new_port->default_allowed_users) {
 	err = add_allowed_users(&new_port->allowed_users,
 				new_port->default_allowed_users,
@@ -1019,6 +1333,22 @@ portconfig(struct absout *eout,
 	goto errout;
     }
 
+    if (new_port->net_to_dev_nbufs > 1) {
+	new_port->net_to_dev_q = calloc(new_port->net_to_dev_nbufs - 1,
+					sizeof(struct gbuf));
+	if (!new_port->net_to_dev_q) {
+	    eout->out(eout, "Could not allocate net to dev buffers");
+	    goto errout;
+	}
+	for (i = 0; i < new_port->net_to_dev_nbufs - 1; i++) {
+	    if (gbuf_init(&new_port->net_to_dev_q[i],
+			  new_port->net_to_dev.maxsize)) {
+		eout->out(eout, "Could not allocate net to dev buffers");
+		goto errout;
+	    }
+	}
+    }
+
     /*
      * Don't handle the remaddr/connect back defaults until here, we
      * don't want to mess with it if the user has set it, because the
@@ -1048,18 +1378,10 @@ portconfig(struct absout *eout,
 	}
     }
 
-    new_port->netcons = malloc(sizeof(net_info_t) * new_port->max_connections);
-    if (new_port->netcons == NULL) {
-	eout->out(eout, "Could not allocate a port data structure");
-	goto errout;
-    }
-    memset(new_port->netcons, 0,
-	   sizeof(net_info_t) * new_port->max_connections);
-    for_each_connection(new_port, netcon)
-	netcon->port = new_port;
-
+    /* Other connection slots get allocated as connections come in. */
     for (r = new_port->connbacks; r; r = r->next)
 	process_connect_back(eout, new_port, r);
+    init_netcon_lists(new_port);
 
     /* Link it on the end of new_ports for now. */
     if (new_ports_end)
@@ -23,6 +23,7 @@
  *  release a modified version which carries forward this exception.
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
@@ -69,11 +70,9 @@ showshortport(struct controller_info *cntlr, port_info_t *port)
     controller_outputf(cntlr, NULL, "%7d ", port->timeout);
 
     netcon = first_live_net_con(port);
-    if (!netcon)
-	netcon = &(port->netcons[0]);
 
     if (port_in_use(port)) {
-	if (net_raddr_str(netcon->net, buffer, sizeof(buffer)) != 0)
+	if (netcon && net_raddr_str(netcon->net, buffer, sizeof(buffer)) != 0)
 	    count = controller_outputf(cntlr, NULL, "%s", buffer);
     } else {
 	count = controller_outputf(cntlr, NULL, "unconnected");
@@ -140,6 +139,12 @@ showport(struct controller_info *cntlr, port_info_t *port, bool yaml)
 			       (unsigned long) netcon->bytes_received);
 	    controller_outputf(cntlr, "bytes written to TCP", "%lu",
 			       (unsigned long) netcon->bytes_sent);
+	    if (port->fanout_backlog) {
+		controller_outputf(cntlr, "bytes queued to TCP", "%lu",
+				   (unsigned long) netcon->fanout.queued);
+		controller_outputf(cntlr, "bytes dropped", "%lu",
+				   (unsigned long) netcon->bytes_dropped);
+	    }
 	    controller_indent(cntlr, -1);
 	}
     }
@@ -227,18 +232,15 @@ find_port_by_name(const char *name, bool allow_deleted)
     port_info_t *port;
 
     so->lock(ports_lock);
-    port = ports;
-    while (port != NULL) {
-	if (strcmp(name, port->name) == 0) {
-	    so->lock(port->lock);
-	    so->unlock(ports_lock);
-	    if (port->deleted && !allow_deleted) {
-		so->unlock(port->lock);
-		return NULL;
-	    }
-	    return port;
+    port = port_index_find(name);
+    if (port) {
+	so->lock(port->lock);
+	so->unlock(ports_lock);
+	if (port->deleted && !allow_deleted) {
+	    so->unlock(port->lock);
+	    return NULL;
 	}
-	port = port->next;
+	return port;
     }
 
     so->unlock(ports_lock);
@@ -274,6 +276,107 @@ showports(struct controller_info *cntlr, const char *portspec, bool yaml)
     }
 }
 
+static void
+show_hist(struct controller_info *cntlr, const char *name,
+	  struct port_hist *h)
+{
+    char label[32];
+    unsigned int i;
+
+    controller_outs(cntlr, name, NULL);
+    controller_indent(cntlr, 1);
+    controller_outputf(cntlr, "count", "%lu", h->count);
+    controller_outputf(cntlr, "total", "%lu", h->total);
+    controller_outputf(cntlr, "max", "%lu", h->max);
+    if (h->count) {
+	controller_outs(cntlr, "buckets", NULL);
+	controller_indent(cntlr, 1);
+	for (i = 0; i < PORT_HIST_BUCKETS; i++) {
+	    if (!h->buckets[i])
+		continue;
+	    if (i == PORT_HIST_BUCKETS - 1)
+		strcpy(label, "overflow");
+	    else
+		snprintf(label, sizeof(label), "under %lu", 1UL << i);
+	    controller_outputf(cntlr, label, "%lu", h->buckets[i]);
+	}
+	controller_indent(cntlr, -1);
+    }
+    controller_indent(cntlr, -1);
+}
+
+/* Print the data path statistics for a port. */
+static void
+showportstat(struct controller_info *cntlr, port_info_t *port, bool yaml)
+{
+    struct port_stats *st = &port->stats;
+
+    if (yaml) {
+	controller_outs(cntlr, "port", NULL);
+	controller_indent(cntlr, 1);
+	controller_outputf(cntlr, "name", "%s", port->name);
+    } else {
+	controller_outputf(cntlr, "port", "%s", port->name);
+	controller_indent(cntlr, 1);
+    }
+    controller_outputf(cntlr, "device reads", "%lu", st->dev_reads);
+    controller_outputf(cntlr, "network reads", "%lu", st->net_reads);
+    controller_outputf(cntlr, "network sends", "%lu", st->net_sends);
+    controller_outputf(cntlr, "device read stalls", "%lu",
+		       st->dev_read_stalls);
+    controller_outputf(cntlr, "network read stalls", "%lu",
+		       st->net_read_stalls);
+    controller_outputf(cntlr, "chardelay timeouts", "%lu",
+		       st->chardelay_timeouts);
+    controller_outputf(cntlr, "sendon matches", "%lu", st->sendon_matches);
+    controller_outputf(cntlr, "frames", "%lu", st->frames);
+    controller_outputf(cntlr, "partial device writes", "%lu",
+		       st->partial_dev_writes);
+    show_hist(cntlr, "device to network delay usec", &st->dev_to_net_delay);
+    show_hist(cntlr, "device to network send size", &st->dev_to_net_size);
+    show_hist(cntlr, "device read stall usec", &st->dev_read_stall);
+    show_hist(cntlr, "network read stall usec", &st->net_read_stall);
+    show_hist(cntlr, "network to device buffers in use",
+	      &st->net_to_dev_bufs);
+    if (port->chardelay_adaptive) {
+	controller_outputf(cntlr, "chardelay usec", "%d", port->chardelay);
+	controller_outputf(cntlr, "burst gap average usec", "%d",
+			   port->gap_burst_avg);
+	controller_outputf(cntlr, "idle gap average usec", "%d",
+			   port->gap_idle_avg);
+	show_hist(cntlr, "adaptive chardelay usec", &st->chardelay);
+    }
+    controller_indent(cntlr, -1);
+}
+
+/* Handle a showportstats command from the control port. */
+void
+showportstats(struct controller_info *cntlr, const char *portspec, bool yaml)
+{
+    port_info_t *port;
+
+    if (portspec == NULL) {
+	so->lock(ports_lock);
+	port = ports;
+	while (port != NULL) {
+	    so->lock(port->lock);
+	    showportstat(cntlr, port, yaml);
+	    so->unlock(port->lock);
+	    port = port->next;
+	}
+	so->unlock(ports_lock);
+    } else {
+	port = find_port_by_name(portspec, true);
+	if (port == NULL) {
+	    controller_outputf(cntlr, "error", "Invalid port number - %s",
+			       portspec);
+	} else {
+	    showportstat(cntlr, port, yaml);
+	    so->unlock(port->lock);
+	}
+    }
+}
+
 /* Handle a showport command from the control port. */
 void
 showshortports(struct controller_info *cntlr, const char *portspec)
@@ -344,6 +447,7 @@ setporttimeout(struct controller_info *cntlr, const char *portspec,
 		if (netcon->net)
 		    reset_timer(netcon);
 	    }
+	    port_restart_timer(port);
 	}
 	so->unlock(port->lock);
     }
@@ -468,64 +572,139 @@ setportenable(struct controller_info *cntlr, const char *portspec,
     }
 }
 
-/* Start data monitoring on the given port, type may be either "tcp" or
-   "term" and only one direction may be monitored.  This return NULL if
-   the monitor fails.  The monitor output will go to "fd". */
+/* Start data monitoring on the given port, type may be "tcp", "term"
+   or "both".  This return NULL if the monitor fails.  The monitor
+   output will go to the controller. */
 void *
 data_monitor_start(struct controller_info *cntlr, const char *type,
-		   const char *portspec)
+		   const char *portspec, const char * const *options)
 {
     port_info_t *port;
+    struct port_monitor *mon;
+    const char *str;
+    unsigned int i;
 
-    port = find_port_by_name(portspec, true);
-    if (port == NULL) {
-	controller_outputf(cntlr, "error", "Invalid port number - %s",
-			   portspec);
-	goto out;
-    }
-
-    if ((port->net_monitor != NULL) || (port->dev_monitor != NULL)) {
-	controller_outputf(cntlr, "error", "Port is already being monitored");
-	goto out_unlock;
+    mon = malloc(sizeof(*mon));
+    if (!mon) {
+	controller_outputf(cntlr, "error", "Out of memory");
+	return NULL;
     }
+    memset(mon, 0, sizeof(*mon));
+    mon->cntlr = cntlr;
 
     if (strcmp(type, "tcp") == 0) {
-	port->net_monitor = cntlr;
+	mon->dirs = MONITOR_NET;
     } else if (strcmp(type, "term") == 0) {
-	port->dev_monitor = cntlr;
+	mon->dirs = MONITOR_DEV;
+    } else if (strcmp(type, "both") == 0) {
+	mon->dirs = MONITOR_NET | MONITOR_DEV;
     } else {
-	controller_outs(cntlr, "invalid monitor type - %s", type);
-	so->unlock(port->lock);
-	port = NULL;
-	goto out;
+	controller_outputf(cntlr, "error", "invalid monitor type - %s", type);
+	goto out_err;
     }
- out_unlock:
+
+    for (i = 0; options && options[i]; i++) {
+	if (strcmp(options[i], "timestamp") == 0) {
+	    mon->timestamps = true;
+	} else if (strcmp(options[i], "drop") == 0) {
+	    mon->block_time = 0;
+	} else if (strcmp(options[i], "block") == 0) {
+	    mon->block_time = 1000;
+	} else if (strncmp(options[i], "block=", 6) == 0) {
+	    str = options[i] + 6;
+	    if (scan_int(str) <= 0) {
+		controller_outputf(cntlr, "error", "Invalid block time - %s",
+				   str);
+		goto out_err;
+	    }
+	    mon->block_time = scan_int(str);
+	} else {
+	    controller_outputf(cntlr, "error", "invalid monitor option - %s",
+			       options[i]);
+	    goto out_err;
+	}
+    }
+
+    port = find_port_by_name(portspec, true);
+    if (port == NULL) {
+	controller_outputf(cntlr, "error", "Invalid port number - %s",
+			   portspec);
+	goto out_err;
+    }
+
+    mon->next = port->monitors;
+    port->monitors = mon;
+    port_select_data_path(port);
     so->unlock(port->lock);
- out:
     return port;
+
+ out_err:
+    free(mon);
+    return NULL;
 }
 
-/* Stop monitoring the given id. */
-void
-data_monitor_stop(struct controller_info *cntlr,
-		  void                   *monitor_id)
+/*
+ * Find a monitor for the controller on the given id.  Returns with
+ * the port locked if found.
+ */
+static struct port_monitor **
+find_monitor(struct controller_info *cntlr, void *monitor_id,
+	     port_info_t **rport)
 {
-    port_info_t *port = (port_info_t *) monitor_id;
     port_info_t *curr;
+    struct port_monitor **mon;
 
     so->lock(ports_lock);
-    curr = ports;
-    while (curr) {
-	if (curr == port) {
-	    so->lock(port->lock);
-	    port->net_monitor = NULL;
-	    port->dev_monitor = NULL;
-	    so->unlock(port->lock);
-	    break;
+    for (curr = ports; curr; curr = curr->next) {
+	if (curr != monitor_id)
+	    continue;
+	so->lock(curr->lock);
+	for (mon = &curr->monitors; *mon; mon = &(*mon)->next) {
+	    if ((*mon)->cntlr == cntlr) {
+		so->unlock(ports_lock);
+		*rport = curr;
+		return mon;
+	    }
 	}
-	curr = curr->next;
+	so->unlock(curr->lock);
+	break;
     }
     so->unlock(ports_lock);
+    return NULL;
+}
+
+/* Stop monitoring the given id. */
+void
+data_monitor_stop(struct controller_info *cntlr,
+		  void                   *monitor_id)
+{
+    port_info_t *port;
+    struct port_monitor **monp, *mon;
+
+    monp = find_monitor(cntlr, monitor_id, &port);
+    if (!monp)
+	return;
+    mon = *monp;
+    *monp = mon->next;
+    monitor_unblock(port, mon);
+    port_select_data_path(port);
+    so->unlock(port->lock);
+    free(mon);
+}
+
+void
+data_monitor_drained(struct controller_info *cntlr,
+		     void                   *monitor_id)
+{
+    port_info_t *port;
+    struct port_monitor **monp;
+
+    monp = find_monitor(cntlr, monitor_id, &port);
+    if (!monp)
+	return;
+    (*monp)->gave_up = false;
+    monitor_unblock(port, *monp);
+    so->unlock(port->lock);
 }
 
 void
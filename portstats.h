@@ -0,0 +1,111 @@
+/*
+ *  ser2net - A program for allowing telnet connection to serial ports
+ *  Copyright (C) 2001-2020  Corey Minyard <minyard@acm.org>
+ *
+ *  SPDX-License-Identifier: GPL-2.0-only
+ *
+ *  In addition, as a special exception, the copyright holders of
+ *  ser2net give you permission to combine ser2net with free software
+ *  programs or libraries that are released under the GNU LGPL and
+ *  with code included in the standard release of OpenSSL under the
+ *  OpenSSL license (or modified versions of such code, with unchanged
+ *  license). You may copy and distribute such a system following the
+ *  terms of the GNU GPL for ser2net and the licenses of the other code
+ *  concerned, provided that you include the source code of that
+ *  other code when and as the GNU GPL requires distribution of source
+ *  code.
+ *
+ *  Note that people who make modified versions of ser2net are not
+ *  obligated to grant this special exception for their modified
+ *  versions; it is their choice whether to do so. The GNU General
+ *  Public License gives permission to release a modified version
+ *  without this exception; this exception also makes it possible to
+ *  release a modified version which carries forward this exception.
+ */
+
+/*
+ * Lightweight statistics kept for each port.  These are all updated
+ * with the port lock held, so nothing special is needed to keep them
+ * consistent.
+ */
+
+#ifndef PORTSTATS
+#define PORTSTATS
+
+#include <stdbool.h>
+#include <gensio/gensio.h>
+
+#define PORT_HIST_BUCKETS	32
+
+/*
+ * A log2 histogram.  Bucket n holds values where 2^(n-1) <= v < 2^n,
+ * bucket 0 holds zeros, and the last bucket holds everything too big
+ * for the others.
+ */
+struct port_hist {
+    unsigned long count;
+    unsigned long total;
+    unsigned long max;
+    unsigned long buckets[PORT_HIST_BUCKETS];
+};
+
+static inline void
+port_hist_add(struct port_hist *h, unsigned long val)
+{
+    unsigned int b = 0;
+
+    if (val)
+	b = (sizeof(val) * 8) - __builtin_clzl(val);
+    if (b >= PORT_HIST_BUCKETS)
+	b = PORT_HIST_BUCKETS - 1;
+    h->buckets[b]++;
+    h->count++;
+    h->total += val;
+    if (val > h->max)
+	h->max = val;
+}
+
+struct port_stats {
+    /*
+     * Microseconds from the first byte going into dev_to_net until it
+     * is sent to the network.
+     */
+    struct port_hist dev_to_net_delay;
+
+    /* Bytes in dev_to_net when it is sent. */
+    struct port_hist dev_to_net_size;
+
+    /* Microseconds device reads are held off waiting on the network. */
+    struct port_hist dev_read_stall;
+
+    /* Microseconds network reads are held off waiting on the device. */
+    struct port_hist net_read_stall;
+
+    /* Number of net to dev buffers in use when network data comes in. */
+    struct port_hist net_to_dev_bufs;
+
+    /* Microseconds of chardelay picked by adaptive chardelay. */
+    struct port_hist chardelay;
+
+    unsigned long dev_reads;
+    unsigned long net_reads;
+    unsigned long net_sends;
+    unsigned long dev_read_stalls;
+    unsigned long net_read_stalls;
+    unsigned long chardelay_timeouts;
+    unsigned long sendon_matches;
+    unsigned long partial_dev_writes;
+    unsigned long frames;
+
+    /* Trace bytes dropped from closed trace files. */
+    unsigned long trace_dropped;
+
+    /* Internal state for timing the above. */
+    gensio_time dev_to_net_start;
+    gensio_time dev_read_stall_start;
+    gensio_time net_read_stall_start;
+    bool dev_read_stalled;
+    bool net_read_stalled;
+};
+
+#endif /* PORTSTATS */
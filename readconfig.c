@@ -618,7 +618,7 @@ handle_config_line(char *inbuf, int len)
 	    class[len] = '\0';
 	}
 
-	err = gensio_set_default(so, class, name, str, 0);
+	err = set_config_default(class, name, str);
 	if (err)
 	    syslog(LOG_ERR, "error setting default value on line %d for %s: %s",
 		   lineno, name, strerror(err));
@@ -639,7 +639,7 @@ handle_config_line(char *inbuf, int len)
 	    goto out;
 	}
 
-	err = gensio_del_default(so, class, name, false);
+	err = del_config_default(class, name);
 	if (err)
 	    syslog(LOG_ERR, "error deleting default value on line %d for %s: %s",
 		   lineno, name, strerror(err));
@@ -763,7 +763,7 @@ readconfig_init(void)
     free_longstrs();
     free_tracefiles();
     free_rs485confs();
-    free_leds();
+    retire_leds();
 
     free_rotators();
     return 0;
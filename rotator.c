@@ -33,6 +33,35 @@
 #include "port.h"
 #include "defaults.h"
 
+enum rotator_policy {
+    ROTATOR_ROUND_ROBIN,
+    ROTATOR_LEAST_CONNECTIONS,
+    ROTATOR_NEXT_FREE
+};
+
+#define ROT_MAP_BITS (sizeof(unsigned long) * 8)
+
+/*
+ * A bitmap of the rotator's ports that may have a free connection
+ * slot, a bit is set when a connection on the port goes away and
+ * cleared when the rotator finds the port full.  It is a hint, the
+ * port is always checked before use.  Ports keep a reference to it,
+ * so it has its own lock and refcount and may outlive the rotator.
+ */
+struct rotator_freemap {
+    struct gensio_lock *lock;
+    unsigned int refcount;
+    bool dead;
+    unsigned int nbits;
+    unsigned long bits[];
+};
+
+struct port_rotator_ref {
+    struct rotator_freemap *map;
+    unsigned int idx;
+    struct port_rotator_ref *next;
+};
+
 typedef struct rotator
 {
     /* Rotators use the ports_lock for mutex. */
@@ -40,6 +69,12 @@ typedef struct rotator
     const char **portv;
     int portc;
 
+    enum rotator_policy policy;
+    struct rotator_freemap *freemap;
+    unsigned long *triedmap; /* Scratch for least-connections. */
+    bool ports_attached;
+    unsigned int port_gen;   /* port_index_gen when ports were attached. */
+
     char *name;
     char *accstr;
 
@@ -59,73 +94,300 @@ typedef struct rotator
 
 static rotator_t *rotators = NULL;
 
-/* Returns with the port locked, if non-NULL. */
-static port_info_t *
-find_rotator_port(const char *portname, struct gensio *net,
-		  unsigned int *netconnum)
+static void
+rot_map_set(struct rotator_freemap *m, unsigned int bit)
 {
-    port_info_t *port = ports;
-
-    while (port) {
-	if (strcmp(port->name, portname) == 0) {
-	    unsigned int i;
-	    struct sockaddr_storage addr;
-	    gensiods socklen;
-	    int err;
-
-	    so->lock(port->lock);
-	    if (!port->enabled)
-		goto next;
-	    if (port->dev_to_net_state == PORT_CLOSING)
-		goto next;
-	    err = net_raddr(net, &addr, &socklen);
-	    if (err)
-		goto next;
-	    if (!remaddr_check(port->remaddrs,
-			       (struct sockaddr *) &addr, socklen))
-		goto next;
-	    if (port->net_to_dev_state == PORT_UNCONNECTED &&
-		is_device_already_inuse(port))
-		goto next;
-
-	    for (i = 0; i < port->max_connections; i++) {
-		if (!port->netcons[i].net) {
-		    *netconnum = i;
-		    return port;
-		}
+    m->bits[bit / ROT_MAP_BITS] |= 1UL << (bit % ROT_MAP_BITS);
+}
+
+static void
+rot_map_clear(struct rotator_freemap *m, unsigned int bit)
+{
+    m->bits[bit / ROT_MAP_BITS] &= ~(1UL << (bit % ROT_MAP_BITS));
+}
+
+/* Find the first set bit at or after start, -1 if none. */
+static int
+rot_map_next(unsigned long *bits, unsigned int nbits, unsigned int start)
+{
+    unsigned int w = start / ROT_MAP_BITS;
+    unsigned long v;
+
+    if (start >= nbits)
+	return -1;
+    v = bits[w] & (~0UL << (start % ROT_MAP_BITS));
+    for (;;) {
+	if (v) {
+	    start = w * ROT_MAP_BITS + __builtin_ctzl(v);
+	    return start < nbits ? (int) start : -1;
+	}
+	if (++w >= (nbits + ROT_MAP_BITS - 1) / ROT_MAP_BITS)
+	    return -1;
+	v = bits[w];
+    }
+}
+
+static void
+rot_freemap_put(struct rotator_freemap *m)
+{
+    unsigned int count;
+
+    so->lock(m->lock);
+    count = --m->refcount;
+    so->unlock(m->lock);
+    if (count == 0) {
+	so->free_lock(m->lock);
+	free(m);
+    }
+}
+
+void
+rotator_port_freed(port_info_t *port)
+{
+    struct port_rotator_ref *ref;
+
+    for (ref = port->rotator_refs; ref; ref = ref->next) {
+	so->lock(ref->map->lock);
+	if (!ref->map->dead)
+	    rot_map_set(ref->map, ref->idx);
+	so->unlock(ref->map->lock);
+    }
+}
+
+void
+free_port_rotator_refs(port_info_t *port)
+{
+    struct port_rotator_ref *ref;
+
+    while (port->rotator_refs) {
+	ref = port->rotator_refs;
+	port->rotator_refs = ref->next;
+	rot_freemap_put(ref->map);
+	free(ref);
+    }
+}
+
+/*
+ * Tell the rotator's ports about the rotator so they can report free
+ * slots.  Redone whenever the ports change.  Must be called with
+ * ports_lock held.
+ */
+static void
+rot_attach_ports(rotator_t *rot)
+{
+    struct rotator_freemap *m = rot->freemap;
+    struct port_rotator_ref *ref, **prev;
+    port_info_t *port;
+    unsigned int i;
+    bool found;
+
+    for (i = 0; i < (unsigned int) rot->portc; i++) {
+	port = port_index_find(rot->portv[i]);
+	if (!port)
+	    continue;
+
+	so->lock(port->lock);
+	found = false;
+	prev = &port->rotator_refs;
+	while (*prev) {
+	    ref = *prev;
+	    so->lock(ref->map->lock);
+	    if (ref->map->dead) {
+		so->unlock(ref->map->lock);
+		*prev = ref->next;
+		rot_freemap_put(ref->map);
+		free(ref);
+		continue;
 	    }
-	next:
-	    so->unlock(port->lock);
+	    so->unlock(ref->map->lock);
+	    if (ref->map == m && ref->idx == i)
+		found = true;
+	    prev = &ref->next;
+	}
+	if (!found) {
+	    ref = malloc(sizeof(*ref));
+	    if (!ref) {
+		so->unlock(port->lock);
+		syslog(LOG_ERR, "Out of memory attaching rotator %s",
+		       rot->name);
+		return;
+	    }
+	    so->lock(m->lock);
+	    m->refcount++;
+	    so->unlock(m->lock);
+	    ref->map = m;
+	    ref->idx = i;
+	    ref->next = port->rotator_refs;
+	    port->rotator_refs = ref;
 	}
-	port = port->next;
+	so->unlock(port->lock);
     }
 
+    /* We don't know the port states, so check them all. */
+    so->lock(m->lock);
+    memset(m->bits, 0xff,
+	   ((m->nbits + ROT_MAP_BITS - 1) / ROT_MAP_BITS) * sizeof(m->bits[0]));
+    so->unlock(m->lock);
+
+    rot->ports_attached = true;
+    rot->port_gen = port_index_gen;
+}
+
+/*
+ * Returns with the port locked, if non-NULL.  Must be called with
+ * ports_lock held.
+ */
+static port_info_t *
+find_rotator_port(rotator_t *rot, unsigned int idx, struct gensio *net,
+		  net_info_t **rnetcon)
+{
+    port_info_t *port = port_index_find(rot->portv[idx]);
+    net_info_t *netcon;
+    struct sockaddr_storage addr;
+    gensiods socklen;
+    int err;
+
+    if (!port)
+	return NULL;
+
+    so->lock(port->lock);
+    if (!port->enabled)
+	goto out_unlock;
+    if (port->dev_to_net_state == PORT_CLOSING)
+	goto out_unlock;
+    if (port->net_count >= port->max_connections)
+	goto out_full;
+    err = net_raddr(net, &addr, &socklen);
+    if (err)
+	goto out_unlock;
+    if (!remaddr_check(port->remaddrs,
+		       (struct sockaddr *) &addr, socklen))
+	goto out_unlock;
+    if (port->net_to_dev_state == PORT_UNCONNECTED &&
+	is_device_already_inuse(port))
+	goto out_unlock;
+
+    netcon = first_free_netcon(port);
+    if (netcon) {
+	*rnetcon = netcon;
+	return port;
+    }
+ out_full:
+    /*
+     * Cleared with the port lock held, so a connection going away
+     * can't race with this and leave the bit clear.
+     */
+    so->lock(rot->freemap->lock);
+    rot_map_clear(rot->freemap, idx);
+    so->unlock(rot->freemap->lock);
+ out_unlock:
+    so->unlock(port->lock);
     return NULL;
 }
 
+/*
+ * Pick the next port to try.  Returns -1 when there are no more
+ * ports, "tried" is the number of ports tried so far and "pos" is
+ * the last port tried.  Must be called with ports_lock held.
+ */
+static int
+rot_next_port(rotator_t *rot, int tried, int pos)
+{
+    struct rotator_freemap *m = rot->freemap;
+    unsigned int i, load, best_load = 0;
+    int best = -1, idx;
+    port_info_t *port;
+
+    switch (rot->policy) {
+    case ROTATOR_ROUND_ROBIN:
+	if (tried >= rot->portc)
+	    return -1;
+	return (rot->curr_port + tried) % rot->portc;
+
+    case ROTATOR_NEXT_FREE:
+	/*
+	 * Walk the set bits from curr_port to the end, then wrap to
+	 * the beginning up to curr_port.
+	 */
+	so->lock(m->lock);
+	if (tried == 0 || pos >= rot->curr_port) {
+	    idx = rot_map_next(m->bits, m->nbits,
+			       tried == 0 ? rot->curr_port : pos + 1);
+	    if (idx < 0 && rot->curr_port > 0)
+		idx = rot_map_next(m->bits, rot->curr_port, 0);
+	} else {
+	    idx = rot_map_next(m->bits, rot->curr_port, pos + 1);
+	}
+	so->unlock(m->lock);
+	return idx;
+
+    case ROTATOR_LEAST_CONNECTIONS:
+	/*
+	 * Choose the untried port with the fewest connections, ties
+	 * go to the port that comes first from curr_port.  The counts
+	 * are read without the port locks, they are only a guide and
+	 * the chosen port is checked with its lock held.
+	 */
+	if (tried == 0)
+	    memset(rot->triedmap, 0,
+		   ((rot->portc + ROT_MAP_BITS - 1) / ROT_MAP_BITS)
+		   * sizeof(rot->triedmap[0]));
+	else
+	    rot->triedmap[pos / ROT_MAP_BITS] |= 1UL << (pos % ROT_MAP_BITS);
+	for (i = 0; i < (unsigned int) rot->portc; i++) {
+	    idx = (rot->curr_port + i) % rot->portc;
+	    if (rot->triedmap[idx / ROT_MAP_BITS] &
+			(1UL << (idx % ROT_MAP_BITS)))
+		continue;
+	    port = port_index_find(rot->portv[idx]);
+	    if (!port)
+		continue;
+	    load = port->net_count;
+	    if (load >= port->max_connections)
+		continue;
+	    if (best < 0 || load < best_load) {
+		best = idx;
+		best_load = load;
+		if (load == 0)
+		    break;
+	    }
+	}
+	return best;
+    }
+
+    return -1;
+}
+
 /* A connection request has come in on a port. */
 static int
 rot_new_con(rotator_t *rot, struct gensio *net)
 {
-    int i;
+    int i, tried = 0;
     const char *err;
 
     so->lock(ports_lock);
-    i = rot->curr_port;
-    do {
-	unsigned int netconnum = 0;
-	port_info_t *port = find_rotator_port(rot->portv[i], net, &netconnum);
+    if (!rot->ports_attached || rot->port_gen != port_index_gen)
+	rot_attach_ports(rot);
+    for (i = rot_next_port(rot, 0, 0); i >= 0;
+	 i = rot_next_port(rot, ++tried, i)) {
+	net_info_t *netcon = NULL;
+	port_info_t *port = find_rotator_port(rot, i, net, &netcon);
 
-	if (++i >= rot->portc)
-	    i = 0;
 	if (port) {
+	    if (++i >= rot->portc)
+		i = 0;
 	    rot->curr_port = i;
 	    so->unlock(ports_lock);
-	    handle_new_net(port, net, &port->netcons[netconnum]);
+	    /*
+	     * The net stays on the main os funcs, gensio can't move it
+	     * to the port's worker.  Everything it does takes the port
+	     * lock, so this is safe, just not on the worker's thread.
+	     */
+	    handle_new_net(port, net, netcon);
 	    so->unlock(port->lock);
 	    return 0;
 	}
-    } while (i != rot->curr_port);
+    }
     so->unlock(ports_lock);
 
     err = "No free port found\r\n";
@@ -204,6 +466,14 @@ free_rotator(rotator_t *rot)
 	free(rot->accstr);
     if (rot->portv)
 	gensio_argv_free(so, rot->portv);
+    if (rot->freemap) {
+	so->lock(rot->freemap->lock);
+	rot->freemap->dead = true;
+	so->unlock(rot->freemap->lock);
+	rot_freemap_put(rot->freemap);
+    }
+    if (rot->triedmap)
+	free(rot->triedmap);
     if (rot->restart_timer)
 	so->free_timer(rot->restart_timer);
     free(rot);
@@ -259,6 +529,7 @@ add_rotator(struct absout *eout, const char *name, const char *accstr,
 	    int portc, const char **ports, const char **options, int lineno)
 {
     rotator_t *rot;
+    unsigned int words;
     int rv;
 
     rot = malloc(sizeof(*rot));
@@ -308,6 +579,20 @@ add_rotator(struct absout *eout, const char *name, const char *accstr,
 		if (rot->accepter_retry_time < 1)
 		    rot->accepter_retry_time = 1;
 		continue;
+	    } else if (gensio_check_keyvalue(options[i], "policy", &str) > 0) {
+		if (strcmp(str, "round-robin") == 0) {
+		    rot->policy = ROTATOR_ROUND_ROBIN;
+		} else if (strcmp(str, "least-connections") == 0) {
+		    rot->policy = ROTATOR_LEAST_CONNECTIONS;
+		} else if (strcmp(str, "next-free") == 0) {
+		    rot->policy = ROTATOR_NEXT_FREE;
+		} else {
+		    eout->out(eout, "Invalid rotator policy %s on line %d\n",
+			      str, lineno);
+		    rv = EINVAL;
+		    goto out_err;
+		}
+		continue;
 	    }
 	    free_rotator(rot);
 	    eout->out(eout, "Invalid option %s for rotator on line %d\n",
@@ -322,6 +607,26 @@ add_rotator(struct absout *eout, const char *name, const char *accstr,
 	goto out_nomem;
     }
 
+    words = (portc + ROT_MAP_BITS - 1) / ROT_MAP_BITS;
+    if (words == 0)
+	words = 1;
+    rot->freemap = malloc(sizeof(*rot->freemap) +
+			  words * sizeof(rot->freemap->bits[0]));
+    if (!rot->freemap)
+	goto out_nomem;
+    memset(rot->freemap, 0, sizeof(*rot->freemap));
+    rot->freemap->refcount = 1;
+    rot->freemap->nbits = portc;
+    rot->freemap->lock = so->alloc_lock(so);
+    if (!rot->freemap->lock) {
+	free(rot->freemap);
+	rot->freemap = NULL;
+	goto out_nomem;
+    }
+    rot->triedmap = calloc(words, sizeof(*rot->triedmap));
+    if (!rot->triedmap)
+	goto out_nomem;
+
     rot->portc = portc;
     rot->portv = ports;
 
@@ -26,6 +26,9 @@
 /* This is the entry point for the ser2net program.  It reads
    parameters, initializes everything, then starts the select loop. */
 
+#ifdef linux
+#define _GNU_SOURCE /* For pthread_setaffinity_np(). */
+#endif
 #include <stdio.h>
 #include <signal.h>
 #include <stdlib.h>
@@ -42,6 +45,7 @@
 #include "controller.h"
 #include "dataxfer.h"
 #include "led.h"
+#include "metrics.h"
 
 static char *config_file = SYSCONFDIR "/ser2net/ser2net.yaml";
 static bool config_file_set = false;
@@ -60,6 +64,25 @@ struct thread_info {
     pthread_t id;
 };
 struct thread_info *threads;
+
+/*
+ * Port workers.  If there are any, each port is given to one of them
+ * when it is configured, and the port's device, accepter, connections
+ * and timers all run on that worker's selector.  So a port's
+ * callbacks always run on the same thread, and ports on different
+ * workers don't fight over locks or cache lines.  Ports only move
+ * between workers when the config is reread.
+ */
+struct port_worker {
+    pthread_t id;
+    struct selector_s *sel;
+    struct gensio_os_funcs *o;
+    int cpu;				/* -1 if not pinned to a CPU. */
+};
+static struct port_worker *workers;
+static unsigned int num_workers;
+static unsigned int next_worker;
+static char *worker_cpus;
 #endif
 
 
@@ -83,6 +106,11 @@ static char *help_string =
 "  -u - Disable UUCP locking\n"
 #ifdef USE_PTHREADS
 "  -t <num threads> - Use the given number of threads, default 1\n"
+"  -w <num workers> - Spread the ports across this many worker threads,\n"
+"     each with its own selector, default 0 (no workers)\n"
+"  -a <cpu list> - Pin the worker threads to the given comma separated\n"
+"     CPUs, in order, wrapping around if there are more workers than CPUs,\n"
+"     Linux only\n"
 #endif
 "  -b - unused (was Do CISCO IOS baud-rate negotiation, instead of RFC2217)\n"
 "  -v - print the program's version and exit\n"
@@ -221,6 +249,7 @@ reread_config_file(const char *reqtype, struct absout *eout)
 
 	if (!admin_port_from_cmdline)
 	    controller_shutdown();
+	metrics_shutdown();
 	if (is_yaml)
 	    rv = yaml_readconfig(instream, config_lines, num_config_lines,
 				 eout);
@@ -264,28 +293,62 @@ add_usec_to_time(gensio_time *tv, int usec)
 #endif
 }
 
+void
+add_sec_to_time(gensio_time *tv, unsigned int sec)
+{
+#ifdef gensio_version_major
+    tv->secs += sec;
+#else
+    tv->tv_sec += sec;
+#endif
+}
+
+void
+diff_time(gensio_time *dest, gensio_time *left, gensio_time *right)
+{
+#ifdef gensio_version_major
+    dest->secs = left->secs - right->secs;
+    dest->nsecs = left->nsecs - right->nsecs;
+    while (dest->nsecs < 0) {
+	dest->nsecs += 1000000000;
+	dest->secs--;
+    }
+#else
+    dest->tv_sec = left->tv_sec - right->tv_sec;
+    dest->tv_usec = left->tv_usec - right->tv_usec;
+    while (dest->tv_usec < 0) {
+	dest->tv_usec += 1000000;
+	dest->tv_sec--;
+    }
+#endif
+}
+
+int
+cmp_time(gensio_time *left, gensio_time *right)
+{
+#ifdef gensio_version_major
+    if (left->secs != right->secs)
+	return left->secs < right->secs ? -1 : 1;
+    if (left->nsecs != right->nsecs)
+	return left->nsecs < right->nsecs ? -1 : 1;
+#else
+    if (left->tv_sec != right->tv_sec)
+	return left->tv_sec < right->tv_sec ? -1 : 1;
+    if (left->tv_usec != right->tv_usec)
+	return left->tv_usec < right->tv_usec ? -1 : 1;
+#endif
+    return 0;
+}
+
 int
 sub_time(gensio_time *left, gensio_time *right)
 {
     gensio_time dest;
 
+    diff_time(&dest, left, right);
 #ifdef gensio_version_major
-    dest.secs = left->secs - right->secs;
-    dest.nsecs = left->nsecs - right->nsecs;
-    while (dest.nsecs < 0) {
-	dest.nsecs += 1000000000;
-	dest.secs--;
-    }
-
     return (dest.secs * 1000000) + (dest.nsecs + 500) / 1000;
 #else
-    dest.tv_sec = left->tv_sec - right->tv_sec;
-    dest.tv_usec = left->tv_usec - right->tv_usec;
-    while (dest.tv_usec < 0) {
-	dest.tv_usec += 1000000;
-	dest.tv_sec--;
-    }
-
     return (dest.tv_sec * 1000000) + dest.tv_usec;
 #endif
 }
@@ -563,8 +626,212 @@ slock_unlock(sel_lock_t *l)
     pthread_mutex_unlock(&l->lock);
 }
 
+static void *
+worker_loop(void *data)
+{
+    struct port_worker *w = data;
+    pthread_t self = pthread_self();
+
+#ifdef linux
+    if (w->cpu >= 0) {
+	cpu_set_t set;
+	int rv;
+
+	CPU_ZERO(&set);
+	CPU_SET(w->cpu, &set);
+	rv = pthread_setaffinity_np(self, sizeof(set), &set);
+	if (rv)
+	    syslog(LOG_ERR, "Unable to pin worker to CPU %d: %s", w->cpu,
+		   strerror(rv));
+    }
+#endif
+
+    /*
+     * Ports are still shut down after in_shutdown is set, so keep
+     * going, the process exits when that is done.
+     */
+    for (;;)
+	sel_select(w->sel, wake_thread_send_sig, (long) &self, NULL, NULL);
+    return NULL;
+}
+
+/*
+ * Allocate the worker selectors.  This is done before the config is
+ * read, the threads are started after we detach.
+ */
+static void
+alloc_workers(void)
+{
+    unsigned int i;
+    char *s, *end;
+    int err;
+
+    if (!num_workers)
+	return;
+
+    workers = calloc(num_workers, sizeof(*workers));
+    if (!workers) {
+	fprintf(stderr, "Unable to allocate worker info\n");
+	exit(1);
+    }
+
+    s = worker_cpus;
+    for (i = 0; i < num_workers; i++) {
+	struct port_worker *w = &workers[i];
+
+	w->cpu = -1;
+	if (s) {
+	    w->cpu = strtoul(s, &end, 10);
+	    if (end == s || (*end != ',' && *end != '\0')) {
+		fprintf(stderr, "Invalid CPU list: %s\n", worker_cpus);
+		exit(1);
+	    }
+	    s = end + 1;
+	    if (*end == '\0')
+		s = worker_cpus;
+	}
+
+	err = sel_alloc_selector_thread(&w->sel, ser2net_wake_sig,
+					slock_alloc, slock_free,
+					slock_lock, slock_unlock, NULL);
+	if (err) {
+	    fprintf(stderr, "Could not initialize worker selector: '%s'\n",
+		    strerror(err));
+	    exit(1);
+	}
+	w->o = gensio_selector_alloc(w->sel, ser2net_wake_sig);
+	if (!w->o) {
+	    fprintf(stderr, "Could not alloc worker gensio selector\n");
+	    exit(1);
+	}
+	w->o->vlog = so->vlog;
+    }
+}
+
+static void
+start_workers(void)
+{
+    unsigned int i;
+    int rv;
+
+    for (i = 0; i < num_workers; i++) {
+	rv = pthread_create(&workers[i].id, NULL, worker_loop, &workers[i]);
+	if (rv) {
+	    syslog(LOG_ERR, "Unable to start worker thread: %s",
+		   strerror(rv));
+	    exit(1);
+	}
+	pthread_detach(workers[i].id);
+    }
+}
+
+/*
+ * The job pool.  Jobs only run when there is something to do at
+ * startup or a reconfig, so a few threads is plenty.
+ */
+#define JOB_POOL_THREADS 4
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_done_cond = PTHREAD_COND_INITIALIZER;
+static struct gensio_list jobs;
+
+static void *
+job_loop(void *data)
+{
+    struct ser2net_job *job;
+
+    pthread_mutex_lock(&job_lock);
+    for (;;) {
+	while (gensio_list_empty(&jobs))
+	    pthread_cond_wait(&job_cond, &job_lock);
+	job = gensio_container_of(gensio_list_first(&jobs),
+				  struct ser2net_job, link);
+	gensio_list_rm(&jobs, &job->link);
+	job->queued = false;
+	job->running = true;
+	pthread_mutex_unlock(&job_lock);
+
+	job->func(job);
+
+	pthread_mutex_lock(&job_lock);
+	job->running = false;
+	pthread_cond_broadcast(&job_done_cond);
+    }
+    return NULL;
+}
+
+void
+ser2net_job_queue(struct ser2net_job *job)
+{
+    pthread_mutex_lock(&job_lock);
+    if (!job->queued) {
+	job->queued = true;
+	gensio_list_add_tail(&jobs, &job->link);
+	pthread_cond_signal(&job_cond);
+    }
+    pthread_mutex_unlock(&job_lock);
+}
+
+void
+ser2net_job_cancel(struct ser2net_job *job)
+{
+    pthread_mutex_lock(&job_lock);
+    if (job->queued) {
+	gensio_list_rm(&jobs, &job->link);
+	job->queued = false;
+    }
+    while (job->running)
+	pthread_cond_wait(&job_done_cond, &job_lock);
+    pthread_mutex_unlock(&job_lock);
+}
+
+static void
+init_job_pool(void)
+{
+    gensio_list_init(&jobs);
+}
+
+static void
+start_job_pool(void)
+{
+    pthread_t id;
+    unsigned int i;
+    int rv;
+
+    for (i = 0; i < JOB_POOL_THREADS; i++) {
+	rv = pthread_create(&id, NULL, job_loop, NULL);
+	if (rv) {
+	    syslog(LOG_ERR, "Unable to start job thread: %s", strerror(rv));
+	    exit(1);
+	}
+	pthread_detach(id);
+    }
+}
+
+struct gensio_os_funcs *
+port_os_funcs(void)
+{
+    struct gensio_os_funcs *o;
+
+    if (!num_workers)
+	return so;
+
+    so->lock(config_lock);
+    o = workers[next_worker].o;
+    next_worker = (next_worker + 1) % num_workers;
+    so->unlock(config_lock);
+    return o;
+}
+
 #else
 int ser2net_wake_sig = 0;
+struct gensio_os_funcs *port_os_funcs(void) { return so; }
+static void alloc_workers(void) { }
+static void start_workers(void) { }
+static void init_job_pool(void) { }
+static void start_job_pool(void) { }
+void ser2net_job_queue(struct ser2net_job *job) { job->func(job); }
+void ser2net_job_cancel(struct ser2net_job *job) { }
 void start_maint_op(void) { }
 void end_maint_op(void) { }
 static void start_threads(void) { }
@@ -589,6 +856,7 @@ finish_shutdown_cleanly(void)
     sel_clear_fd_handlers(ser2net_sel, sig_fd_watch);
     free_rotators();
     free_controllers();
+    free_metrics();
     shutdown_ports();
     do {
 	if (check_ports_shutdown())
@@ -863,6 +1131,34 @@ main(int argc, char *argv[])
 		exit(1);
 	    }
             break;
+
+	case 'w':
+            i++;
+            if (i == argc) {
+	        fprintf(stderr, "No worker count specified\n");
+		exit(1);
+            }
+	    num_workers = strtoul(argv[i], &end, 10);
+	    if (end == argv[i] || *end != '\0') {
+	        fprintf(stderr, "Invalid worker count specified: %s\n",
+			argv[i]);
+		exit(1);
+	    }
+            break;
+
+	case 'a':
+            i++;
+            if (i == argc) {
+	        fprintf(stderr, "No CPU list specified\n");
+		exit(1);
+            }
+#ifdef linux
+	    worker_cpus = argv[i];
+#else
+	    fprintf(stderr, "CPU pinning with -a is only supported on Linux\n");
+	    exit(1);
+#endif
+            break;
 #endif
 
 	default:
@@ -872,7 +1168,7 @@ main(int argc, char *argv[])
     }
 
 #ifdef USE_PTHREADS
-    if (num_threads > 1)
+    if (num_threads > 1 || num_workers)
 	err = sel_alloc_selector_thread(&ser2net_sel, ser2net_wake_sig,
 					slock_alloc, slock_free,
 					slock_lock, slock_unlock, NULL);
@@ -906,6 +1202,9 @@ main(int argc, char *argv[])
 	exit(1);
     }
 
+    init_job_pool();
+    alloc_workers();
+
     setup_signals();
 
     err = init_dataxfer();
@@ -1015,6 +1314,8 @@ main(int argc, char *argv[])
     make_pidfile();
 
     start_threads();
+    start_workers();
+    start_job_pool();
 
     if (print_when_ready) {
 	printf("Ready\n");
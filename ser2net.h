@@ -37,11 +37,37 @@ extern char *rfc2217_signature;
 
 extern struct gensio_os_funcs *so;
 
+/*
+ * The os funcs a new port should run on.  This is so unless there
+ * are port workers, then the workers are handed out round robin.
+ */
+struct gensio_os_funcs *port_os_funcs(void);
+
 extern int ser2net_debug;
 extern int ser2net_debug_level;
 
 extern int ser2net_wake_sig;
 
+/*
+ * Slow blocking work, like walking sysfs, that shouldn't hold up the
+ * selectors.  Jobs are run by a pool of threads.  Jobs queued before
+ * the pool is started (the config is applied before we detach) wait
+ * for it.  Without threads the job is run immediately.
+ */
+struct ser2net_job {
+    void (*func)(struct ser2net_job *job);
+    struct gensio_link link;
+    bool queued;
+    bool running;
+};
+/* Does nothing if the job is already queued. */
+void ser2net_job_queue(struct ser2net_job *job);
+/*
+ * Remove the job if it's queued, or wait for it to finish if it's
+ * running.  The job's func must not claim locks the caller holds.
+ */
+void ser2net_job_cancel(struct ser2net_job *job);
+
 void start_maint_op(void);
 void end_maint_op(void);
 int reread_config_file(const char *reqtype, struct absout *eout);
@@ -56,6 +82,11 @@ void write_ignore_fail(int fd, const char *data, size_t count);
 typedef struct timeval gensio_time;
 #endif
 void add_usec_to_time(gensio_time *tv, int usec);
+void add_sec_to_time(gensio_time *tv, unsigned int sec);
+/* dest = left - right */
+void diff_time(gensio_time *dest, gensio_time *left, gensio_time *right);
+/* Returns <0, 0, or >0 like strcmp. */
+int cmp_time(gensio_time *left, gensio_time *right);
 int sub_time(gensio_time *left, gensio_time *right);
 
 /* Scan for a positive integer, and return it.  Return -1 if the
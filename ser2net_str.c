@@ -24,6 +24,7 @@
  */
 
 #include <time.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
@@ -71,11 +72,23 @@ static char *smonths[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
 			   "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
 static char *sdays[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
 
+/*
+ * Escapes whose value changes between uses of a string, everything
+ * else only depends on the port configuration.
+ */
+static const char dynamic_escapes[] = "BYyMmADHhiSqPTeUI";
+
+/*
+ * If fieldop is not NULL, the dynamic escapes are passed to it
+ * instead of being expanded.
+ */
 static void
 process_str(port_info_t *port, net_info_t *netcon,
 	    struct tm *time, struct timeval *tv,
 	    const char *s,
-	    void (*op)(void *data, char val), void *data, int isfilename)
+	    void (*op)(void *data, char val),
+	    void (*fieldop)(void *data, char code),
+	    void *data, int isfilename)
 {
     char val;
     char *t, *s2;
@@ -85,6 +98,11 @@ process_str(port_info_t *port, net_info_t *netcon,
 	    s++;
 	    if (!*s)
 		return;
+	    if (fieldop && strchr(dynamic_escapes, *s)) {
+		fieldop(data, *s);
+		s++;
+		continue;
+	    }
 	    switch (*s) {
 	    /* Standard "C" characters. */
 	    case 'a': op(data, 7); break;
@@ -409,7 +427,8 @@ process_str_to_str(port_info_t *port, net_info_t *netcon,
     struct bufop_data bufop;
 
     localtime_r(&tv->tv_sec, &now);
-    process_str(port, netcon, &now, tv, str, count_op, &len, isfilename);
+    process_str(port, netcon, &now, tv, str, count_op, NULL, &len,
+		isfilename);
     if (!lenrv)
 	/* If we don't return a length, append a nil char. */
 	len++;
@@ -422,7 +441,8 @@ process_str_to_str(port_info_t *port, net_info_t *netcon,
 	syslog(LOG_ERR, "Out of memory processing string: %s", port->name);
 	return NULL;
     }
-    process_str(port, netcon, &now, tv, str, buffer_op, &bufop, isfilename);
+    process_str(port, netcon, &now, tv, str, buffer_op, NULL, &bufop,
+		isfilename);
     bufop.str[len] = '\0';
 
     if (lenrv)
@@ -433,33 +453,200 @@ process_str_to_str(port_info_t *port, net_info_t *netcon,
     return bufop.str;
 }
 
+/*
+ * A string compiled for repeated expansion.  The parts are literal
+ * text, with everything that only depends on the port already
+ * expanded, and dynamic escapes that are expanded on each use.  If
+ * there are no dynamic escapes the expanded string is shared by all
+ * users.
+ */
+#define TMPL_FIELD_MAX 128	/* Max expanded size of a dynamic escape. */
+
+struct str_tpart {
+    gensiods start;		/* Offset in lit for literal parts. */
+    gensiods len;		/* 0 for a dynamic escape. */
+    char code;			/* The dynamic escape character. */
+};
+
+struct str_template {
+    unsigned char *lit;
+    gensiods litlen;
+    gensiods litsize;
+    unsigned int nfields;
+    bool has_time;
+    bool failed;
+    struct str_tpart *parts;
+    unsigned int nparts;
+    unsigned int partsize;
+};
+
+static struct str_tpart *
+tmpl_new_part(struct str_template *t)
+{
+    struct str_tpart *p;
+
+    if (t->nparts == t->partsize) {
+	unsigned int nsize = t->partsize ? t->partsize * 2 : 4;
+
+	p = realloc(t->parts, nsize * sizeof(*p));
+	if (!p) {
+	    t->failed = true;
+	    return NULL;
+	}
+	t->parts = p;
+	t->partsize = nsize;
+    }
+    p = &t->parts[t->nparts++];
+    memset(p, 0, sizeof(*p));
+    return p;
+}
+
+static void
+tmpl_lit_op(void *data, char c)
+{
+    struct str_template *t = data;
+    struct str_tpart *p = NULL;
+
+    if (t->failed)
+	return;
+    if (t->litlen == t->litsize) {
+	gensiods nsize = t->litsize ? t->litsize * 2 : 64;
+	unsigned char *n = realloc(t->lit, nsize);
+
+	if (!n) {
+	    t->failed = true;
+	    return;
+	}
+	t->lit = n;
+	t->litsize = nsize;
+    }
+    t->lit[t->litlen++] = c;
+
+    if (t->nparts)
+	p = &t->parts[t->nparts - 1];
+    if (!p || p->len == 0) {
+	p = tmpl_new_part(t);
+	if (!p)
+	    return;
+	p->start = t->litlen - 1;
+    }
+    p->len++;
+}
+
+static void
+tmpl_field_op(void *data, char code)
+{
+    struct str_template *t = data;
+    struct str_tpart *p;
+
+    if (t->failed)
+	return;
+    p = tmpl_new_part(t);
+    if (!p)
+	return;
+    p->code = code;
+    t->nfields++;
+    if (code != 'B' && code != 'I')
+	t->has_time = true;
+}
+
+void
+str_template_free(struct str_template *t)
+{
+    if (!t)
+	return;
+    if (t->lit)
+	free(t->lit);
+    if (t->parts)
+	free(t->parts);
+    free(t);
+}
+
+int
+str_template_compile(port_info_t *port, const char *str,
+		     struct str_template **rtmpl)
+{
+    struct str_template *t;
+
+    *rtmpl = NULL;
+    if (!str || *str == '\0')
+	return 0;
+
+    t = malloc(sizeof(*t));
+    if (!t)
+	return ENOMEM;
+    memset(t, 0, sizeof(*t));
+    process_str(port, NULL, NULL, NULL, str, tmpl_lit_op, tmpl_field_op, t, 0);
+    if (t->failed) {
+	str_template_free(t);
+	return ENOMEM;
+    }
+    *rtmpl = t;
+    return 0;
+}
+
+struct field_data {
+    unsigned char *buf;
+    gensiods pos;
+};
+
+static void
+field_op(void *data, char c)
+{
+    struct field_data *f = data;
+
+    if (f->pos < TMPL_FIELD_MAX)
+	f->buf[f->pos++] = c;
+}
+
+/*
+ * Expand a compiled string into a gbuf.  Returns NULL if the string
+ * is empty or on an error.
+ */
 struct gbuf *
-process_str_to_buf(port_info_t *port, net_info_t *netcon, const char *str)
+str_template_render(port_info_t *port, net_info_t *netcon,
+		    struct str_template *t)
 {
-    char *bstr;
     struct gbuf *buf;
-    gensiods len;
     struct timeval tv;
+    struct tm now;
+    struct field_data f;
+    char esc[3] = { '\\', 0, 0 };
+    unsigned int i;
 
-    if (!str || *str == '\0')
+    if (!t)
 	return NULL;
-    gettimeofday(&tv, NULL);
 
-    buf = malloc(sizeof(*buf));
+    if (t->nfields == 0)
+	buf = gbuf_alloc_ref(t->lit, t->litlen);
+    else
+	buf = gbuf_alloc(t->litlen + t->nfields * TMPL_FIELD_MAX);
     if (!buf) {
 	syslog(LOG_ERR, "Out of memory processing string: %s", port->name);
 	return NULL;
     }
-    bstr = process_str_to_str(port, netcon, str, &tv, &len, 0);
-    if (!bstr) {
-	free(buf);
-	syslog(LOG_ERR, "Error processing string: %s", port->name);
-	return NULL;
+    if (t->nfields == 0)
+	return buf;
+
+    if (t->has_time) {
+	gettimeofday(&tv, NULL);
+	localtime_r(&tv.tv_sec, &now);
+    }
+
+    for (i = 0; i < t->nparts; i++) {
+	struct str_tpart *p = &t->parts[i];
+
+	if (p->len) {
+	    memcpy(buf->buf + buf->cursize, t->lit + p->start, p->len);
+	    buf->cursize += p->len;
+	    continue;
+	}
+	esc[1] = p->code;
+	f.buf = buf->buf + buf->cursize;
+	f.pos = 0;
+	process_str(port, netcon, &now, &tv, esc, field_op, NULL, &f, 0);
+	buf->cursize += f.pos;
     }
-    buf->buf = (unsigned char *) bstr;
-    buf->maxsize = len;
-    buf->pos = 0;
-    buf->cursize = len;
 
     return buf;
 }
@@ -0,0 +1,337 @@
+#!/usr/bin/python3
+#
+# ser2net benchmark harness
+#
+# This runs ser2net over a matrix of network protocols, device types,
+# chardelay settings, connection counts and thread counts and reports
+# throughput, device to network latency, connection accept rate and
+# ser2net CPU use.  Each result is printed as a single JSON object on
+# its own line so the output can be fed straight to other tools;
+# progress information goes to stderr.
+#
+# Run it with "make bench" in the build directory, extra arguments can
+# be passed in BENCH_ARGS, like:
+#
+#   make bench BENCH_ARGS="--protocols tcp,ssl --threads 1 --quick"
+#
+
+import os
+import sys
+import time
+import json
+import argparse
+import gensio
+import utils
+
+o = utils.o
+
+netport = 3023
+
+# Accepter string given to ser2net and connector string used by the
+# benchmark for each protocol.  %d is replaced by the port number.
+protocols = {
+    "tcp": ("tcp,%d", "tcp,localhost,%d"),
+    "udp": ("udp,%d", "udp,localhost,%d"),
+    "telnet": ("telnet,tcp,%d", "telnet,tcp,localhost,%d"),
+    "ssl": ("ssl(key=%s/key.pem,cert=%s/cert.pem),tcp,%%d"
+                % (utils.keydir, utils.keydir),
+            "ssl(CA=%s/CA.pem),tcp,localhost,%%d" % utils.keydir),
+}
+
+# Connector string given to ser2net and, for the serialsim pipe, the
+# gensio used by the benchmark for the other end of the device.  %s is
+# replaced by the serial parameters.  Devices without a far end echo
+# whatever is written to them, so the first network connection is the
+# data source and the measurement is a full round trip.
+devices = {
+    "pipe": ("serialdev,/dev/ttyPipeA0,%s", "serialdev,/dev/ttyPipeB0,%s"),
+    "echo": ("echo", None),
+    "pty": ("pty(raw),/bin/cat", None),
+}
+
+# ser2net option lines for each chardelay setting.
+chardelays = {
+    "off": ("chardelay: false",),
+    "on": ("chardelay: true",),
+    "adaptive": ("chardelay: true", "chardelay-adaptive: true"),
+}
+
+def log(s):
+    sys.stderr.write(s + "\n")
+    sys.stderr.flush()
+    return
+
+def waitms(ms):
+    gensio.waiter(o).wait_timeout(1, ms)
+    return
+
+def percentile(vals, pct):
+    """Nearest-rank percentile of a list of numbers"""
+    if not vals:
+        return None
+    vals = sorted(vals)
+    idx = int((pct * len(vals) + 99) / 100) - 1
+    if idx < 0:
+        idx = 0
+    return vals[idx]
+
+def cpu_seconds(pid):
+    """Return the user+system CPU time used by a process so far"""
+    with open("/proc/%d/stat" % pid) as f:
+        stat = f.read()
+    # The command name may have spaces, so skip past it.
+    fields = stat[stat.rfind(")") + 2:].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+
+def make_config(proto, dev, serparms, chardelay, nconns):
+    config = ["connection: &bench",
+              "  accepter: " + (protocols[proto][0] % netport),
+              "  connector: " + (devices[dev][0].replace("%s", serparms)),
+              "  options:",
+              "    max-connections: %d" % nconns]
+    for i in chardelays[chardelay]:
+        config.append("    " + i)
+    return config
+
+def close_all(conns):
+    for io in conns:
+        try:
+            utils.io_close(io)
+        except Exception:
+            pass
+    return
+
+def prime_udp(conns, devio):
+    """Make ser2net learn the address of each UDP client
+
+    ser2net does not know about a UDP client until it has received
+    something from it, so send a byte from each and throw away
+    whatever comes back.
+    """
+    for io in conns:
+        io.handler.ignore_input = True
+        io.read_cb_enable(True)
+        io.handler.set_write_data("A")
+        if io.handler.wait_timeout(1000) == 0:
+            raise Exception("%s: Timed out priming UDP" % io.handler.name)
+        if devio:
+            devio.handler.set_compare("A")
+            if devio.handler.wait_timeout(1000) == 0:
+                raise Exception("%s: Timed out priming UDP"
+                                % devio.handler.name)
+    waitms(200)
+    for io in conns:
+        io.read_cb_enable(False)
+        io.handler.ignore_input = False
+    return
+
+def xfer(src, dests, data, timeout):
+    """Write data from src and wait until every dest has received it"""
+    for io in dests:
+        io.handler.set_compare(data)
+    src.handler.set_write_data(data)
+    if src.handler.wait_timeout(timeout) == 0:
+        raise Exception("%s: Timed out waiting for write completion" %
+                        src.handler.name)
+    for io in dests:
+        if io.handler.wait_timeout(timeout) == 0:
+            raise Exception("%s: Timed out waiting for read completion at "
+                            "byte %d" % (io.handler.name, io.handler.compared))
+    return
+
+def bench_xfer(args, proto, dev, chardelay, nconns, threads):
+    """Measure throughput and latency for one point of the matrix"""
+    serparms = "%dN81" % args.baud
+    result = { "test": "xfer", "protocol": proto, "device": dev,
+               "chardelay": chardelay, "connections": nconns,
+               "threads": threads, "bytes": args.size,
+               "probes": args.probes }
+    devstr = devices[dev][1]
+    config = make_config(proto, dev, serparms, chardelay, nconns)
+
+    ser2net = utils.Ser2netDaemon(o, config, extra_args = "-t %d" % threads)
+    devio = None
+    conns = []
+    try:
+        if devstr:
+            devio = utils.alloc_io(o, devstr % serparms)
+        for i in range(0, nconns):
+            io = utils.alloc_io(o, protocols[proto][1] % netport)
+            io.handler.name = "%s conn %d" % (proto, i)
+            conns.append(io)
+        if proto == "udp":
+            prime_udp(conns, devio)
+        else:
+            # Give ser2net time to finish opening the device for
+            # every connection.
+            waitms(100)
+
+        if devio:
+            src = devio
+        else:
+            src = conns[0]
+
+        if devio:
+            # A serialsim pipe runs at the configured baud rate, so
+            # allow for that plenty of time.
+            timeout = int(args.size * 10 * 1000 * 3 / args.baud) + 5000
+        else:
+            timeout = 60000
+
+        lat = []
+        for i in range(0, args.probes):
+            probe = os.urandom(16)
+            start = time.perf_counter()
+            xfer(src, conns, probe, 2000)
+            lat.append((time.perf_counter() - start) * 1000000)
+
+        data = os.urandom(args.size)
+        cpu_start = cpu_seconds(ser2net.pid)
+        start = time.perf_counter()
+        xfer(src, conns, data, timeout)
+        elapsed = time.perf_counter() - start
+        cpu = cpu_seconds(ser2net.pid) - cpu_start
+
+        # Every connection receives the data, so that's how much
+        # ser2net pushed out to the network.
+        mbytes = args.size * nconns / 1000000.0
+        result["elapsed_sec"] = round(elapsed, 6)
+        result["bytes_per_sec"] = round(args.size / elapsed, 1)
+        result["net_bytes_per_sec"] = round(args.size * nconns / elapsed, 1)
+        result["latency_p50_usec"] = round(percentile(lat, 50), 1)
+        result["latency_p99_usec"] = round(percentile(lat, 99), 1)
+        result["cpu_sec"] = round(cpu, 3)
+        result["cpu_sec_per_mb"] = round(cpu / mbytes, 6)
+    except Exception as E:
+        result["error"] = str(E)
+    finally:
+        close_all(conns)
+        if devio:
+            close_all([devio])
+        ser2net.terminate()
+    return result
+
+def bench_accept(args, proto, threads):
+    """Measure how fast ser2net can accept and drop connections"""
+    result = { "test": "accept", "protocol": proto, "threads": threads }
+    if proto == "udp":
+        # UDP has no connection setup, opening a client just creates a
+        # socket locally.
+        result["skipped"] = "connectionless"
+        return result
+
+    config = make_config(proto, "echo", "", "off", 64)
+    ser2net = utils.Ser2netDaemon(o, config, extra_args = "-t %d" % threads)
+    try:
+        count = 0
+        cpu_start = cpu_seconds(ser2net.pid)
+        start = time.perf_counter()
+        end = start + args.accept_time
+        while time.perf_counter() < end:
+            io = utils.alloc_io(o, protocols[proto][1] % netport)
+            # Make sure ser2net has the connection up and the device
+            # open before dropping it.
+            xfer(io, [io], "A", 2000)
+            utils.io_close(io)
+            count += 1
+        elapsed = time.perf_counter() - start
+        cpu = cpu_seconds(ser2net.pid) - cpu_start
+        result["accepts"] = count
+        result["elapsed_sec"] = round(elapsed, 6)
+        result["accepts_per_sec"] = round(count / elapsed, 1)
+        result["cpu_sec"] = round(cpu, 3)
+    except Exception as E:
+        result["error"] = str(E)
+    finally:
+        ser2net.terminate()
+    return result
+
+def listarg(s, valid = None):
+    l = [i for i in s.split(",") if i]
+    if valid is not None:
+        for i in l:
+            if i not in valid:
+                raise argparse.ArgumentTypeError("invalid value: " + i)
+    return l
+
+def intlist(s):
+    try:
+        return [int(i) for i in listarg(s)]
+    except ValueError as E:
+        raise argparse.ArgumentTypeError(str(E))
+
+parser = argparse.ArgumentParser(description = "Benchmark ser2net")
+parser.add_argument("--protocols", default = "tcp,udp,telnet,ssl",
+                    type = lambda s: listarg(s, protocols),
+                    help = "comma separated list of %s" %
+                        ",".join(protocols))
+parser.add_argument("--devices", default = "pipe,echo",
+                    type = lambda s: listarg(s, devices),
+                    help = "comma separated list of %s" % ",".join(devices))
+parser.add_argument("--chardelay", default = "off,on",
+                    type = lambda s: listarg(s, chardelays),
+                    help = "comma separated list of %s" %
+                        ",".join(chardelays))
+parser.add_argument("--connections", default = "1,4", type = intlist,
+                    help = "comma separated list of connection counts")
+parser.add_argument("--threads", default = "1,4", type = intlist,
+                    help = "comma separated list of ser2net thread counts")
+parser.add_argument("--size", default = 65536, type = int,
+                    help = "bytes to transfer for the throughput test")
+parser.add_argument("--probes", default = 200, type = int,
+                    help = "number of latency probes")
+parser.add_argument("--baud", default = 115200, type = int,
+                    help = "baud rate for the serialsim pipe")
+parser.add_argument("--accept-time", default = 2.0, type = float,
+                    help = "seconds to run the accept rate test")
+parser.add_argument("--no-accept", action = "store_true",
+                    help = "skip the accept rate test")
+parser.add_argument("--quick", action = "store_true",
+                    help = "small transfers and few probes, for smoke testing")
+parser.add_argument("--output", default = None,
+                    help = "write results to the given file instead of stdout")
+args = parser.parse_args()
+
+if args.quick:
+    args.size = 4096
+    args.probes = 20
+    args.accept_time = 0.5
+
+if args.output:
+    out = open(args.output, "w")
+else:
+    out = sys.stdout
+
+def report(result):
+    out.write(json.dumps(result, sort_keys = True) + "\n")
+    out.flush()
+    if "error" in result:
+        log("  failed: " + result["error"])
+    return
+
+failures = 0
+for threads in args.threads:
+    for proto in args.protocols:
+        if not args.no_accept:
+            log("accept %s threads=%d" % (proto, threads))
+            r = bench_accept(args, proto, threads)
+            report(r)
+            if "error" in r:
+                failures += 1
+        for dev in args.devices:
+            for chardelay in args.chardelay:
+                for nconns in args.connections:
+                    log("xfer %s %s chardelay=%s connections=%d threads=%d" %
+                        (proto, dev, chardelay, nconns, threads))
+                    r = bench_xfer(args, proto, dev, chardelay, nconns,
+                                   threads)
+                    report(r)
+                    if "error" in r:
+                        failures += 1
+
+if args.output:
+    out.close()
+if failures:
+    log("%d benchmark runs failed" % failures)
+    sys.exit(1)
+sys.exit(0)
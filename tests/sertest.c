@@ -27,6 +27,9 @@
 #include <ctype.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/resource.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include <gensio/gensio_selector.h>
@@ -843,12 +846,649 @@ interactive_term(void)
     sertest_cleanup(c);
 }
 
+/*
+ * Load generator mode.  This opens a lot of connections to the given
+ * gensio strings (round-robin) and pushes messages through them.  The
+ * far end of each connection must echo what it gets, a ser2net port
+ * with an "echo" connector or a rotator of those works.  Each message
+ * carries the connection number, a sequence number, and the time it
+ * was sent, followed by a payload derived from those, so the returned
+ * data can be checked and the round trip timed.
+ */
+
+enum load_pattern {
+    LOAD_CONSTANT,	/* Send at a fixed rate per connection. */
+    LOAD_BURSTY,	/* Send a burst of messages at a fixed interval. */
+    LOAD_REQRESP	/* Send the next message when the last comes back. */
+};
+
+struct load_parms {
+    unsigned int connections;
+    unsigned int max_opens;	/* Opens in progress at one time. */
+    enum load_pattern pattern;
+    unsigned int msgsize;
+    unsigned int rate;		/* Messages/sec per connection. */
+    unsigned int burst;		/* Messages per burst. */
+    unsigned int burst_interval; /* Milliseconds between bursts. */
+    unsigned int duration;	/* Seconds to run after all are open. */
+};
+
+#define LOAD_HDR_SIZE 16
+#define LOAD_MAX_PENDING 1000
+
+/* Powers of two in microseconds, the last catches everything above. */
+#define LOAD_HIST_BUCKETS 32
+
+struct load_hist {
+    unsigned long count;
+    unsigned long long sum;
+    unsigned long long min;
+    unsigned long long max;
+    unsigned long buckets[LOAD_HIST_BUCKETS];
+};
+
+enum load_conn_state {
+    LOAD_CONN_INIT,
+    LOAD_CONN_OPENING,
+    LOAD_CONN_OPEN,
+    LOAD_CONN_CLOSING,
+    LOAD_CONN_CLOSED
+};
+
+struct load_ctx;
+
+struct load_conn {
+    struct load_ctx *l;
+    struct gensio *io;
+    unsigned int idx;
+    enum load_conn_state state;
+    struct timeval open_start;
+    struct timeval next_send;
+
+    unsigned int pending;	/* Messages due to be sent. */
+    bool writing;
+    unsigned int wpos;
+    unsigned char *wbuf;
+
+    unsigned int rpos;
+    unsigned char *rbuf;
+
+    unsigned int tx_seq;
+    unsigned int rx_seq;
+};
+
+struct load_ctx {
+    struct load_parms *p;
+    struct load_conn *conns;
+    unsigned int nconns;
+    bool draining;
+
+    unsigned int opening;
+    unsigned int closing;
+
+    unsigned int opened;
+    unsigned int open_fails;
+    unsigned int drops;
+    unsigned long integrity_errs;
+    unsigned long overruns;
+    unsigned long long tx_msgs;
+    unsigned long long rx_msgs;
+    unsigned long long tx_bytes;
+    unsigned long long rx_bytes;
+
+    struct load_hist setup;
+    struct load_hist latency;
+};
+
+static unsigned long long
+tv_to_usec(const struct timeval *tv)
+{
+    return ((unsigned long long) tv->tv_sec) * 1000000 + tv->tv_usec;
+}
+
+static void
+tv_add_usec(struct timeval *tv, unsigned long long usec)
+{
+    usec += tv->tv_usec;
+    tv->tv_sec += usec / 1000000;
+    tv->tv_usec = usec % 1000000;
+}
+
+static void
+put_be32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t
+get_be32(const unsigned char *p)
+{
+    return ((uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+	    (uint32_t) p[2] << 8 | p[3]);
+}
+
+static void
+load_hist_add(struct load_hist *h, unsigned long long usec)
+{
+    unsigned int b = 0;
+
+    while (b < LOAD_HIST_BUCKETS - 1 && (usec >> (b + 1)))
+	b++;
+    h->buckets[b]++;
+    if (h->count == 0 || usec < h->min)
+	h->min = usec;
+    if (usec > h->max)
+	h->max = usec;
+    h->count++;
+    h->sum += usec;
+}
+
+/*
+ * Return the upper bound of the bucket holding the given percentile,
+ * clamped to the largest value actually seen.
+ */
+static unsigned long long
+load_hist_pct(struct load_hist *h, unsigned int pct)
+{
+    unsigned long long want, seen = 0, top;
+    unsigned int b;
+
+    if (h->count == 0)
+	return 0;
+    want = (h->count * pct + 99) / 100;
+    for (b = 0; b < LOAD_HIST_BUCKETS; b++) {
+	seen += h->buckets[b];
+	if (seen >= want)
+	    break;
+    }
+    top = (2ULL << b) - 1;
+    if (b >= LOAD_HIST_BUCKETS - 1 || top > h->max)
+	top = h->max;
+    return top;
+}
+
+static void
+load_hist_print(const char *name, struct load_hist *h)
+{
+    unsigned int b;
+
+    printf("%s (usec): count %lu", name, h->count);
+    if (h->count)
+	printf(" min %llu avg %llu p50 %llu p90 %llu p99 %llu max %llu",
+	       h->min, h->sum / h->count, load_hist_pct(h, 50),
+	       load_hist_pct(h, 90), load_hist_pct(h, 99), h->max);
+    printf("\n");
+    for (b = 0; b < LOAD_HIST_BUCKETS; b++) {
+	if (!h->buckets[b])
+	    continue;
+	if (b == LOAD_HIST_BUCKETS - 1)
+	    printf("  >= %llu: %lu\n", 1ULL << b, h->buckets[b]);
+	else
+	    printf("  <= %llu: %lu\n", (2ULL << b) - 1, h->buckets[b]);
+    }
+}
+
+static unsigned char
+load_payload_byte(struct load_conn *lc, uint32_t seq, unsigned int i)
+{
+    return (lc->idx * 7 + seq * 13 + i) & 0xff;
+}
+
+static void
+load_build_msg(struct load_conn *lc)
+{
+    unsigned int i, size = lc->l->p->msgsize;
+    struct timeval now;
+    unsigned long long usec;
+
+    sel_get_monotonic_time(&now);
+    usec = tv_to_usec(&now);
+    put_be32(lc->wbuf, lc->idx);
+    put_be32(lc->wbuf + 4, lc->tx_seq);
+    put_be32(lc->wbuf + 8, usec >> 32);
+    put_be32(lc->wbuf + 12, usec);
+    for (i = LOAD_HDR_SIZE; i < size; i++)
+	lc->wbuf[i] = load_payload_byte(lc, lc->tx_seq, i);
+    lc->tx_seq++;
+    lc->wpos = 0;
+}
+
+static void
+load_start_send(struct load_conn *lc)
+{
+    if (lc->writing || !lc->pending || lc->state != LOAD_CONN_OPEN)
+	return;
+    lc->pending--;
+    load_build_msg(lc);
+    lc->writing = true;
+    gensio_set_write_callback_enable(lc->io, true);
+}
+
+static void
+load_queue_msgs(struct load_conn *lc, unsigned int count)
+{
+    struct load_ctx *l = lc->l;
+
+    if (lc->pending + count > LOAD_MAX_PENDING) {
+	/* The connection can't keep up with the requested load. */
+	l->overruns += lc->pending + count - LOAD_MAX_PENDING;
+	count = LOAD_MAX_PENDING - lc->pending;
+    }
+    lc->pending += count;
+    load_start_send(lc);
+}
+
+static void
+load_close_done(struct gensio *io, void *close_data)
+{
+    struct load_conn *lc = gensio_get_user_data(io);
+
+    lc->state = LOAD_CONN_CLOSED;
+    lc->l->closing--;
+}
+
+static void
+load_close(struct load_conn *lc)
+{
+    if (lc->state != LOAD_CONN_OPEN)
+	return;
+    lc->pending = 0;
+    if (gensio_close(lc->io, load_close_done, NULL)) {
+	lc->state = LOAD_CONN_CLOSED;
+    } else {
+	lc->state = LOAD_CONN_CLOSING;
+	lc->l->closing++;
+    }
+}
+
+static void
+load_check_msg(struct load_conn *lc)
+{
+    struct load_ctx *l = lc->l;
+    unsigned int i, size = l->p->msgsize;
+    unsigned long long sent;
+    uint32_t seq;
+    struct timeval now;
+
+    seq = get_be32(lc->rbuf + 4);
+    if (get_be32(lc->rbuf) != lc->idx || seq != lc->rx_seq)
+	goto bad;
+    for (i = LOAD_HDR_SIZE; i < size; i++) {
+	if (lc->rbuf[i] != load_payload_byte(lc, seq, i))
+	    goto bad;
+    }
+
+    sel_get_monotonic_time(&now);
+    sent = ((unsigned long long) get_be32(lc->rbuf + 8) << 32 |
+	    get_be32(lc->rbuf + 12));
+    load_hist_add(&l->latency, tv_to_usec(&now) - sent);
+    lc->rx_seq++;
+    l->rx_msgs++;
+    if (l->p->pattern == LOAD_REQRESP && !l->draining)
+	load_queue_msgs(lc, 1);
+    return;
+
+ bad:
+    /*
+     * Once the stream is out of step there's no sane way to find the
+     * next message boundary, so drop the connection.
+     */
+    l->integrity_errs++;
+    load_close(lc);
+}
+
+static int
+load_event(struct gensio *io, int event, int readerr,
+	   unsigned char *buf, unsigned int *buflen, void *auxdata)
+{
+    struct load_conn *lc = gensio_get_user_data(io);
+    struct load_ctx *l = lc->l;
+    unsigned int size = l->p->msgsize;
+    unsigned int i, count, written = 0;
+    int err;
+
+    switch (event) {
+    case GENSIO_EVENT_READ:
+	if (readerr) {
+	    gensio_set_read_callback_enable(io, false);
+	    if (lc->state == LOAD_CONN_OPEN) {
+		l->drops++;
+		load_close(lc);
+	    }
+	    return 0;
+	}
+	if (lc->state != LOAD_CONN_OPEN)
+	    return 0;
+
+	l->rx_bytes += *buflen;
+	for (i = 0; i < *buflen && lc->state == LOAD_CONN_OPEN; i += count) {
+	    count = size - lc->rpos;
+	    if (count > *buflen - i)
+		count = *buflen - i;
+	    memcpy(lc->rbuf + lc->rpos, buf + i, count);
+	    lc->rpos += count;
+	    if (lc->rpos == size) {
+		lc->rpos = 0;
+		load_check_msg(lc);
+	    }
+	}
+	return 0;
+
+    case GENSIO_EVENT_WRITE_READY:
+	if (!lc->writing) {
+	    gensio_set_write_callback_enable(io, false);
+	    return 0;
+	}
+	err = gensio_write(io, &written, lc->wbuf + lc->wpos,
+			   size - lc->wpos);
+	if (err) {
+	    gensio_set_write_callback_enable(io, false);
+	    lc->writing = false;
+	    l->drops++;
+	    load_close(lc);
+	    return 0;
+	}
+	lc->wpos += written;
+	l->tx_bytes += written;
+	if (lc->wpos >= size) {
+	    lc->writing = false;
+	    l->tx_msgs++;
+	    if (lc->pending)
+		load_start_send(lc);
+	    else
+		gensio_set_write_callback_enable(io, false);
+	}
+	return 0;
+    }
+
+    return ENOTSUP;
+}
+
+static void
+load_open_done(struct gensio *io, int err, void *open_data)
+{
+    struct load_conn *lc = open_data;
+    struct load_ctx *l = lc->l;
+    struct timeval now;
+
+    l->opening--;
+    sel_get_monotonic_time(&now);
+    if (err) {
+	lc->state = LOAD_CONN_CLOSED;
+	l->open_fails++;
+	return;
+    }
+
+    load_hist_add(&l->setup, tv_to_usec(&now) - tv_to_usec(&lc->open_start));
+    lc->state = LOAD_CONN_OPEN;
+    lc->next_send = now;
+    l->opened++;
+    gensio_set_read_callback_enable(io, true);
+    if (l->draining)
+	load_close(lc);
+    else if (l->p->pattern == LOAD_REQRESP)
+	load_queue_msgs(lc, 1);
+}
+
+/* Add whatever messages have come due for the timed patterns. */
+static void
+load_schedule(struct load_ctx *l, struct timeval *now)
+{
+    struct load_parms *p = l->p;
+    unsigned long long interval;
+    unsigned int i, count;
+
+    if (p->pattern == LOAD_REQRESP)
+	return;
+    if (p->pattern == LOAD_CONSTANT)
+	interval = 1000000 / p->rate;
+    else
+	interval = p->burst_interval * 1000ULL;
+    if (interval == 0)
+	interval = 1;
+
+    for (i = 0; i < l->nconns; i++) {
+	struct load_conn *lc = &l->conns[i];
+
+	if (lc->state != LOAD_CONN_OPEN)
+	    continue;
+	count = 0;
+	while (cmp_timeval(now, &lc->next_send) >= 0) {
+	    count += p->pattern == LOAD_CONSTANT ? 1 : p->burst;
+	    tv_add_usec(&lc->next_send, interval);
+	}
+	if (count)
+	    load_queue_msgs(lc, count);
+    }
+}
+
+static bool
+load_idle(struct load_ctx *l)
+{
+    unsigned int i;
+
+    for (i = 0; i < l->nconns; i++) {
+	struct load_conn *lc = &l->conns[i];
+
+	if (lc->state == LOAD_CONN_OPEN && (lc->writing || lc->pending ||
+					    lc->rx_seq != lc->tx_seq))
+	    return false;
+    }
+    return true;
+}
+
+static void
+load_raise_nofile(unsigned int needed)
+{
+    struct rlimit r;
+
+    if (getrlimit(RLIMIT_NOFILE, &r))
+	return;
+    if (r.rlim_cur >= needed)
+	return;
+    if (r.rlim_max != RLIM_INFINITY && r.rlim_max < needed) {
+	fprintf(stderr, "Warning: file descriptor limit %lu is below the"
+		" %u needed\n", (unsigned long) r.rlim_max, needed);
+	needed = r.rlim_max;
+    }
+    r.rlim_cur = needed;
+    setrlimit(RLIMIT_NOFILE, &r);
+}
+
+static void
+load_service(unsigned int usec)
+{
+    struct timeval timeout = { 0, usec };
+
+    my_o->service(my_o, &timeout);
+}
+
+static int
+run_load(struct load_parms *p, char **targets, int ntargets)
+{
+    struct load_ctx l;
+    struct load_conn *lc;
+    struct timeval now, start, opened_time, drain_start, end;
+    unsigned int i, next_open = 0;
+    bool all_opened = false;
+    unsigned long long elapsed;
+    int err;
+
+    memset(&l, 0, sizeof(l));
+    l.p = p;
+    l.nconns = p->connections;
+    l.conns = calloc(l.nconns, sizeof(*l.conns));
+    if (!l.conns) {
+	fprintf(stderr, "Out of memory allocating connections\n");
+	return 1;
+    }
+
+    /* Every connection needs at least one fd, plus some slack. */
+    load_raise_nofile(l.nconns + 64);
+
+    for (i = 0; i < l.nconns; i++) {
+	lc = &l.conns[i];
+	lc->l = &l;
+	lc->idx = i;
+	lc->wbuf = malloc(p->msgsize * 2);
+	if (!lc->wbuf) {
+	    fprintf(stderr, "Out of memory allocating buffers\n");
+	    return 1;
+	}
+	lc->rbuf = lc->wbuf + p->msgsize;
+	err = str_to_gensio(targets[i % ntargets], my_o, load_event, lc,
+			    &lc->io);
+	if (err) {
+	    fprintf(stderr, "Error creating gensio '%s': %s\n",
+		    targets[i % ntargets], strerror(err));
+	    return 1;
+	}
+    }
+
+    sel_get_monotonic_time(&start);
+    while (true) {
+	while (next_open < l.nconns && l.opening < p->max_opens) {
+	    lc = &l.conns[next_open++];
+	    sel_get_monotonic_time(&lc->open_start);
+	    err = gensio_open(lc->io, load_open_done, lc);
+	    if (err) {
+		lc->state = LOAD_CONN_CLOSED;
+		l.open_fails++;
+	    } else {
+		lc->state = LOAD_CONN_OPENING;
+		l.opening++;
+	    }
+	}
+
+	sel_get_monotonic_time(&now);
+	if (!all_opened && next_open == l.nconns && l.opening == 0) {
+	    all_opened = true;
+	    opened_time = now;
+	    end = now;
+	    end.tv_sec += p->duration;
+	    if (debug)
+		printf("All connections opened in %llu usec\n",
+		       tv_to_usec(&now) - tv_to_usec(&start));
+	}
+
+	if (!l.draining) {
+	    if (all_opened && cmp_timeval(&now, &end) >= 0) {
+		/* Stop sending and give outstanding messages time. */
+		l.draining = true;
+		drain_start = now;
+		end = now;
+		end.tv_sec += 5;
+	    } else {
+		load_schedule(&l, &now);
+	    }
+	} else if (load_idle(&l) || cmp_timeval(&now, &end) >= 0) {
+	    break;
+	}
+
+	load_service(1000);
+    }
+    elapsed = tv_to_usec(&drain_start) - tv_to_usec(&opened_time);
+
+    for (i = 0; i < l.nconns; i++) {
+	lc = &l.conns[i];
+	if (lc->state == LOAD_CONN_OPEN && lc->rx_seq != lc->tx_seq)
+	    /* Never came back, count it as lost data. */
+	    l.integrity_errs++;
+	load_close(lc);
+    }
+    sel_get_monotonic_time(&end);
+    end.tv_sec += 5;
+    while (l.closing > 0) {
+	sel_get_monotonic_time(&now);
+	if (cmp_timeval(&now, &end) >= 0) {
+	    fprintf(stderr, "Timed out waiting for %u connections to close\n",
+		    l.closing);
+	    break;
+	}
+	load_service(10000);
+    }
+
+    printf("connections: %u opened: %u failed: %u dropped: %u\n",
+	   l.nconns, l.opened, l.open_fails, l.drops);
+    printf("messages: sent %llu received %llu overruns %lu\n",
+	   l.tx_msgs, l.rx_msgs, l.overruns);
+    printf("bytes: sent %llu received %llu\n", l.tx_bytes, l.rx_bytes);
+    printf("integrity errors: %lu\n", l.integrity_errs);
+    if (elapsed)
+	printf("elapsed: %llu usec, %llu msgs/sec\n", elapsed,
+	       l.rx_msgs * 1000000 / elapsed);
+    load_hist_print("setup", &l.setup);
+    load_hist_print("latency", &l.latency);
+
+    if (l.closing == 0) {
+	for (i = 0; i < l.nconns; i++) {
+	    gensio_free(l.conns[i].io);
+	    free(l.conns[i].wbuf);
+	}
+	free(l.conns);
+    }
+
+    if (l.open_fails || l.drops || l.integrity_errs)
+	return 1;
+    return 0;
+}
+
+static void
+help(void)
+{
+    printf("sertest [options] [file [file ...]]\n"
+	   "sertest --load [options] gensio [gensio ...]\n"
+	   "Without files, run commands interactively.  Options are:\n"
+	   "  -d, --debug - Increment the debug level\n"
+	   "  --load - Run the load generator against the given gensios\n"
+	   "Load generator options are:\n"
+	   "  -c, --connections <n> - Connections to open, default 100\n"
+	   "  --max-opens <n> - Opens in progress at once, default 64\n"
+	   "  --pattern constant|bursty|reqresp - Traffic pattern, default\n"
+	   "      reqresp\n"
+	   "  --size <n> - Message size, at least 16, default 64\n"
+	   "  --rate <n> - Messages/sec per connection for constant,\n"
+	   "      default 10\n"
+	   "  --burst <n> - Messages per burst for bursty, default 10\n"
+	   "  --burst-interval <ms> - Time between bursts, default 1000\n"
+	   "  --time <sec> - Run time after all connections are open,\n"
+	   "      default 10\n");
+}
+
+static unsigned int
+uint_arg(int argc, char *argv[], int *curr_arg, const char *arg)
+{
+    unsigned long v;
+    char *end;
+
+    if (*curr_arg >= argc) {
+	fprintf(stderr, "No value given for %s\n", arg);
+	exit(1);
+    }
+    v = strtoul(argv[*curr_arg], &end, 0);
+    if (end == argv[*curr_arg] || *end != '\0' || v > UINT_MAX) {
+	fprintf(stderr, "Invalid value for %s: %s\n", arg, argv[*curr_arg]);
+	exit(1);
+    }
+    (*curr_arg)++;
+    return v;
+}
+
 int
 main(int argc, char *argv[])
 {
     int curr_arg = 1;
     const char *arg;
     int rv;
+    bool load = false;
+    struct load_parms lp = {
+	.connections = 100, .max_opens = 64, .pattern = LOAD_REQRESP,
+	.msgsize = 64, .rate = 10, .burst = 10, .burst_interval = 1000,
+	.duration = 10
+    };
 
     while ((curr_arg < argc) && (argv[curr_arg][0] == '-')) {
 	arg = argv[curr_arg];
@@ -858,8 +1498,57 @@ main(int argc, char *argv[])
 	} else if ((strcmp(arg, "-d") == 0) || (strcmp(arg, "--debug") == 0)) {
 	    debug++;
 	} else if ((strcmp(arg, "-?") == 0) || (strcmp(arg, "--help") == 0)) {
-	    printf("Help!\n");
+	    help();
 	    exit(0);
+	} else if (strcmp(arg, "--load") == 0) {
+	    load = true;
+	} else if ((strcmp(arg, "-c") == 0) ||
+		   (strcmp(arg, "--connections") == 0)) {
+	    lp.connections = uint_arg(argc, argv, &curr_arg, arg);
+	} else if (strcmp(arg, "--max-opens") == 0) {
+	    lp.max_opens = uint_arg(argc, argv, &curr_arg, arg);
+	} else if (strcmp(arg, "--pattern") == 0) {
+	    if (curr_arg >= argc) {
+		fprintf(stderr, "No value given for %s\n", arg);
+		exit(1);
+	    }
+	    if (strcmp(argv[curr_arg], "constant") == 0) {
+		lp.pattern = LOAD_CONSTANT;
+	    } else if (strcmp(argv[curr_arg], "bursty") == 0) {
+		lp.pattern = LOAD_BURSTY;
+	    } else if (strcmp(argv[curr_arg], "reqresp") == 0) {
+		lp.pattern = LOAD_REQRESP;
+	    } else {
+		fprintf(stderr, "Unknown pattern: %s\n", argv[curr_arg]);
+		exit(1);
+	    }
+	    curr_arg++;
+	} else if (strcmp(arg, "--size") == 0) {
+	    lp.msgsize = uint_arg(argc, argv, &curr_arg, arg);
+	} else if (strcmp(arg, "--rate") == 0) {
+	    lp.rate = uint_arg(argc, argv, &curr_arg, arg);
+	} else if (strcmp(arg, "--burst") == 0) {
+	    lp.burst = uint_arg(argc, argv, &curr_arg, arg);
+	} else if (strcmp(arg, "--burst-interval") == 0) {
+	    lp.burst_interval = uint_arg(argc, argv, &curr_arg, arg);
+	} else if (strcmp(arg, "--time") == 0) {
+	    lp.duration = uint_arg(argc, argv, &curr_arg, arg);
+	} else {
+	    fprintf(stderr, "Unknown option: %s\n", arg);
+	    help();
+	    exit(1);
+	}
+    }
+
+    if (load) {
+	if (curr_arg >= argc) {
+	    fprintf(stderr, "No gensios given for the load generator\n");
+	    exit(1);
+	}
+	if (lp.msgsize < LOAD_HDR_SIZE || lp.connections == 0 ||
+		lp.max_opens == 0 || lp.rate == 0 || lp.burst == 0) {
+	    fprintf(stderr, "Invalid load generator parameters\n");
+	    exit(1);
 	}
     }
 
@@ -875,6 +1564,13 @@ main(int argc, char *argv[])
 	exit(1);
     }
 
+    if (load) {
+	rv = run_load(&lp, argv + curr_arg, argc - curr_arg);
+	my_o->free_funcs(my_o);
+	sel_free_selector(my_sel);
+	return rv;
+    }
+
     setup_sig();
 
     if (curr_arg < argc) {
@@ -4,6 +4,9 @@ import utils
 from serialsim import *
 import tempfile
 import os
+import socket
+import re
+import signal
 
 print("Testing miscellaneous features")
 
@@ -65,4 +68,387 @@ finally:
         utils.io_close(io4)
     utils.finish_2_ser2net(ser2net, io1, io2)
 
+print("  metrics")
+ser2net, io1, io2 = utils.setup_2_ser2net(utils.o,
+              ("connection: &con",
+               "  accepter: tcp,3023",
+               "  connector: serialdev,/dev/ttyPipeA0,9600N81",
+               "metrics:",
+               "  accepter: tcp,localhost,3024",
+               "  options:",
+               "    cache-time: 0"),
+              "tcp,localhost,3023",
+              "serialdev,/dev/ttyPipeB0,9600N81")
+try:
+    utils.test_dataxfer(io2, io1, "Test string")
+    s = socket.create_connection(("localhost", 3024), timeout = 5)
+    s.sendall(b"GET /metrics HTTP/1.0\r\n\r\n")
+    page = b""
+    while True:
+        data = s.recv(65536)
+        if not data:
+            break
+        page += data
+    s.close()
+    page = page.decode()
+    if not page.startswith("HTTP/1.0 200 OK"):
+        raise Exception("metrics: bad response: " + page[:80])
+    for l in ('ser2net_port_connections{port="con"} 1',
+              'ser2net_port_dev_bytes_received_total{port="con"} 11',
+              'ser2net_port_dev_to_net_size_bytes_sum{port="con"} 11'):
+        if l not in page.split("\n"):
+            raise Exception("metrics: missing " + l)
+finally:
+    utils.finish_2_ser2net(ser2net, io1, io2)
+
+print("  reload keeps unchanged ports")
+def write_reload_config(f, banner):
+    f.seek(0)
+    f.truncate()
+    f.write("connection: &con1\n"
+            "  accepter: tcp,3023\n"
+            "  connector: serialdev,/dev/ttyPipeA0,9600N81\n"
+            "connection: &con2\n"
+            "  accepter: tcp,3025\n"
+            "  connector: serialdev,/dev/ttyPipeA1,9600N81\n")
+    if banner:
+        f.write("  options:\n"
+                "    banner: \"" + banner + "\\r\\n\"\n")
+    f.flush()
+    return
+
+cfg = tempfile.NamedTemporaryFile(mode = "w", suffix = ".yaml")
+write_reload_config(cfg, None)
+ser2net, io1, io2 = utils.setup_2_ser2net(utils.o, (),
+              "tcp,localhost,3023",
+              "serialdev,/dev/ttyPipeB0,9600N81",
+              extra_args = "-c " + cfg.name)
+io3 = None
+io4 = None
+io5 = None
+try:
+    io3 = utils.alloc_io(utils.o, "tcp,localhost,3025")
+    io4 = utils.alloc_io(utils.o, "serialdev,/dev/ttyPipeB1,9600N81")
+    utils.test_dataxfer(io1, io2, "Test string")
+    utils.test_dataxfer(io3, io4, "Test string")
+
+    # Change only con2 and reread the config with both in use.
+    write_reload_config(cfg, "reloaded")
+    ser2net.signal(signal.SIGHUP)
+    gensio.waiter(utils.o).wait_timeout(1, 1000)
+
+    # con1 did not change, its user must not notice the reload.
+    utils.test_dataxfer(io1, io2, "Test 2 string")
+    utils.test_dataxfer(io2, io1, "Test 3 string")
+
+    # con2 changed, its current user keeps the old port until it
+    # leaves, then the port restarts with the new config.
+    utils.test_dataxfer(io3, io4, "Test 2 string")
+    utils.io_close(io3)
+    io3 = None
+    gensio.waiter(utils.o).wait_timeout(1, 500)
+    io5 = utils.alloc_io(utils.o, "tcp,localhost,3025", do_open = False)
+    io5.handler.set_compare("reloaded\r\n")
+    io5.open_s()
+    io5.read_cb_enable(True)
+    if io5.handler.wait_timeout(1000) == 0:
+        raise Exception("reload: changed port didn't restart with new config")
+    utils.test_dataxfer(io5, io4, "Test 3 string")
+finally:
+    if io3 is not None:
+        utils.io_close(io3)
+    if io5 is not None:
+        utils.io_close(io5)
+    if io4 is not None:
+        utils.io_close(io4)
+    utils.finish_2_ser2net(ser2net, io1, io2)
+    cfg.close()
+
+print("  rotator next-free")
+ser2net, io1, io2 = utils.setup_2_ser2net(utils.o,
+              ("connection: &con1",
+               "  accepter: tcp,3023",
+               "  connector: serialdev,/dev/ttyPipeA0,9600N81",
+               "  options:",
+               "    max-connections: 1",
+               "connection: &con2",
+               "  accepter: tcp,3025",
+               "  connector: serialdev,/dev/ttyPipeA1,9600N81",
+               "  options:",
+               "    max-connections: 1",
+               "rotator: &rot",
+               "  accepter: tcp,3026",
+               "  connections: [ *con1, *con2 ]",
+               "  options:",
+               "    policy: next-free"),
+              "tcp,localhost,3023",
+              "serialdev,/dev/ttyPipeB0,9600N81")
+io3 = None
+io4 = None
+io5 = None
+try:
+    io3 = utils.alloc_io(utils.o, "serialdev,/dev/ttyPipeB1,9600N81")
+    utils.test_dataxfer(io1, io2, "Test string")
+
+    # con1 is full, so the rotator must skip it.
+    io4 = utils.alloc_io(utils.o, "tcp,localhost,3026")
+    utils.test_dataxfer(io4, io3, "Test 2 string")
+
+    io5 = utils.alloc_io(utils.o, "tcp,localhost,3026", do_open = False)
+    io5.handler.set_compare("No free port found\r\n")
+    io5.handler.set_expected_err("Remote end closed connection")
+    io5.open_s()
+    io5.read_cb_enable(True)
+    if io5.handler.wait_timeout(1000) == 0:
+        raise Exception("next-free: Overconnect didn't receive errstring")
+    io5.read_cb_enable(True)
+    if io5.handler.wait_timeout(1000) == 0:
+        raise Exception("next-free: Overconnect didn't remclose")
+    utils.io_close(io5)
+    io5 = None
+
+    # Free con2's slot, next-free must find it again.
+    utils.io_close(io4)
+    io4 = None
+    gensio.waiter(utils.o).wait_timeout(1, 500)
+    io4 = utils.alloc_io(utils.o, "tcp,localhost,3026")
+    utils.test_dataxfer(io4, io3, "Test 3 string")
+    utils.test_dataxfer(io1, io2, "Test 4 string")
+
+    # And now con1's.
+    utils.io_close(io1)
+    gensio.waiter(utils.o).wait_timeout(1, 500)
+    io5 = utils.alloc_io(utils.o, "tcp,localhost,3026")
+    utils.test_dataxfer(io5, io2, "Test 5 string")
+finally:
+    if io5 is not None:
+        utils.io_close(io5)
+    if io4 is not None:
+        utils.io_close(io4)
+    if io3 is not None:
+        utils.io_close(io3)
+    utils.finish_2_ser2net(ser2net, io1, io2)
+
+for batch in ("false", "true"):
+    print("  partial device writes, net-batch " + batch)
+    # A slow device can't take a large network send in one write, so
+    # the rest has to go out from where the partial write left off.
+    ser2net, io1, io2 = utils.setup_2_ser2net(utils.o,
+              ("connection: &con",
+               "  accepter: tcp,3023",
+               "  connector: serialdev,/dev/ttyPipeA0,38400N81",
+               "  options:",
+               "    net-batch: " + batch),
+              "tcp,localhost,3023",
+              "serialdev,/dev/ttyPipeB0,38400N81")
+    try:
+        utils.test_dataxfer(io1, io2, os.urandom(32768), timeout = 30000)
+    finally:
+        utils.finish_2_ser2net(ser2net, io1, io2)
+
+def fanout_config(policy):
+    return ("connection: &con",
+            "  accepter: tcp,3023",
+            "  connector: echo",
+            "  options:",
+            "    max-connections: 2",
+            "    fanout-backlog: 65536",
+            "    slow-client: " + policy,
+            "admin:",
+            "  accepter: tcp,localhost,3024")
+
+def fanout_dropped():
+    """Return the "bytes dropped" value for each connection on con"""
+    c = utils.Ser2netController(3024)
+    try:
+        out = c.cmd("showport con")
+    finally:
+        c.close()
+    return [int(l.split(":")[1]) for l in out.split("\n")
+            if l.strip().startswith("bytes dropped:")]
+
+# The echo device is fast, so this is far more than the slow
+# connection's socket buffers can hold.
+fanout_data = os.urandom(8 * 1024 * 1024)
+
+print("  fanout slow-client block")
+ser2net, slow, fast = utils.setup_2_ser2net(utils.o, fanout_config("block"),
+                                            "tcp,localhost,3023",
+                                            "tcp,localhost,3023")
+try:
+    fast.handler.set_write_data(fanout_data)
+    fast.handler.set_compare(fanout_data)
+    gensio.waiter(utils.o).wait_timeout(1, 3000)
+    if fast.handler.to_compare is None:
+        raise Exception("block: slow connection didn't hold up the device")
+
+    # Once the slow one reads, both must get everything.
+    slow.handler.set_compare(fanout_data)
+    if slow.handler.wait_timeout(60000) == 0:
+        raise Exception("block: slow connection didn't get the data, at %d"
+                        % slow.handler.compared)
+    for i in range(0, 2):
+        if fast.handler.wait_timeout(60000) == 0:
+            raise Exception("block: fast connection didn't finish, at %d"
+                            % fast.handler.compared)
+finally:
+    utils.finish_2_ser2net(ser2net, slow, fast)
+
+print("  fanout slow-client drop")
+ser2net, slow, fast = utils.setup_2_ser2net(utils.o, fanout_config("drop"),
+                                            "tcp,localhost,3023",
+                                            "tcp,localhost,3023")
+try:
+    utils.test_dataxfer(fast, fast, fanout_data, timeout = 60000)
+    dropped = fanout_dropped()
+    if len(dropped) != 2 or not [d for d in dropped if d > 0]:
+        raise Exception("drop: slow connection didn't drop data: "
+                        + str(dropped))
+    if 0 not in dropped:
+        raise Exception("drop: fast connection dropped data: "
+                        + str(dropped))
+finally:
+    utils.finish_2_ser2net(ser2net, slow, fast)
+
+print("  fanout slow-client disconnect")
+ser2net, slow, fast = utils.setup_2_ser2net(utils.o,
+                                            fanout_config("disconnect"),
+                                            "tcp,localhost,3023",
+                                            "tcp,localhost,3023")
+try:
+    utils.test_dataxfer(fast, fast, fanout_data, timeout = 60000)
+    slow.handler.ignore_input = True
+    slow.handler.set_expected_err("Remote end closed connection")
+    slow.read_cb_enable(True)
+    if slow.handler.wait_timeout(10000) == 0:
+        raise Exception("disconnect: slow connection wasn't closed")
+    utils.test_dataxfer(fast, fast, "Still here", timeout = 1000)
+finally:
+    utils.finish_2_ser2net(ser2net, slow, fast)
+
+print("  multiple monitors")
+ser2net, io1, io2 = utils.setup_2_ser2net(utils.o,
+              ("connection: &con",
+               "  accepter: tcp,3023",
+               "  connector: serialdev,/dev/ttyPipeA0,9600N81",
+               "admin:",
+               "  accepter: tcp,localhost,3024"),
+              "tcp,localhost,3023",
+              "serialdev,/dev/ttyPipeB0,9600N81")
+c1 = None
+c2 = None
+try:
+    c1 = utils.Ser2netController(3024)
+    c2 = utils.Ser2netController(3024)
+    out = c1.cmd("monitor tcp con") + c2.cmd("monitor both con timestamp")
+    if "error" in out:
+        raise Exception("monitor: start failed: " + out)
+
+    utils.test_dataxfer(io1, io2, "net data")
+    utils.test_dataxfer(io2, io1, "term data")
+
+    # The device data may come in more than one block.
+    out = c2.read_until("]\r\n")
+    got = { "tcp": "", "term": "" }
+    while True:
+        m = re.search(r"\[[0-9]+\.[0-9]{6} (tcp|term) ([0-9]+)\]\r\n$", out)
+        if not m:
+            raise Exception("monitor: bad block header: " + out)
+        got[m.group(1)] += c2.read_len(int(m.group(2)))
+        if len(got["term"]) >= len("term data"):
+            break
+        out = c2.read_until("]\r\n")
+    if got["tcp"] != "net data" or got["term"] != "term data":
+        raise Exception("monitor: bad data on both monitor: " + str(got))
+
+    out = c1.read_until("net data")
+    out = c1.cmd("monitor stop")
+    if "term data" in out:
+        raise Exception("monitor: tcp monitor got term data: " + out)
+finally:
+    if c1 is not None:
+        c1.close()
+    if c2 is not None:
+        c2.close()
+    utils.finish_2_ser2net(ser2net, io1, io2)
+
+print("  monitor drop report")
+ser2net = utils.Ser2netDaemon(utils.o,
+              ("connection: &con",
+               "  accepter: tcp,3023",
+               "  connector: echo",
+               "admin:",
+               "  accepter: tcp,localhost,3024"))
+io1 = None
+c = None
+try:
+    io1 = utils.alloc_io(utils.o, "tcp,localhost,3023")
+    c = utils.Ser2netController(3024)
+    out = c.cmd("monitor tcp con")
+    if "error" in out:
+        raise Exception("monitor: start failed: " + out)
+
+    # The controller doesn't read while this goes through, so it
+    # can't keep up and the monitor drops data.
+    utils.test_dataxfer(io1, io1, os.urandom(8 * 1024 * 1024),
+                        timeout = 60000)
+    c.drain()
+    utils.test_dataxfer(io1, io1, "after drop")
+    out = c.read_until("after drop")
+    m = re.search(r"\[monitor dropped ([0-9]+) bytes\]\r\n", out)
+    if not m or int(m.group(1)) == 0:
+        raise Exception("monitor: no drop report: " + out[-200:])
+finally:
+    if c is not None:
+        c.close()
+    if io1 is not None:
+        utils.io_close(io1)
+    ser2net.terminate()
+
+print("  passthrough with a backlog and a monitor")
+ser2net = utils.Ser2netDaemon(utils.o,
+              ("connection: &con",
+               "  accepter: tcp,3023",
+               "  connector: echo",
+               "  options:",
+               "    passthrough: true",
+               "    chardelay: false",
+               "admin:",
+               "  accepter: tcp,localhost,3024"))
+io1 = None
+c = None
+try:
+    io1 = utils.alloc_io(utils.o, "tcp,localhost,3023")
+    utils.test_dataxfer(io1, io1, "Test string")
+
+    # No ">" in the data, so the controller's prompt can't show up in
+    # the monitor output.
+    data = os.urandom(4 * 1024 * 1024).replace(b">", b"<")
+
+    # Don't read for a while, so the direct writes to the network come
+    # up short and the rest has to be held in the port.
+    io1.handler.set_write_data(data)
+    gensio.waiter(utils.o).wait_timeout(1, 2000)
+
+    # Switch to the full data path and back while data is moving.
+    c = utils.Ser2netController(3024)
+    out = c.cmd("monitor term con")
+    if "error" in out:
+        raise Exception("passthrough: monitor start failed: " + out)
+    io1.handler.set_compare(data)
+    while io1.handler.to_compare and io1.handler.compared < len(data) / 2:
+        gensio.waiter(utils.o).wait_timeout(1, 10)
+    c.cmd("monitor stop")
+
+    for i in range(0, 2):
+        if io1.handler.wait_timeout(60000) == 0:
+            raise Exception("passthrough: transfer didn't finish, at %d"
+                            % io1.handler.compared)
+finally:
+    if c is not None:
+        c.close()
+    if io1 is not None:
+        utils.io_close(io1)
+    ser2net.terminate()
+
 print("  Success!")
@@ -19,6 +19,16 @@ test_one_xfer("banner", None, "Testing banner!",
               "serialdev,/dev/ttyPipeB0,9600N81",
               compare2 = "banner1\r\nTesting banner!")
 
+test_one_xfer("banner with port fields", None, "Testing banner!",
+              ("connection: &con",
+               "  accepter: tcp,3023",
+               "  connector: serialdev,/dev/ttyPipeA0,9600N81",
+               "  options:",
+               "    banner: \"\\\\N on \\\\p\\\\r\\\\n\""),
+              "tcp,localhost,3023",
+              "serialdev,/dev/ttyPipeB0,9600N81",
+              compare2 = "con on tcp,3023\r\nTesting banner!")
+
 print("  banner 100 times")
 ser2net, io1, io2 = utils.setup_2_ser2net(utils.o,
               ("connection: &con",
@@ -135,4 +145,90 @@ try:
 finally:
     utils.finish_2_ser2net(ser2net, io1, io2)
 
+print("  overlapping sendon")
+# "abac" starts inside the partial match "aba" of "ababac", a matcher
+# that restarts from scratch on a mismatch would miss it.
+ser2net, io1, io2 = utils.setup_2_ser2net(utils.o,
+              ("connection: &con",
+               "  accepter: tcp,3023",
+               "  connector: serialdev,/dev/ttyPipeA0,9600N81",
+               "  options:",
+               "    chardelay-min: 5000000",
+               "    chardelay-max: 5000000",
+               "    sendon: \"abac\""),
+              "tcp,localhost,3023",
+              "serialdev,/dev/ttyPipeB0,9600N81")
+try:
+    io1.handler.set_compare("xyababac")
+    io2.handler.set_write_data("xyababac")
+    if io1.handler.wait_timeout(1000) == 0:
+        raise Exception("overlapping sendon: Timed out waiting for sendon")
+finally:
+    utils.finish_2_ser2net(ser2net, io1, io2)
+
+print("  overlapping closeon")
+ser2net, io1, io2 = utils.setup_2_ser2net(utils.o,
+              ("connection: &con",
+               "  accepter: tcp,3023",
+               "  connector: serialdev,/dev/ttyPipeA0,9600N81",
+               "  options:",
+               "    closeon: \"abac\""),
+              "tcp,localhost,3023",
+              "serialdev,/dev/ttyPipeB0,9600N81")
+try:
+    io1.handler.set_expected_err("Remote end closed connection")
+    io1.handler.set_compare("ababac")
+    utils.test_dataxfer(io2, io1, "ababac")
+    io1.read_cb_enable(True)
+    if io1.handler.wait_timeout(1000) == 0:
+        raise Exception("overlapping closeon: Timed out waiting for close")
+finally:
+    utils.finish_2_ser2net(ser2net, io1, io2)
+
+print("  length framer across reads")
+# A one byte length at offset 0 counting the bytes after it.  The
+# frame is written in two pieces, nothing may be sent until the
+# second piece completes it.
+ser2net, io1, io2 = utils.setup_2_ser2net(utils.o,
+              ("connection: &con",
+               "  accepter: tcp,3023",
+               "  connector: serialdev,/dev/ttyPipeA0,9600N81",
+               "  options:",
+               "    chardelay-max: 5000000",
+               "    framer: length,0,1,1"),
+              "tcp,localhost,3023",
+              "serialdev,/dev/ttyPipeB0,9600N81")
+try:
+    io1.handler.set_compare(b"\x05hello")
+    io2.handler.set_write_data(b"\x05he")
+    if io1.handler.wait_timeout(250) != 0:
+        raise Exception("length framer: Sent a partial frame")
+    io2.handler.set_write_data(b"llo")
+    if io1.handler.wait_timeout(1000) == 0:
+        raise Exception("length framer: Timed out waiting for the frame")
+finally:
+    utils.finish_2_ser2net(ser2net, io1, io2)
+
+print("  delim framer with two delimiters")
+ser2net, io1, io2 = utils.setup_2_ser2net(utils.o,
+              ("connection: &con",
+               "  accepter: tcp,3023",
+               "  connector: serialdev,/dev/ttyPipeA0,9600N81",
+               "  options:",
+               "    chardelay-max: 5000000",
+               "    framer: \"delim,\\\\r\\\\n,\\\\x03\""),
+              "tcp,localhost,3023",
+              "serialdev,/dev/ttyPipeB0,9600N81")
+try:
+    io1.handler.set_compare(b"one\r\ntwo\x03")
+    io2.handler.set_write_data(b"one\r\ntwo\x03thr")
+    if io1.handler.wait_timeout(1000) == 0:
+        raise Exception("delim framer: Timed out waiting for the frames")
+    # "thr" has no delimiter yet, so it must be held.
+    io1.handler.set_compare(b"thr")
+    if io1.handler.wait_timeout(250) != 0:
+        raise Exception("delim framer: Sent a partial frame")
+finally:
+    utils.finish_2_ser2net(ser2net, io1, io2)
+
 print("  Success!")
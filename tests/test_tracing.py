@@ -4,6 +4,7 @@ import utils
 from serialsim import *
 import tempfile
 import os
+import struct
 
 from dataxfer import test_one_xfer
 
@@ -20,6 +21,28 @@ def validate_file_contents(test, fn, contents):
         raise Exception("%s: expected contents '%s', got '%s'" %
                         (test, contents, a))
 
+def validate_pcap_contents(test, fn, tag, contents):
+    f = open(fn, "rb")
+    a = f.read()
+    f.close()
+    if len(a) < 24:
+        raise Exception("%s: pcap file too short" % test)
+    (magic, major, minor, zone, sigfigs, snaplen,
+     linktype) = struct.unpack("=IHHiIII", a[0:24])
+    if magic != 0xa1b2c3d4 or linktype != 147:
+        raise Exception("%s: invalid pcap header" % test)
+    pos = 24
+    data = b""
+    while pos < len(a):
+        (secs, usecs, incl, orig) = struct.unpack("=IIII", a[pos:pos + 16])
+        pos += 16
+        if a[pos] == tag:
+            data += a[pos + 1:pos + incl]
+        pos += incl
+    if data != contents.encode():
+        raise Exception("%s: expected contents '%s', got '%s'" %
+                        (test, contents, data))
+
 temp1 = gettempfile()
 try:
     temp2 = gettempfile()
@@ -165,6 +188,23 @@ try:
     os.truncate(temp1, 0)
     os.truncate(temp3, 0)
 
+    test_one_xfer("trace pcap", "Testing Trace Pcap Write!",
+                  "Testing Trace Pcap Read!",
+                  ("connection: &con",
+                   "  accepter: tcp,3023",
+                   "  connector: serialdev,/dev/ttyPipeA0,9600N81",
+                   "  options:",
+                   "    trace-pcap: true",
+                   "    trace-both: %s" % temp1),
+                   "tcp,localhost,3023",
+                   "serialdev,/dev/ttyPipeB0,9600N81")
+
+    validate_pcap_contents("trace_pcap/r", temp1, 0,
+                           "Testing Trace Pcap Read!")
+    validate_pcap_contents("trace_pcap/w", temp1, 1,
+                           "Testing Trace Pcap Write!")
+    os.truncate(temp1, 0)
+
     print("  Success!")
 
 finally:
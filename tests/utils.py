@@ -793,3 +793,72 @@ if not srcdir:
 
 def remote_id_int(io):
     return int(io.control(0, True, gensio.GENSIO_CONTROL_REMOTE_ID, None))
+
+class Ser2netController:
+    """A connection to the ser2net admin port
+
+    This talks to the admin interface over a plain socket, which is
+    fine because ser2net runs in its own process.  Reads block until
+    ser2net sends what is waited for or timeout seconds pass.
+    """
+
+    def __init__(self, port, timeout = 5):
+        import socket
+        self.s = socket.create_connection(("localhost", port),
+                                          timeout = timeout)
+        self.buf = b""
+        self.read_until("-> ")
+        return
+
+    def read_until(self, s):
+        """Return everything up to and including s"""
+        s = bytes(s, "utf8")
+        while s not in self.buf:
+            data = self.s.recv(65536)
+            if not data:
+                raise Exception("controller: connection closed waiting for "
+                                + str(s))
+            self.buf += data
+        idx = self.buf.index(s) + len(s)
+        out = self.buf[:idx]
+        self.buf = self.buf[idx:]
+        return str(out, "utf8", "replace")
+
+    def read_len(self, count):
+        """Return the next count bytes"""
+        while len(self.buf) < count:
+            data = self.s.recv(65536)
+            if not data:
+                raise Exception("controller: connection closed reading data")
+            self.buf += data
+        out = self.buf[:count]
+        self.buf = self.buf[count:]
+        return str(out, "utf8", "replace")
+
+    def send(self, s):
+        self.s.sendall(bytes(s + "\r\n", "utf8"))
+        return
+
+    def drain(self, idle = 0.5):
+        """Throw away input until nothing comes for idle seconds"""
+        import socket
+        timeout = self.s.gettimeout()
+        self.s.settimeout(idle)
+        try:
+            while self.s.recv(65536):
+                pass
+        except socket.timeout:
+            pass
+        finally:
+            self.s.settimeout(timeout)
+        self.buf = b""
+        return
+
+    def cmd(self, s):
+        """Run a command and return its output, up to the next prompt"""
+        self.send(s)
+        return self.read_until("-> ")
+
+    def close(self):
+        self.s.close()
+        return
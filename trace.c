@@ -33,141 +33,503 @@
 #include <fcntl.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
 #include "ser2net.h"
 #include "port.h"
 
+/*
+ * Trace data is not written to the file from the data path, it is
+ * appended to a buffer for the file and a writer (a thread if we have
+ * them, a runner if not) writes it out.  That way a slow trace file
+ * does not hold up the port.  If the buffer fills up, the new data is
+ * dropped and counted, and the count is logged by the writer.
+ *
+ * Each file has its own lock for its buffer, so ports tracing to
+ * different files don't contend.  trace_pending_lock only covers the
+ * list of files waiting for the writer.  The file lock is taken
+ * before trace_pending_lock.
+ */
+#define TRACE_BUFSIZE	131072
+
+struct trace_file {
+#ifdef USE_PTHREADS
+    pthread_mutex_t lock;
+#endif
+    int fd;
+    char *name;
+
+    /* Data waiting to be written, filled from the data path. */
+    unsigned char *buf;
+    gensiods len;
+
+    /* Data being written by the writer. */
+    unsigned char *wbuf;
+
+    gensiods dropped;	/* Bytes dropped since the last report. */
+    gensiods total_dropped; /* Bytes dropped since the file was opened. */
+
+    /*
+     * For pcap files, the realtime and monotonic clocks when the file
+     * was opened.  Record times are the realtime base plus the
+     * monotonic time since, so they never go backwards.
+     */
+    bool pcap;
+    struct timespec real_base;
+    struct timespec mono_base;
+
+    bool queued;	/* On the pending list, under trace_pending_lock. */
+    bool closing;	/* Close and free once everything is written. */
+    struct trace_file *next;
+};
+
+static struct trace_file *trace_pending;
+static struct trace_file *trace_pending_tail;
+
+#ifdef USE_PTHREADS
+static pthread_mutex_t trace_pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t trace_thread;
+static bool trace_thread_running;
+static bool trace_thread_stop;
+
+#define trace_file_lock(f)	pthread_mutex_lock(&(f)->lock)
+#define trace_file_unlock(f)	pthread_mutex_unlock(&(f)->lock)
+#define trace_pending_lock()	pthread_mutex_lock(&trace_pending_lock)
+#define trace_pending_unlock()	pthread_mutex_unlock(&trace_pending_lock)
+#define trace_wake()		pthread_cond_signal(&trace_cond)
+#else
+static struct gensio_runner *trace_runner;
+
+#define trace_file_lock(f)	do { } while (0)
+#define trace_file_unlock(f)	do { } while (0)
+#define trace_pending_lock()	do { } while (0)
+#define trace_pending_unlock()	do { } while (0)
+#define trace_wake()		so->run(trace_runner)
+#endif
+
+/* Write out the whole buffer, closing the file on an error. */
+static void
+trace_file_write(struct trace_file *f, const unsigned char *buf,
+		 gensiods len)
+{
+    ssize_t rv;
+
+    while (len > 0 && f->fd != -1) {
+	rv = write(f->fd, buf, len);
+	if (rv == -1) {
+	    char errbuf[128];
+	    int err = errno;
+
+	    if (err == EINTR)
+		continue;
+
+	    /* Fatal error writing to the file, log it and close the file. */
+
+	    if (strerror_r(err, errbuf, sizeof(errbuf)) == -1)
+		syslog(LOG_ERR, "Unable write to trace file %s: %d",
+		       f->name, err);
+	    else
+		syslog(LOG_ERR, "Unable to write to trace file %s: %s",
+		       f->name, errbuf);
+
+	    close(f->fd);
+	    f->fd = -1;
+	    return;
+	}
+
+	/* Handle a partial write */
+	len -= rv;
+	buf += rv;
+    }
+}
+
+/*
+ * Write everything buffered for the file.  Only the writer calls
+ * this, the file lock is just held to swap the buffers.
+ */
+static void
+trace_file_flush(struct trace_file *f)
+{
+    unsigned char *buf;
+    gensiods len, dropped;
+
+    trace_file_lock(f);
+    while (f->len || f->dropped) {
+	buf = f->buf;
+	f->buf = f->wbuf;
+	f->wbuf = buf;
+	len = f->len;
+	f->len = 0;
+	dropped = f->dropped;
+	f->dropped = 0;
+	trace_file_unlock(f);
+
+	if (dropped)
+	    syslog(LOG_WARNING, "Trace file %s too slow, dropped %lu bytes",
+		   f->name, (unsigned long) dropped);
+	trace_file_write(f, buf, len);
+
+	trace_file_lock(f);
+    }
+    trace_file_unlock(f);
+}
+
+static void
+trace_file_free(struct trace_file *f)
+{
+    if (f->fd != -1)
+	close(f->fd);
+    free(f->name);
+    free(f->buf);
+    free(f->wbuf);
+#ifdef USE_PTHREADS
+    pthread_mutex_destroy(&f->lock);
+#endif
+    free(f);
+}
+
+/*
+ * Handle the pending files.  Must be called with trace_pending_lock
+ * held, it is released while flushing.
+ */
+static void
+trace_run_pending(void)
+{
+    struct trace_file *f;
+    bool closing;
+
+    while (trace_pending) {
+	f = trace_pending;
+	trace_pending = f->next;
+	if (!trace_pending)
+	    trace_pending_tail = NULL;
+	f->queued = false;
+	trace_pending_unlock();
+
+	trace_file_flush(f);
+	trace_file_lock(f);
+	closing = f->closing;
+	trace_file_unlock(f);
+
+	trace_pending_lock();
+	/* If it was queued again while flushing, free it later. */
+	if (closing && !f->queued)
+	    trace_file_free(f);
+    }
+}
+
+/* Must be called with the file lock held. */
+static void
+trace_file_queue(struct trace_file *f)
+{
+    trace_pending_lock();
+    if (!f->queued) {
+	f->queued = true;
+	f->next = NULL;
+	if (trace_pending_tail)
+	    trace_pending_tail->next = f;
+	else
+	    trace_pending = f;
+	trace_pending_tail = f;
+	trace_wake();
+    }
+    trace_pending_unlock();
+}
+
+#ifdef USE_PTHREADS
+static void *
+trace_writer(void *dummy)
+{
+    trace_pending_lock();
+    for (;;) {
+	trace_run_pending();
+	if (trace_thread_stop)
+	    break;
+	pthread_cond_wait(&trace_cond, &trace_pending_lock);
+    }
+    trace_pending_unlock();
+    return NULL;
+}
+
+/* Must be called with trace_pending_lock held. */
+static void
+trace_start_writer(void)
+{
+    int rv;
+
+    if (trace_thread_running)
+	return;
+
+    rv = pthread_create(&trace_thread, NULL, trace_writer, NULL);
+    if (rv)
+	/* Things will still get written at shutdown. */
+	syslog(LOG_ERR, "Unable to start trace writer thread: %s",
+	       strerror(rv));
+    else
+	trace_thread_running = true;
+}
+#else
+static void
+trace_writer(struct gensio_runner *runner, void *cb_data)
+{
+    trace_pending_lock();
+    trace_run_pending();
+    trace_pending_unlock();
+}
+
+#define trace_start_writer() do { } while (0)
+#endif
+
+/*
+ * Add a header and data to the file's buffer to be written by the
+ * writer.  Either both go in or both are dropped, so records are
+ * never split.
+ */
+static void
+trace_out_rec(struct trace_file *f, const void *hdr, gensiods hdrlen,
+	      const void *data, gensiods len)
+{
+    if (hdrlen + len == 0)
+	return;
+
+    trace_file_lock(f);
+    if (f->fd == -1) {
+	/* The file got an error, just throw the data away. */
+    } else if (TRACE_BUFSIZE - f->len < hdrlen + len) {
+	f->dropped += hdrlen + len;
+	f->total_dropped += hdrlen + len;
+	trace_file_queue(f);
+    } else {
+	memcpy(f->buf + f->len, hdr, hdrlen);
+	f->len += hdrlen;
+	memcpy(f->buf + f->len, data, len);
+	f->len += len;
+	trace_file_queue(f);
+    }
+    trace_file_unlock(f);
+}
+
+/* Add data to the file's buffer to be written by the writer. */
+static void
+trace_out(struct trace_file *f, const void *data, gensiods len)
+{
+    trace_out_rec(f, data, len, NULL, 0);
+}
+
+/*
+ * pcap files use a user link type.  Each packet starts with a one
+ * byte tag saying what it is, followed by the data.
+ */
+#define PCAP_MAGIC		0xa1b2c3d4 /* Microsecond timestamps. */
+#define PCAP_SNAPLEN		262144
+#define PCAP_LINKTYPE_USER0	147
+
+#define PCAP_TAG_DEV		0 /* Data read from the device. */
+#define PCAP_TAG_NET		1 /* Data read from the network. */
+#define PCAP_TAG_EVENT		2 /* Open/close text. */
+
+struct pcap_file_hdr {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_rec_hdr {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+    uint8_t tag;
+} __attribute__((packed));
+
+static void
+trace_write_pcap_hdr(struct trace_file *f)
+{
+    struct pcap_file_hdr hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = PCAP_MAGIC;
+    hdr.version_major = 2;
+    hdr.version_minor = 4;
+    hdr.snaplen = PCAP_SNAPLEN;
+    hdr.linktype = PCAP_LINKTYPE_USER0;
+    trace_out(f, &hdr, sizeof(hdr));
+}
+
+static void
+trace_write_pcap(struct trace_file *f, uint8_t tag,
+		 const void *buf, gensiods buf_len)
+{
+    struct pcap_rec_hdr hdr;
+    struct timespec now;
+    int64_t usecs;
+
+    if (buf_len > PCAP_SNAPLEN - 1)
+	buf_len = PCAP_SNAPLEN - 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    usecs = ((int64_t) (now.tv_sec - f->mono_base.tv_sec) * 1000000 +
+	     (now.tv_nsec - f->mono_base.tv_nsec) / 1000 +
+	     f->real_base.tv_nsec / 1000);
+
+    hdr.ts_sec = f->real_base.tv_sec + usecs / 1000000;
+    hdr.ts_usec = usecs % 1000000;
+    hdr.incl_len = buf_len + 1;
+    hdr.orig_len = buf_len + 1;
+    hdr.tag = tag;
+    trace_out_rec(f, &hdr, sizeof(hdr), buf, buf_len);
+}
+
+static const char hexdigits[] = "0123456789abcdef";
+
+/* What to print for each byte in the ASCII part of a hexdump. */
+static char printable[256];
+
 static int
 timestamp(trace_info_t *t, char *buf, int size)
 {
     time_t result;
+    struct tm tm;
+
     if (!t->timestamp)
         return 0;
     result = time(NULL);
-    return strftime(buf, size, "%Y/%m/%d %H:%M:%S ", localtime(&result));
+    if (t->ts_len == 0 || result != t->ts_time) {
+	/* Only reformat the time when the second changes. */
+	t->ts_len = strftime(t->ts_str, sizeof(t->ts_str),
+			     "%Y/%m/%d %H:%M:%S ", localtime_r(&result, &tm));
+	t->ts_time = result;
+    }
+    if (t->ts_len > size)
+	return 0;
+    memcpy(buf, t->ts_str, t->ts_len);
+    return t->ts_len;
 }
 
-static int
-trace_write_end(char *out, int size, const unsigned char *start, int col)
+/*
+ * Output a block as a hexdump, 8 bytes per line.  Lines are formatted
+ * into one buffer and handed to the writer together.
+ */
+static void
+trace_write_hexdump(trace_info_t *t, const unsigned char *buf,
+		    gensiods buf_len, const char *prefix)
 {
-    int pos = 0, w;
+    char out[4096];
+    gensiods q;
+    int pos = 0, col, n, prefixlen = strlen(prefix);
+    int linemax = sizeof(t->ts_str) + prefixlen + 1 + 8 * 3 + 8 + 4;
+
+    if (linemax > sizeof(out))
+	return;
+
+    while (buf_len > 0) {
+	if (pos > sizeof(out) - linemax) {
+	    trace_out(t->file, out, pos);
+	    pos = 0;
+	}
+
+	pos += timestamp(t, out + pos, sizeof(out) - pos);
+	memcpy(out + pos, prefix, prefixlen);
+	pos += prefixlen;
+	out[pos++] = ' ';
 
-    strncat(out, " |", size - pos);
-    pos += 2;
-    for(w = 0; w < col; w++) {
-        pos += snprintf(out + pos, size - pos, "%c",
-			isprint(start[w]) ? start[w] : '.');
+	n = buf_len < 8 ? buf_len : 8;
+	for (col = 0; col < n; col++) {
+	    out[pos++] = hexdigits[buf[col] >> 4];
+	    out[pos++] = hexdigits[buf[col] & 0xf];
+	    out[pos++] = ' ';
+	}
+	for (; col < 8; col++) {
+	    out[pos++] = ' ';
+	    out[pos++] = ' ';
+	    out[pos++] = ' ';
+	}
+
+	out[pos++] = ' ';
+	out[pos++] = '|';
+	for (q = 0; q < n; q++)
+	    out[pos++] = printable[buf[q]];
+	out[pos++] = '|';
+	out[pos++] = '\n';
+
+	buf += n;
+	buf_len -= n;
     }
-    strncat(out + pos, "|\n", size - pos);
-    pos += 2;
-    return pos;
+
+    trace_out(t->file, out, pos);
 }
 
-static int
+static void
 trace_write(port_info_t *port, trace_info_t *t, const unsigned char *buf,
 	    gensiods buf_len, const char *prefix)
 {
-    int rv = 0, w, col = 0, pos, file = t->fd;
-    gensiods q;
-    static char out[1024];
-    const unsigned char *start;
-
     if (buf_len == 0)
-        return 0;
-
-    if (!t->hexdump)
-        return write(file, buf, buf_len);
-
-    pos = timestamp(t, out, sizeof(out));
-    pos += snprintf(out + pos, sizeof(out) - pos, "%s ", prefix);
-
-    start = buf;
-    for (q = 0; q < buf_len; q++) {
-        pos += snprintf(out + pos, sizeof(out) - pos, "%02x ", buf[q]);
-        col++;
-        if (col >= 8) {
-            trace_write_end(out + pos, sizeof(out) - pos, start, col);
-            rv = write(file, out, strlen(out));
-            if (rv < 0)
-                return rv;
-            pos = timestamp(t, out, sizeof(out));
-            pos += snprintf(out + pos, sizeof(out) - pos, "%s ", prefix);
-            col = 0;
-            start = buf + q + 1;
-        }
-    }
-    if (col > 0) {
-        for (w = 8; w > col; w--) {
-            strncat(out + pos, "   ", sizeof(out) - pos);
-            pos += 3;
-        }
-        trace_write_end(out + pos, sizeof(out) - pos, start, col);
-        rv = write(file, out, strlen(out));
-        if (rv < 0)
-            return rv;
-    }
-    return buf_len;
+        return;
+
+    if (t->file->pcap)
+	/* prefix is SERIAL or NET from dataxfer.c. */
+	trace_write_pcap(t->file, strcmp(prefix, "term") == 0 ?
+			 PCAP_TAG_DEV : PCAP_TAG_NET, buf, buf_len);
+    else if (t->hexdump)
+	trace_write_hexdump(t, buf, buf_len, prefix);
+    else
+        trace_out(t->file, buf, buf_len);
 }
 
 void
 do_trace(port_info_t *port, trace_info_t *t, const unsigned char *buf,
 	 gensiods buf_len, const char *prefix)
 {
-    int rv;
-
-    while (buf_len > 0) {
-    retry_write:
-	rv = trace_write(port, t, buf, buf_len, prefix);
-	if (rv == -1) {
-	    char errbuf[128];
-	    int err = errno;
-
-	    if (err == EINTR)
-		goto retry_write;
-
-	    /* Fatal error writing to the file, log it and close the file. */
-
-	    if (strerror_r(err, errbuf, sizeof(errbuf)) == -1)
-		syslog(LOG_ERR, "Unable write to trace file on port %s: %d",
-		       port->name, err);
-	    else
-		syslog(LOG_ERR, "Unable to write to trace file on port %s: %s",
-		       port->name, errbuf);
+    if (t->file)
+	trace_write(port, t, buf, buf_len, prefix);
+}
 
-	    close(t->fd);
-	    t->fd = -1;
-	    return;
-	}
+static void
+hf_out_one(trace_info_t *t, char *buf, int len, int tslen)
+{
+    if (!t->file)
+	return;
 
-	/* Handle a partial write */
-	buf_len -= rv;
-	buf += rv;
-    }
+    /* pcap files have their own timestamps, they always get events. */
+    if (t->file->pcap)
+	trace_write_pcap(t->file, PCAP_TAG_EVENT, buf + tslen, len - tslen);
+    else if (t->timestamp)
+	trace_out(t->file, buf, len);
 }
 
+/* buf holds a timestamp of tslen bytes followed by the event text. */
 static void
-hf_out(port_info_t *port, char *buf, int len)
+hf_out(port_info_t *port, char *buf, int len, int tslen)
 {
-    if (port->tr && port->tr->timestamp)
-        write_ignore_fail(port->tr->fd, buf, len);
+    if (port->tr)
+        hf_out_one(port->tr, buf, len, tslen);
 
     /* don't output to write file if it's the same as read file */
-    if (port->tw && port->tw != port->tr && port->tw->timestamp)
-        write_ignore_fail(port->tw->fd, buf, len);
+    if (port->tw && port->tw != port->tr)
+        hf_out_one(port->tw, buf, len, tslen);
 
     /* don't output to both file if it's the same as read or write file */
-    if (port->tb && port->tb != port->tr && port->tb != port->tw
-		&& port->tb->timestamp)
-        write_ignore_fail(port->tb->fd, buf, len);
+    if (port->tb && port->tb != port->tr && port->tb != port->tw)
+        hf_out_one(port->tb, buf, len, tslen);
 }
 
 void
 header_trace(port_info_t *port, net_info_t *netcon)
 {
     char buf[1024];
-    trace_info_t tr = { 1, 1, NULL, -1 };
-    gensiods len = 0;
+    trace_info_t tr = { .hexdump = 1, .timestamp = 1 };
+    gensiods len = 0, tslen;
 
     len += timestamp(&tr, buf, sizeof(buf));
+    tslen = len;
     if (sizeof(buf) > len)
 	len += snprintf(buf + len, sizeof(buf) - len, "OPEN (");
     if (sizeof(buf) > len)
@@ -175,22 +537,23 @@ header_trace(port_info_t *port, net_info_t *netcon)
     if (sizeof(buf) > len)
 	len += snprintf(buf + len, sizeof(buf) - len, ")\n");
 
-    hf_out(port, buf, len);
+    hf_out(port, buf, len, tslen);
 }
 
 void
 footer_trace(port_info_t *port, char *type, const char *reason)
 {
     char buf[1024];
-    trace_info_t tr = { 1, 1, NULL, -1 };
-    int len = 0;
+    trace_info_t tr = { .hexdump = 1, .timestamp = 1 };
+    int len = 0, tslen;
 
     len += timestamp(&tr, buf, sizeof(buf));
+    tslen = len;
     if (sizeof(buf) > len)
 	len += snprintf(buf + len, sizeof(buf) - len,
 			"CLOSE %s (%s)\n", type, reason);
 
-    hf_out(port, buf, len);
+    hf_out(port, buf, len, tslen);
 }
 
 static void
@@ -201,11 +564,28 @@ open_trace_file(port_info_t *port,
 {
     int rv;
     char *trfile;
+    struct trace_file *f;
 
+    t->file = NULL;
     trfile = process_str_to_str(port, NULL, t->filename, tv, NULL, 1);
     if (!trfile) {
 	syslog(LOG_ERR, "Unable to translate trace file %s", t->filename);
-	t->fd = -1;
+	return;
+    }
+
+    f = calloc(1, sizeof(*f));
+    if (f) {
+	f->buf = malloc(TRACE_BUFSIZE);
+	f->wbuf = malloc(TRACE_BUFSIZE);
+    }
+    if (!f || !f->buf || !f->wbuf) {
+	syslog(LOG_ERR, "Out of memory allocating trace file %s", trfile);
+	if (f) {
+	    free(f->buf);
+	    free(f->wbuf);
+	    free(f);
+	}
+	free(trfile);
 	return;
     }
 
@@ -222,9 +602,45 @@ open_trace_file(port_info_t *port,
 		   trfile, errbuf);
     }
 
-    free(trfile);
-    t->fd = rv;
+#ifdef USE_PTHREADS
+    pthread_mutex_init(&f->lock, NULL);
+#endif
+    f->fd = rv;
+    f->name = trfile;
+    t->file = f;
     *out = t;
+
+    if (t->pcap) {
+	struct stat st;
+
+	f->pcap = true;
+	clock_gettime(CLOCK_REALTIME, &f->real_base);
+	clock_gettime(CLOCK_MONOTONIC, &f->mono_base);
+	/* Only a new file gets a header, otherwise we are appending. */
+	if (rv != -1 && fstat(rv, &st) == 0 && st.st_size == 0)
+	    trace_write_pcap_hdr(f);
+    }
+
+    trace_pending_lock();
+    trace_start_writer();
+    trace_pending_unlock();
+}
+
+/* Let the writer finish the file and free it. */
+static void
+close_trace_file(port_info_t *port, trace_info_t *t)
+{
+    struct trace_file *f = t->file;
+
+    if (!f)
+	return;
+
+    t->file = NULL;
+    trace_file_lock(f);
+    port->stats.trace_dropped += f->total_dropped;
+    f->closing = true;
+    trace_file_queue(f);
+    trace_file_unlock(f);
 }
 
 void
@@ -265,18 +681,73 @@ setup_trace(port_info_t *port)
 void
 shutdown_trace(port_info_t *port)
 {
-    if (port->trace_write.fd != -1) {
-	close(port->trace_write.fd);
-	port->trace_write.fd = -1;
-    }
-    if (port->trace_read.fd != -1) {
-	close(port->trace_read.fd);
-	port->trace_read.fd = -1;
-    }
-    if (port->trace_both.fd != -1) {
-	close(port->trace_both.fd);
-	port->trace_both.fd = -1;
-    }
+    close_trace_file(port, &port->trace_write);
+    close_trace_file(port, &port->trace_read);
+    close_trace_file(port, &port->trace_both);
 
     port->tw = port->tr = port->tb = NULL;
 }
+
+static unsigned long
+trace_file_dropped(struct trace_file *f)
+{
+    unsigned long dropped;
+
+    if (!f)
+	return 0;
+    trace_file_lock(f);
+    dropped = f->total_dropped;
+    trace_file_unlock(f);
+    return dropped;
+}
+
+unsigned long
+trace_dropped(port_info_t *port)
+{
+    return (port->stats.trace_dropped +
+	    trace_file_dropped(port->trace_write.file) +
+	    trace_file_dropped(port->trace_read.file) +
+	    trace_file_dropped(port->trace_both.file));
+}
+
+int
+init_tracing(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(printable); i++)
+	printable[i] = isprint(i) ? i : '.';
+
+#ifndef USE_PTHREADS
+    trace_runner = so->alloc_runner(so, trace_writer, NULL);
+    if (!trace_runner)
+	return ENOMEM;
+#endif
+    return 0;
+}
+
+/* Write out everything still buffered and stop the writer. */
+void
+shutdown_tracing(void)
+{
+#ifdef USE_PTHREADS
+    trace_pending_lock();
+    if (!trace_thread_running) {
+	trace_run_pending();
+	trace_pending_unlock();
+	return;
+    }
+    trace_thread_stop = true;
+    trace_wake();
+    trace_pending_unlock();
+    pthread_join(trace_thread, NULL);
+    trace_thread_running = false;
+    trace_thread_stop = false;
+#else
+    if (trace_runner) {
+	trace_run_pending();
+	so->free_runner(trace_runner);
+	trace_runner = NULL;
+    }
+#endif
+}
@@ -39,7 +39,9 @@
 #include "ser2net.h"
 #include "dataxfer.h"
 #include "readconfig.h"
+#include "defaults.h"
 #include "led.h"
+#include "metrics.h"
 
 //#define DEBUG 1
 
@@ -104,20 +106,54 @@ enum ystate {
     END_DOC
 };
 
-struct alias {
+/*
+ * Aliases and included files are looked up by name in hash tables,
+ * generated configs can have thousands of them and reference them
+ * all over the place.
+ */
+struct yhash_ent {
     char *name;
-    char *value;
     unsigned int namelen;
-    struct alias *next;
+    unsigned int hash;
+    struct yhash_ent *next;
+};
+
+struct yhash {
+    struct yhash_ent **table;
+    unsigned int size; /* Always a power of 2. */
+    unsigned int count;
+};
+
+struct alias {
+    struct yhash_ent h; /* Must be first. */
+    char *value;
+    unsigned int valuelen;
 };
 
+/*
+ * Included files are cached across config reads.  The stat
+ * information is checked the first time a file is used in each read,
+ * if it has changed the file is read again.  Files that are not used
+ * in a read are dropped at the end of it.
+ */
 struct yfile {
-    char *name;
+    struct yhash_ent h; /* Must be first. */
     char *value;
-    unsigned int namelen;
-    struct yfile *next;
+    unsigned int valuelen;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    time_t ctime;
+#ifdef linux
+    long mtime_nsec;
+#endif
+    unsigned int used_gen;
 };
 
+static struct yhash yfile_cache;
+static unsigned int yfile_gen;
+
 struct scalar_next_state;
 
 struct option_info {
@@ -184,9 +220,7 @@ struct yconf {
     unsigned int curr_option;
     unsigned int options_len;
 
-    struct alias *aliases;
-
-    struct yfile *files;
+    struct yhash aliases;
 
     yaml_parser_t parser;
     yaml_event_t e;
@@ -265,15 +299,90 @@ yconf_cleanup_main(struct yconf *y)
     y->curr_connection = 0;
 }
 
+static unsigned int
+yhash_str(const char *s, unsigned int len)
+{
+    unsigned int h = 2166136261U; /* FNV-1a */
+
+    while (len-- > 0) {
+	h ^= (unsigned char) *s++;
+	h *= 16777619U;
+    }
+    return h;
+}
+
+static struct yhash_ent *
+yhash_find(struct yhash *t, const char *name, unsigned int len)
+{
+    struct yhash_ent *e;
+    unsigned int h;
+
+    if (!t->table)
+	return NULL;
+
+    h = yhash_str(name, len);
+    for (e = t->table[h & (t->size - 1)]; e; e = e->next) {
+	if (e->hash == h && e->namelen == len &&
+		strncmp(e->name, name, len) == 0)
+	    return e;
+    }
+    return NULL;
+}
+
+/*
+ * Add an entry, e->name and e->namelen must be set.  The table is
+ * doubled when it gets full, if that fails the chains just get
+ * longer.
+ */
+static int
+yhash_add(struct yhash *t, struct yhash_ent *e)
+{
+    unsigned int i, size;
+    struct yhash_ent **table, *n;
+
+    if (!t->table || t->count >= t->size) {
+	size = t->size ? t->size * 2 : 64;
+	table = calloc(size, sizeof(*table));
+	if (!table) {
+	    if (!t->table)
+		return ENOMEM;
+	} else {
+	    for (i = 0; i < t->size; i++) {
+		while (t->table[i]) {
+		    n = t->table[i];
+		    t->table[i] = n->next;
+		    n->next = table[n->hash & (size - 1)];
+		    table[n->hash & (size - 1)] = n;
+		}
+	    }
+	    free(t->table);
+	    t->table = table;
+	    t->size = size;
+	}
+    }
+
+    e->hash = yhash_str(e->name, e->namelen);
+    e->next = t->table[e->hash & (t->size - 1)];
+    t->table[e->hash & (t->size - 1)] = e;
+    t->count++;
+    return 0;
+}
+
+static void
+yhash_del(struct yhash *t, struct yhash_ent *e)
+{
+    struct yhash_ent **p = &t->table[e->hash & (t->size - 1)];
+
+    while (*p != e)
+	p = &(*p)->next;
+    *p = e->next;
+    t->count--;
+}
+
 static struct alias *
 lookup_alias_len(struct yconf *y, const char *name, unsigned int len)
 {
-    struct alias *a;
-
-    a = y->aliases;
-    while (a && (a->namelen != len || strncmp(a->name, name, len) != 0))
-	a = a->next;
-    return a;
+    return (struct alias *) yhash_find(&y->aliases, name, len);
 }
 
 static struct alias *
@@ -302,7 +411,7 @@ add_alias(struct yconf *y, const char *iname, const char *ivalue)
 
     a = lookup_alias(y, name);
     if (a) {
-	free(a->name);
+	free(name);
 	free(a->value);
     } else {
 	a = malloc(sizeof(*a));
@@ -312,83 +421,204 @@ add_alias(struct yconf *y, const char *iname, const char *ivalue)
 	    errout(y, "Out of memory allocating alias");
 	    return -1;
 	}
-	a->next = y->aliases;
-	y->aliases = a;
+	a->h.name = name;
+	a->h.namelen = strlen(name);
+	if (yhash_add(&y->aliases, &a->h)) {
+	    free(a);
+	    free(name);
+	    free(value);
+	    errout(y, "Out of memory allocating alias table");
+	    return -1;
+	}
     }
-    a->name = name;
     a->value = value;
-    a->namelen = strlen(name);
+    a->valuelen = strlen(value);
     return 0;
 }
 
-static struct yfile *
-lookup_filename_len(struct yconf *y, const char *filename, unsigned int len)
+static void
+free_aliases(struct yconf *y)
 {
-    struct yfile *f = y->files;
-    int infd, rv;
-    char *name, *value = NULL;
-    struct stat stat;
+    struct yhash_ent *e;
+    struct alias *a;
+    unsigned int i;
+
+    for (i = 0; i < y->aliases.size; i++) {
+	while (y->aliases.table[i]) {
+	    e = y->aliases.table[i];
+	    y->aliases.table[i] = e->next;
+	    a = (struct alias *) e;
+	    free(a->h.name);
+	    free(a->value);
+	    free(a);
+	}
+    }
+    free(y->aliases.table);
+    y->aliases.table = NULL;
+    y->aliases.size = 0;
+    y->aliases.count = 0;
+}
 
-    while (f && f->namelen == len && strncmp(f->name, filename, len) != 0)
-	f = f->next;
-    if (f)
-	return f;
+static bool
+yfile_unchanged(struct yfile *f, struct stat *st)
+{
+    return (f->dev == st->st_dev && f->ino == st->st_ino &&
+	    f->size == st->st_size && f->mtime == st->st_mtime &&
+#ifdef linux
+	    f->mtime_nsec == st->st_mtim.tv_nsec &&
+#endif
+	    f->ctime == st->st_ctime);
+}
 
-    name = strndup(filename, len);
-    if (!name) {
-	errout(y, "Out of memory allocating alias name");
-	return NULL;
-    }
+static void
+yfile_set_stat(struct yfile *f, struct stat *st)
+{
+    f->dev = st->st_dev;
+    f->ino = st->st_ino;
+    f->size = st->st_size;
+    f->mtime = st->st_mtime;
+    f->ctime = st->st_ctime;
+#ifdef linux
+    f->mtime_nsec = st->st_mtim.tv_nsec;
+#endif
+}
+
+/*
+ * Read the whole file, returning the contents nil terminated and the
+ * stat information from the open file.
+ */
+static char *
+yfile_read(struct yconf *y, const char *name, struct stat *st)
+{
+    int infd, rv;
+    char *value = NULL;
+    off_t pos = 0;
 
     infd = open(name, O_RDONLY);
     if (infd == -1) {
 	errout(y, "Error opening %s: %s", name, strerror(errno));
-	goto out_err;
+	return NULL;
     }
 
-    rv = fstat(infd, &stat);
+    rv = fstat(infd, st);
     if (rv == -1) {
 	errout(y, "Error stat-ing %s: %s", name, strerror(errno));
 	goto out_err;
     }
 
-    value = malloc(stat.st_size + 1);
+    value = malloc(st->st_size + 1);
     if (!value) {
 	errout(y, "Error allocating memory for file %s", name);
 	goto out_err;
     }
 
-    rv = read(infd, value, stat.st_size);
-    if (rv == -1) {
-	errout(y, "Error reading %s: %s", name, strerror(errno));
-	goto out_err;
+    while (pos < st->st_size) {
+	rv = read(infd, value + pos, st->st_size - pos);
+	if (rv == -1) {
+	    if (errno == EINTR)
+		continue;
+	    errout(y, "Error reading %s: %s", name, strerror(errno));
+	    goto out_err;
+	}
+	if (rv == 0)
+	    break;
+	pos += rv;
+    }
+    value[pos] = '\0';
+    close(infd);
+    return value;
+
+ out_err:
+    if (value)
+	free(value);
+    close(infd);
+    return NULL;
+}
+
+static struct yfile *
+lookup_filename_len(struct yconf *y, const char *filename, unsigned int len)
+{
+    struct yfile *f;
+    char *value;
+    struct stat st;
+
+    f = (struct yfile *) yhash_find(&yfile_cache, filename, len);
+    if (f) {
+	if (f->used_gen == yfile_gen)
+	    return f;
+	if (stat(f->h.name, &st) == 0 && yfile_unchanged(f, &st)) {
+	    f->used_gen = yfile_gen;
+	    return f;
+	}
+
+	/* Changed or gone, get the current contents. */
+	value = yfile_read(y, f->h.name, &st);
+	if (!value)
+	    return NULL;
+	free(f->value);
+	f->value = value;
+	f->valuelen = strlen(value);
+	yfile_set_stat(f, &st);
+	f->used_gen = yfile_gen;
+	return f;
     }
-    value[stat.st_size] = '\0';
 
     f = malloc(sizeof(*f));
     if (!f) {
-	errout(y, "Error allocating memory for file struct %s", name);
-	goto out_err;
+	errout(y, "Error allocating memory for file struct");
+	return NULL;
     }
-    close(infd);
+    f->h.name = strndup(filename, len);
+    if (!f->h.name) {
+	errout(y, "Out of memory allocating file name");
+	free(f);
+	return NULL;
+    }
+    f->h.namelen = len;
+
+    f->value = yfile_read(y, f->h.name, &st);
+    if (!f->value)
+	goto out_err;
+    f->valuelen = strlen(f->value);
+    yfile_set_stat(f, &st);
+    f->used_gen = yfile_gen;
 
-    f->name = name;
-    f->namelen = strlen(name);
-    f->value = value;
-    f->next = y->files;
-    y->files = f;
+    if (yhash_add(&yfile_cache, &f->h)) {
+	errout(y, "Error allocating memory for file table");
+	free(f->value);
+	goto out_err;
+    }
 
     return f;
 
  out_err:
-    if (value)
-	free(value);
-    free(name);
-    if (infd != -1)
-	close(infd);
+    free(f->h.name);
+    free(f);
     return NULL;
 }
 
+/* Drop any cached files that were not used by the last config read. */
+static void
+yfile_cache_prune(void)
+{
+    struct yhash_ent *e, *next;
+    struct yfile *f;
+    unsigned int i;
+
+    for (i = 0; i < yfile_cache.size; i++) {
+	for (e = yfile_cache.table[i]; e; e = next) {
+	    next = e->next;
+	    f = (struct yfile *) e;
+	    if (f->used_gen == yfile_gen)
+		continue;
+	    yhash_del(&yfile_cache, e);
+	    free(f->h.name);
+	    free(f->value);
+	    free(f);
+	}
+    }
+}
+
 static int
 add_option(struct yconf *y, const char *name, const char *option,
 	   const char *place)
@@ -556,13 +786,22 @@ static struct scalar_next_state sc_admin[] = {
     {}
 };
 
+static struct scalar_next_state sc_metrics[] = {
+    { "accepter", IN_MAIN_MAP_KEYVAL, WHICH_INFO_KEYVAL,
+      .keyval_info = &keyval_accepter },
+    { "options", IN_OPTIONS, WHICH_INFO_OPTION,
+      .option_info = &led_option_info },
+    {}
+};
+
 enum main_map_types {
     MAIN_MAP_DEFAULT,
     MAIN_MAP_DELDEFAULT,
     MAIN_MAP_CONNECTION,
     MAIN_MAP_ROTATOR,
     MAIN_MAP_LED,
-    MAIN_MAP_ADMIN
+    MAIN_MAP_ADMIN,
+    MAIN_MAP_METRICS
 };
 
 static struct map_info sc_default_map = {
@@ -589,6 +828,10 @@ static struct map_info sc_admin_map = {
     "admin", sc_admin, MAIN_LEVEL, MAIN_MAP_ADMIN, false
 };
 
+static struct map_info sc_metrics_map = {
+    "metrics", sc_metrics, MAIN_LEVEL, MAIN_MAP_METRICS, false
+};
+
 static struct scalar_next_state sc_main[] = {
     { "define", IN_DEFINE },
     { "default", IN_MAIN_NAME, WHICH_INFO_MAP, .map_info = &sc_default_map },
@@ -599,6 +842,7 @@ static struct scalar_next_state sc_main[] = {
     { "rotator", IN_MAIN_NAME, WHICH_INFO_MAP, .map_info = &sc_rotator_map },
     { "led", IN_MAIN_NAME, WHICH_INFO_MAP, .map_info = &sc_led_map },
     { "admin", IN_MAIN_NAME, WHICH_INFO_MAP, .map_info = &sc_admin_map },
+    { "metrics", IN_MAIN_NAME, WHICH_INFO_MAP, .map_info = &sc_metrics_map },
     {}
 };
 
@@ -654,6 +898,14 @@ process_scalar(struct yconf *y, const char *iscalar)
     unsigned int len = 0, alen;
     int state = 0;
 
+    if (!strchr(iscalar, '*')) {
+	/* Nothing to substitute, the common case. */
+	rv = strdup(iscalar);
+	if (!rv)
+	    errout(y, "Out of memory processing string '%s'", iscalar);
+	return rv;
+    }
+
  restart:
     for (s = iscalar; *s; s++) {
 	if (state == 0) {
@@ -703,7 +955,7 @@ process_scalar(struct yconf *y, const char *iscalar)
 		    errout(y, "unknown alias at '%s'", start - 2);
 		    goto out_err;
 		}
-		alen = strlen(a->value);
+		alen = a->valuelen;
 		if (out) {
 		    memcpy(out, a->value, alen);
 		    out += alen;
@@ -728,7 +980,7 @@ process_scalar(struct yconf *y, const char *iscalar)
 		struct yfile *f = lookup_filename_len(y, start, s - start);
 		if (!f)
 		    goto out_err;
-		alen = strlen(f->value);
+		alen = f->valuelen;
 		if (out) {
 		    memcpy(out, f->value, alen);
 		    out += alen;
@@ -949,7 +1201,7 @@ yhandle_mapping_end(struct yconf *y)
 		errout(y, "No name given in default");
 		return -1;
 	    }
-	    err = gensio_set_default(so, y->class, y->name, y->value, 0);
+	    err = set_config_default(y->class, y->name, y->value);
 	    if (err) {
 		errout(y, "Unable to set default name %s:%s:%s: %s",
 			  y->class ? y->class : "",
@@ -969,7 +1221,7 @@ yhandle_mapping_end(struct yconf *y)
 		errout(y, "No class given in delete_default");
 		return -1;
 	    }
-	    err = gensio_del_default(so, y->class, y->name, false);
+	    err = del_config_default(y->class, y->name);
 	    if (err) {
 		errout(y, "Unable to set default name %s:%s:%s: %s",
 			  y->class ? y->class : "",
@@ -1067,6 +1319,20 @@ yhandle_mapping_end(struct yconf *y)
 	    y->state = MAIN_LEVEL;
 	    yconf_cleanup_main(y);
 	    break;
+
+	case MAIN_MAP_METRICS:
+	    if (!y->accepter) {
+		errout(y, "No accepter given in metrics");
+		return -1;
+	    }
+	    /* NULL terminate the options. */
+	    if (add_option(y, NULL, NULL, "metrics"))
+		return -1;
+	    metrics_init(y->accepter, (const char **) y->options,
+			 &y->sub_errout);
+	    y->state = MAIN_LEVEL;
+	    yconf_cleanup_main(y);
+	    break;
 	}
 	break;
 
@@ -1237,6 +1503,7 @@ yaml_readconfig(FILE *f, char **config_lines, unsigned int num_config_lines,
     y.errout = errout;
     y.sub_errout.out = sub_errout;
     y.sub_errout.data = &y;
+    yfile_gen++;
 
     yaml_parser_initialize(&y.parser);
 
@@ -1347,21 +1614,8 @@ yaml_readconfig(FILE *f, char **config_lines, unsigned int num_config_lines,
     yconf_cleanup_main(&y);
     free(y.options);
     free(y.connections);
-    while (y.aliases) {
-	struct alias *a = y.aliases;
-	y.aliases = a->next;
-	free(a->name);
-	free(a->value);
-	free(a);
-    }
-
-    while (y.files) {
-	struct yfile *f = y.files;
-	y.files = f->next;
-	free(f->name);
-	free(f->value);
-	free(f);
-    }
+    free_aliases(&y);
+    yfile_cache_prune();
 
     return err;
 }